@@ -21,20 +21,37 @@
 
 #include "cifsd.h"
 #include "netlink.h"
+#include "smbconf.h"
+#include "idcache.h"
+#include "pathcheck.h"
+#include "snapshot.h"
+#include "sharereg.h"
+#include "startup.h"
 #include <pwd.h>
+#include <time.h>
+#include <getopt.h>
 
-struct list_head cifsd_share_list;
-int cifsd_num_shares;
+char *cifsd_conf_path = PATH_SHARECONF;
+/* fingerprint of the [global] section last loaded */
+static unsigned long long global_conf_hash;
 
 char workgroup[MAX_SERVER_WRKGRP_LEN];
 char server_string[MAX_SERVER_NAME_LEN];
+unsigned int netlink_batch_size = 1;
+unsigned int ipc_workers;
+unsigned int netlink_rcvbuf;
+unsigned int netlink_sndbuf;
+unsigned int nr_held_shares;
+/* paths of the held back shares, checked by cifsd_retry_held_shares() */
+static char **held_paths;
 
 void usage(void)
 {
 	fprintf(stderr,
 		"cifsd-tools version : %s, date : %s\n"
 		"Usage: cifsd [-h|--help] [-v|--version] [-d |--debug]\n"
-		"       [-c smb.conf|--configure=smb.conf] [-i usrs-db|--import-users=cifspwd.db\n", CIFSD_TOOLS_VERSION, CIFSD_TOOLS_DATE);
+		"       [-c smb.conf|--configure=smb.conf] [-i usrs-db|--import-users=cifspwd.db\n"
+		"       [--startup-profile=profile.json]\n", CIFSD_TOOLS_VERSION, CIFSD_TOOLS_DATE);
 	exit(0);
 }
 
@@ -54,7 +71,10 @@ int cifsd_request_handler(struct nl_sock *nlsock)
 
 	switch (nlh->nlmsg_type) {
 	case CIFSD_UEVENT_CONFIG_USER_RSP:
+	case CIFSD_UEVENT_CONFIG_USERS_RSP:
 	case CIFSD_UEVENT_CONFIG_SHARE_RSP:
+	case CIFSD_UEVENT_CONFIG_SHARES_RSP:
+	case CIFSD_UEVENT_REMOVE_SHARE_RSP:
 		ret = ev->error;
 		break;
 	default:
@@ -66,21 +86,237 @@ int cifsd_request_handler(struct nl_sock *nlsock)
 }
 
 /**
- * config_users() - function to configure cifsd with user accounts from
- *		local database file. cifsd should be live in kernel
- *		else this function fails and displays user message
- *		"cifsd is not available"
+ * config_user_done() - report kernel response to a user config request
  * @nlsock:	netlink socket
+ * @nlh:	response, NULL if none arrived
+ * @priv:	user name, freed here
+ */
+static void config_user_done(struct nl_sock *nlsock, struct nlmsghdr *nlh,
+		void *priv)
+{
+	char *user = (char *)priv;
+	struct cifsd_uevent *ev;
+
+	if (!nlh) {
+		cifsd_err("user[%s] configuration got no response\n", user);
+	} else {
+		ev = NLMSG_DATA(nlh);
+		if (ev->error)
+			cifsd_err("user[%s] configuration failed : %d\n",
+					user, ev->error);
+	}
+	free(user);
+}
+
+/**
+ * config_user_send() - send one user account as a text entry
+ * @nlsock:	netlink socket
+ * @rec:	user record
+ *
+ * The entry is "name:hash" of the user db, followed by ":uid:gid" when
+ * the user has a local account.
+ *
+ * Return:	0 on success, -1 on error
+ */
+static int config_user_send(struct nl_sock *nlsock,
+		const struct cifsd_user_rec *rec)
+{
+	struct cifsd_uevent ev;
+	char *user_entry, *priv;
+	int ent_len, user_len;
+#define UID_BUF_SIZE 14
+
+	ent_len = strlen(rec->name) + 1 + CIFS_NTHASH_SIZE;
+	user_entry = (char *)calloc(1, ent_len + UID_BUF_SIZE);
+	if (!user_entry) {
+		cifsd_err("entry allocation failed\n");
+		return -1;
+	}
+
+	sprintf(user_entry, "%s:", rec->name);
+	memcpy(user_entry + ent_len - CIFS_NTHASH_SIZE, rec->hash,
+			CIFS_NTHASH_SIZE);
+	if (rec->flags & CIFSD_USER_REC_ID)
+		snprintf(user_entry + ent_len, UID_BUF_SIZE, ":%u:%u\n",
+				rec->uid, rec->gid);
+
+	priv = strdup(rec->name);
+	if (!priv) {
+		free(user_entry);
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = CIFSD_KEVENT_CONFIG_USER;
+	user_len = strlen(user_entry);
+	ev.buflen = user_len;
+	if (nl_async_send(nlsock, &ev, user_entry, user_len + 1,
+			CIFSD_UEVENT_CONFIG_USER_RSP,
+			config_user_done, priv) < 0) {
+		cifsd_err("cifsd event sending failed\n");
+		free(priv);
+		free(user_entry);
+		return -1;
+	}
+
+	free(user_entry);
+	return 0;
+}
+
+/* user records collected for one CIFSD_KEVENT_CONFIG_USERS message */
+struct user_batch {
+	unsigned int nr;
+	struct cifsd_user_rec recs[CIFSD_USERS_PER_MSG];
+};
+
+/**
+ * config_users_done() - report per record status of a user batch
+ * @nlsock:	netlink socket
+ * @nlh:	response, NULL if none arrived
+ * @priv:	user batch, freed here
+ */
+static void config_users_done(struct nl_sock *nlsock, struct nlmsghdr *nlh,
+		void *priv)
+{
+	struct user_batch *batch = (struct user_batch *)priv;
+	struct cifsd_uevent *ev = nlh ? NLMSG_DATA(nlh) : NULL;
+	int *status = NULL;
+	unsigned int i;
+	int err;
+
+	/* without per record status the whole batch shares ev->error */
+	if (ev && ev->buflen >= batch->nr * sizeof(int))
+		status = (int *)ev->buffer;
+
+	for (i = 0; i < batch->nr; i++) {
+		if (!ev) {
+			cifsd_err("user[%s] configuration got no response\n",
+					batch->recs[i].name);
+			continue;
+		}
+
+		err = status ? status[i] : ev->error;
+		if (err)
+			cifsd_err("user[%s] configuration failed : %d\n",
+					batch->recs[i].name, err);
+	}
+	free(batch);
+}
+
+/**
+ * config_users_send() - send a batch of user records
+ * @nlsock:	netlink socket
+ * @recs:	user records
+ * @nr:		number of records, at most CIFSD_USERS_PER_MSG
+ *
+ * Return:	0 on success, -1 on error
+ */
+static int config_users_send(struct nl_sock *nlsock,
+		const struct cifsd_user_rec *recs, unsigned int nr)
+{
+	struct user_batch *batch;
+	struct cifsd_uevent ev;
+	int len = nr * sizeof(struct cifsd_user_rec);
+
+	/* records are kept for reporting per record status */
+	batch = malloc(offsetof(struct user_batch, recs) + len);
+	if (!batch)
+		return -1;
+	batch->nr = nr;
+	memcpy(batch->recs, recs, len);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = CIFSD_KEVENT_CONFIG_USERS;
+	ev.buflen = len;
+	ev.u.c_users.nr_users = nr;
+	if (nl_async_send(nlsock, &ev, (char *)batch->recs, len,
+			CIFSD_UEVENT_CONFIG_USERS_RSP,
+			config_users_done, batch) < 0) {
+		cifsd_err("cifsd event sending failed\n");
+		free(batch);
+		return -1;
+	}
+
+	/* keep a window of requests in flight */
+	return nl_async_wait(nlsock, NETLINK_CIFSD_ASYNC_WINDOW) < 0 ? -1 : 0;
+}
+
+/**
+ * user_rec_fill() - fill a fixed layout user record
+ * @rec:	record to fill
+ * @entry:	"name:hash" entry of the user db
+ * @ent_len:	length of @entry
+ * @name:	user name
+ * @id:		local account of the user, NULL if there is none
+ *
+ * Return:	0 on success, -EINVAL if @name does not fit or @entry is
+ *		too short to hold the hash
+ */
+static int user_rec_fill(struct cifsd_user_rec *rec, const char *entry,
+		int ent_len, const char *name, const struct id_entry *id)
+{
+	size_t len = strlen(name);
+
+	if (len >= CIFSD_USERNAME_LEN) {
+		cifsd_err("user[%s] name too long, skipped\n", name);
+		return -EINVAL;
+	}
+
+	if ((size_t)ent_len < len + 1 + CIFS_NTHASH_SIZE) {
+		cifsd_err("user[%s] hash truncated, skipped\n", name);
+		return -EINVAL;
+	}
+
+	memset(rec, 0, sizeof(*rec));
+	memcpy(rec->name, name, len);
+	memcpy(rec->hash, entry + len + 1, CIFS_NTHASH_SIZE);
+	if (id) {
+		rec->flags = CIFSD_USER_REC_ID;
+		rec->uid = id->uid;
+		rec->gid = id->gid;
+	}
+	return 0;
+}
+
+/* user accounts of the user db, in file order */
+struct user_table {
+	struct cifsd_user_rec *recs;
+	unsigned int nr;
+	unsigned int max;
+};
+
+static struct cifsd_user_rec *user_table_add(struct user_table *users)
+{
+	struct cifsd_user_rec *recs;
+	unsigned int max;
+
+	if (users->nr == users->max) {
+		max = users->max ? users->max * 2 : 256;
+		recs = realloc(users->recs, max * sizeof(*recs));
+		if (!recs)
+			return NULL;
+		users->recs = recs;
+		users->max = max;
+	}
+	return &users->recs[users->nr];
+}
+
+/**
+ * load_users() - read user accounts from local database file and
+ *		resolve their local uid and gid
  * @db_path:	username db file path
+ * @users:	user table to fill
  *
  * Return:	success: CIFS_SUCCESS; fail: CIFS_FAIL
  */
-int config_users(struct nl_sock *nlsock, char *db_path)
+static int load_users(char *db_path, struct user_table *users)
 {
 	int eof = 0, db_fd;
-	char *entry, *user_account, *dummy, *user_entry = NULL;
-	struct cifsd_uevent ev;
-	int user_len;
+	char *entry, *user_account, *dummy;
+	const struct id_entry *id;
+	struct cifsd_user_rec *rec;
+	struct id_cache *ids;
+	int ret = CIFS_FAIL;
 
 	db_fd = open(db_path, O_RDONLY);
 	if (db_fd < 0) {
@@ -88,554 +324,1058 @@ int config_users(struct nl_sock *nlsock, char *db_path)
 		return CIFS_FAIL;
 	}
 
+	ids = id_cache_load(PATH_IDCACHE, ID_CACHE_TTL);
+	if (!ids) {
+		cifsd_err("id cache allocation failed\n");
+		close(db_fd);
+		return CIFS_FAIL;
+	}
+
 	while (!eof) {
 		int ent_len;
 
 		ent_len = get_entry(db_fd, &entry, &eof);
 		if (ent_len < 0) {
 			cifsd_err("get_entry failed : %d\n", ent_len);
-			goto out2;
+			goto out;
 		}
 
 		init_2_strings(entry, &user_account, &dummy, ent_len);
 		if (user_account) {
-			struct passwd *passwd = NULL;
-			char *id_buf = NULL;
-			int alloc_size;
-#define UID_BUF_SIZE 14
-
-			alloc_size = ent_len + UID_BUF_SIZE;
-
-			user_entry = (char *)calloc(1, alloc_size);
-			if (!user_entry) {
-				cifsd_err("entry allocation failed\n");
-				goto out;
-			}
-
-			memcpy(user_entry, entry, ent_len);
-			passwd = getpwnam(user_account);
-			if (passwd) {
-				int id_len;
-
-				id_buf = (char *)malloc(UID_BUF_SIZE);
-				if (!id_buf)
-					goto out;
-
-				if (passwd->pw_uid > 65535 ||
-						passwd->pw_gid > 65535) {
-					cifsd_err("over limit uid : %d, gid : %d\n",
-						passwd->pw_uid, passwd->pw_gid);
-					free(id_buf);
-					goto out;
-				}
-
-				id_len = snprintf(id_buf, UID_BUF_SIZE,
-						":%u:%u\n", passwd->pw_uid,
-						passwd->pw_gid);
-				memcpy(user_entry + ent_len, id_buf,
-						id_len);
-				ent_len += id_len;
-				free(id_buf);
+			id = id_cache_lookup(ids, user_account);
+			if (id && (id->uid > 65535 || id->gid > 65535)) {
+				cifsd_err("over limit uid : %u, gid : %u\n",
+					id->uid, id->gid);
+				goto out_free;
 			}
 
-			memset(&ev, 0, sizeof(ev));
-			ev.type = CIFSD_KEVENT_CONFIG_USER;
-			user_len = strlen(user_entry);
-			ev.buflen = user_len;
-			if (cifsd_common_sendmsg(nlsock, &ev, user_entry,
-				user_len + 1) < 0) {
-				cifsd_err("cifsd event sending failed\n");
-				return -1;
-			}
-			nlsock->event_handle_cb = cifsd_request_handler;
-			if (nl_handle_event(nlsock) < 0) {
-				cifsd_err("user[%s] configuration failed\n",
-					user_account);
-			}
+			rec = user_table_add(users);
+			if (!rec)
+				goto out_free;
+			if (!user_rec_fill(rec, entry, ent_len, user_account,
+					id))
+				users->nr++;
 
 			free(user_account);
 			free(dummy);
-			free(user_entry);
 		}
 		free(entry);
 	}
 
-	close(db_fd);
-	return CIFS_SUCCESS;
+	cifsd_debug("id cache : %u hits, %u misses\n", ids->nr_hits,
+			ids->nr_misses);
+	ret = id_cache_save(ids);
+	if (ret)
+		cifsd_debug("id cache %s not saved : %d\n", PATH_IDCACHE, ret);
+	ret = CIFS_SUCCESS;
+	goto out;
 
-out:
+out_free:
 	free(entry);
 	free(user_account);
 	free(dummy);
-	free(user_entry);
-out2:
+out:
 	close(db_fd);
-
-	return CIFS_FAIL;
+	id_cache_free(ids);
+	return ret;
 }
 
 /**
- * alloc_new_share() - allocate new share
+ * config_users() - function to configure cifsd with user accounts.
+ *		cifsd should be live in kernel else this function fails
+ *		and displays user message "cifsd is not available"
+ * @nlsock:	netlink socket
+ * @recs:	user records
+ * @nr:		number of records
+ *
+ * Accounts are packed into page sized CIFSD_KEVENT_CONFIG_USERS
+ * messages when the kernel announced CIFSD_CAP_USER_BATCH, and sent one
+ * CIFSD_KEVENT_CONFIG_USER each otherwise. The capabilities answer early
+ * init ahead of any config response, so they are known once the first
+ * account, sent alone, is acknowledged. They are frozen from then on.
+ * The other requests are left in flight, cifsd_early_setup() waits for
+ * them.
  *
- * Return:	success: allocated share; fail: NULL
+ * Return:	success: CIFS_SUCCESS; fail: CIFS_FAIL
  */
-static struct cifsd_share *alloc_new_share(void)
+int config_users(struct nl_sock *nlsock, const struct cifsd_user_rec *recs,
+		unsigned int nr)
 {
-	struct cifsd_share *share = NULL;
-	share = (struct cifsd_share *) calloc(1,
-			sizeof(struct cifsd_share));
-	if (!share)
-		return NULL;
-
-	share->sharename = (char *) calloc(1, SHARE_MAX_NAME_LEN);
-	if (!share->sharename) {
-		free(share);
-		return NULL;
+	unsigned int i = 0, n;
+
+	nlsock->event_handle_cb = cifsd_request_handler;
+	if (nr && !nlsock->caps_known) {
+		if (config_user_send(nlsock, &recs[0]))
+			goto fail;
+		if (nl_async_wait(nlsock, 0) < 0)
+			goto fail;
+		i = 1;
 	}
+	nl_freeze_caps(nlsock);
+
+	for (; i < nr; i += n) {
+		if (!(nlsock->peer_caps & CIFSD_CAP_USER_BATCH)) {
+			n = 1;
+			if (config_user_send(nlsock, &recs[i]))
+				goto fail;
+			if (nl_async_wait(nlsock,
+					NETLINK_CIFSD_ASYNC_WINDOW) < 0)
+				goto fail;
+			continue;
+		}
 
-	share->config.comment = (char *) calloc(1, SHARE_MAX_COMMENT_LEN);
-	if (!share->config.comment) {
-		free(share->sharename);
-		free(share);
-		return NULL;
+		n = nr - i;
+		if (n > CIFSD_USERS_PER_MSG)
+			n = CIFSD_USERS_PER_MSG;
+		if (config_users_send(nlsock, &recs[i], n))
+			goto fail;
 	}
 
-	INIT_LIST_HEAD(&share->list);
-	return share;
+	startup_count(STARTUP_NR_USERS, nr);
+	return CIFS_SUCCESS;
+
+fail:
+	nl_async_cancel(nlsock);
+	return CIFS_FAIL;
 }
 
 /**
- * add_new_share() - add newly allocated share in global share list
- * @sharename:	share name string
- * @comment:	comment decribing share
+ * new_share_registry() - allocate a share registry holding IPC$
+ *
+ * Return:	registry, NULL on error
  */
-static void add_new_share(char *sharename, char *comment)
+static struct share_registry *new_share_registry(void)
 {
-	struct cifsd_share *share;
-
-	share = (struct cifsd_share *)alloc_new_share();
-	if (!share)
-		return;
+	struct share_registry *reg;
 
-	if (sharename)
-		memcpy(share->sharename, sharename, strlen(sharename));
-
-	if (share->config.comment)
-		memcpy(share->config.comment, comment, strlen(comment));
+	reg = share_registry_alloc();
+	if (!reg)
+		return NULL;
 
-	list_add(&share->list, &cifsd_share_list);
-	cifsd_num_shares++;
+	if (!share_registry_add(reg, STR_IPC, "IPC$ share", 0)) {
+		share_registry_put(reg);
+		return NULL;
+	}
+	return reg;
 }
 
 /**
- * exit_share_config() - destroy share list
+ * exit_share_config() - drop the exported shares
  */
 static void exit_share_config(void)
 {
-	struct cifsd_share *share;
-	struct list_head *tmp, *t;
-
-	list_for_each_safe(tmp, t, &cifsd_share_list) {
-		share = list_entry(tmp, struct cifsd_share, list);
-		list_del(&share->list);
-		cifsd_num_shares--;
-		free(share->config.comment);
-		free(share->sharename);
-		free(share);
-	}
+	share_registry_publish(NULL);
 }
 
 /**
- * init_share_config() - initialize global share list head and
- *			add IPC$ share
+ * init_share_config() - publish a share registry holding IPC$
  */
 static void init_share_config(void)
 {
-	INIT_LIST_HEAD(&cifsd_share_list);
-	add_new_share(STR_IPC, "IPC$ share");
+	share_registry_publish(new_share_registry());
 	strncpy(workgroup, STR_WRKGRP, strlen(STR_WRKGRP));
 	strncpy(server_string, STR_SRV_NAME, strlen(STR_SRV_NAME));
 }
 
 /**
- * parse_global_config() - parse global share config
+ * validate_share_paths() - check if the share paths of a config exist
+ * @conf:	config model
+ *
+ * Paths are checked in parallel, each within PATH_CHECK_TIMEOUT_MS.
  *
- * @src:	source string to be scanned
+ * Return:	per section status, 0 for sections without path, -ETIMEDOUT
+ *		for paths not answering in time; NULL on error
  */
-static void parse_global_config(char *src)
+static int *validate_share_paths(struct cifsd_conf *conf)
 {
-	char *tmp;
-	char *dup;
-	char *conf;
-	char *val;
-	char *sstring = NULL;
-	char *workgrp = NULL;
+	unsigned int i, nr = 0, nr_timedout = 0;
+	unsigned long long start;
+	struct conf_section *sec;
+	struct conf_param *param;
+	const char **paths;
+	unsigned int *secs;
+	int *status, *ret;
+	struct timespec ts;
+
+	ret = calloc(conf->nr_sections, sizeof(int));
+	paths = calloc(conf->nr_sections, sizeof(char *));
+	secs = calloc(conf->nr_sections, sizeof(unsigned int));
+	status = calloc(conf->nr_sections, sizeof(int));
+	if (!ret || !paths || !secs || !status)
+		goto fail;
+
+	for (i = 0; i < conf->nr_sections; i++) {
+		sec = &conf->sections[i];
+		if (sec->flags & CONF_SECTION_GLOBAL)
+			continue;
+		param = conf_find(conf, sec, CONF_PATH);
+		if (!param)
+			continue;
+		paths[nr] = conf_str(conf, param->val);
+		secs[nr++] = i;
+	}
 
-	if (!src)
-		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+	if (path_check(paths, nr, status, PATH_CHECK_TIMEOUT_MS))
+		goto fail;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	tmp = dup = strdup(src);
-	conf = strtok(dup, "<");
-	if (!conf)
-		goto out;
+	for (i = 0; i < nr; i++) {
+		ret[secs[i]] = status[i];
+		if (!status[i])
+			continue;
 
-	do {
-		if (!strncasecmp("server string =", conf, 15)) {
-			val = strchr(conf, '=');
-			if (val)
-				sstring = val + 2;
-		}
-		else if (!strncasecmp("workgroup =", conf, 11)) {
-			val = strchr(conf, '=');
-			if (val)
-				workgrp = val + 2;
+		sec = &conf->sections[secs[i]];
+		if (status[i] == -ETIMEDOUT || status[i] == -EAGAIN) {
+			cifsd_err("share[%s] path %s not responding\n",
+					conf_str(conf, sec->name), paths[i]);
+			ret[secs[i]] = -ETIMEDOUT;
+			nr_timedout++;
+			continue;
 		}
-	}while((conf = strtok(NULL, "<")));
+		fprintf(stderr, "Failed to add SMB %s \t",
+				conf_str(conf, sec->name));
+		fprintf(stderr, "%s: %s\n", paths[i], strerror(-status[i]));
+	}
 
-	if (sstring)
-		strncpy(server_string, sstring, MAX_SERVER_NAME_LEN - 1);
+	cifsd_info("validated %u share paths in %llums, %u not responding\n",
+			nr, ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000 - start,
+			nr_timedout);
+	free(paths);
+	free(secs);
+	free(status);
+	return ret;
 
-	if (workgrp)
-		strncpy(workgroup, workgrp, MAX_SERVER_WRKGRP_LEN - 1);
+fail:
+	free(ret);
+	free(paths);
+	free(secs);
+	free(status);
+	return NULL;
+}
 
-out:
-	free(tmp);
+/**
+ * config_share_done() - report kernel response to a share config request
+ * @nlsock:	netlink socket
+ * @nlh:	response, NULL if none arrived
+ * @priv:	share name, freed here
+ */
+static void config_share_done(struct nl_sock *nlsock, struct nlmsghdr *nlh,
+		void *priv)
+{
+	char *share = (char *)priv;
+	struct cifsd_uevent *ev;
+
+	if (!nlh) {
+		cifsd_err("share[%s] configuration got no response\n", share);
+	} else {
+		ev = NLMSG_DATA(nlh);
+		if (ev->error)
+			cifsd_err("share[%s] configuration failed : %d\n",
+					share, ev->error);
+	}
+	free(share);
 }
 
 /**
- * parse_share_config() - parse share config entry for sharename and
- *			comment for dcerpc
+ * send_share_config() - send a share config entry without waiting for
+ *			its response
+ * @nlsock:	netlink socket
+ * @ev:		config share event header
+ * @tbuf:	share config entry
+ * @len:	length of @tbuf, including terminating NUL of text entries
+ * @sname:	share name
  *
- * @src:	source string to be scanned
+ * Return:	0 on success, -1 on error
  */
-static void parse_share_config(char *src)
+static int send_share_config(struct nl_sock *nlsock, struct cifsd_uevent *ev,
+		char *tbuf, int len, const char *sname)
 {
-	char *tmp;
-	char *dup;
-	char *conf;
-	char *val;
-	char *sharename = NULL;
-	char *comment = NULL;
+	char *name;
+
+	name = strdup(sname);
+	if (!name)
+		return -1;
+
+	ev->buflen = len;
+	if (nl_async_send(nlsock, ev, tbuf, len,
+			CIFSD_UEVENT_CONFIG_SHARE_RSP,
+			config_share_done, name) < 0) {
+		cifsd_err("cifsd event sending failed\n");
+		free(name);
+		return -1;
+	}
 
-	if (!src)
-		return;
+	/* keep a window of requests in flight */
+	return nl_async_wait(nlsock, NETLINK_CIFSD_ASYNC_WINDOW);
+}
+
+/* share config entries collected for one CIFSD_KEVENT_CONFIG_SHARES */
+struct share_batch {
+	unsigned int nr;
+	unsigned int len;
+	char *names[CIFSD_SHARES_PER_MSG];
+	char buf[NETLINK_CIFSD_MAX_PAYLOAD];
+};
 
-	cifsd_debug("src : %s\n", src);
+static void free_share_batch(struct share_batch *batch)
+{
+	unsigned int i;
 
-	if (strcasestr(src, "sharename = global")) {
-		parse_global_config(src);
+	if (!batch)
 		return;
-	}
 
-	tmp = dup = strdup(src);
-	conf = strtok(dup, "<");
-	if (!conf)
-		goto out;
+	for (i = 0; i < batch->nr; i++)
+		free(batch->names[i]);
+	free(batch);
+}
 
-	do {
-		if (!strncasecmp("sharename =", conf, 11)) {
-			val = strchr(conf, '=');
-			if (val)
-				sharename = val + 2;
-		}
-		else if (!strncasecmp("comment =", conf, 9)) {
-			val = strchr(conf, '=');
-			if (val)
-				comment = val + 2;
+/**
+ * config_shares_done() - report per entry status of a share batch
+ * @nlsock:	netlink socket
+ * @nlh:	response, NULL if none arrived
+ * @priv:	share batch, freed here
+ */
+static void config_shares_done(struct nl_sock *nlsock, struct nlmsghdr *nlh,
+		void *priv)
+{
+	struct share_batch *batch = (struct share_batch *)priv;
+	struct cifsd_uevent *ev = nlh ? NLMSG_DATA(nlh) : NULL;
+	int *status = NULL;
+	unsigned int i;
+	int err;
+
+	/* without per entry status the whole batch shares ev->error */
+	if (ev && ev->buflen >= batch->nr * sizeof(int))
+		status = (int *)ev->buffer;
+
+	for (i = 0; i < batch->nr; i++) {
+		if (!ev) {
+			cifsd_err("share[%s] configuration got no response\n",
+					batch->names[i]);
+			continue;
 		}
-	}while((conf = strtok(NULL, "<")));
-
-	if (sharename)
-		add_new_share(sharename, comment);
 
-out:
-	free(tmp);
+		err = status ? status[i] : ev->error;
+		if (err)
+			cifsd_err("share[%s] configuration failed : %d\n",
+					batch->names[i], err);
+	}
+	free_share_batch(batch);
 }
 
 /**
- * prefix_share_name() - add prefix to share name for simple parsing
- * @src:	source string to be scanned
- * @srclen:	lenth of share name
+ * config_shares_send() - send a batch of share config entries
+ * @nlsock:	netlink socket
+ * @batchp:	share batch, always consumed and reset to NULL
+ *
+ * Return:	0 on success, -1 on error
  */
-void prefix_share_name(char *src, int *srclen)
+static int config_shares_send(struct nl_sock *nlsock,
+		struct share_batch **batchp)
 {
-	char *share_cfg = "sharename = ";
-	char share_name[PAGE_SZ];
-	int i, j;
-	int cfg_len;
+	struct share_batch *batch = *batchp;
+	struct cifsd_uevent ev;
+
+	*batchp = NULL;
 
-	/* remove [ and ] from share name */
-	for (i = 0, j = 0; i < *srclen; i++) {
-		if (!(src[i] == '[' || src[i] == ']'))
-			share_name[j++] = src[i];
+	memset(&ev, 0, sizeof(ev));
+	ev.type = CIFSD_KEVENT_CONFIG_SHARES;
+	ev.buflen = batch->len;
+	ev.u.c_shares.nr_shares = batch->nr;
+	if (nl_async_send(nlsock, &ev, batch->buf, batch->len,
+			CIFSD_UEVENT_CONFIG_SHARES_RSP,
+			config_shares_done, batch) < 0) {
+		cifsd_err("cifsd event sending failed\n");
+		free_share_batch(batch);
+		return -1;
 	}
-	share_name[j] = '\0';
 
-	cfg_len = strlen(share_cfg);
-	strncpy(src, share_cfg, cfg_len);
-	src[cfg_len] = '\0';
-	strncat(src, share_name, strlen(share_name));
-	*srclen = strlen(src);
+	/* keep a window of requests in flight */
+	return nl_async_wait(nlsock, NETLINK_CIFSD_ASYNC_WINDOW) < 0 ? -1 : 0;
 }
 
 /**
- * validate_share_path() - check if share path exist or not
- * @path:	share path name string
- * @sname:	share name string
+ * push_share_config() - queue a share config entry for the kernel
+ * @nlsock:	netlink socket
+ * @ev:		config share event header, used without batching
+ * @batchp:	share batch being filled
+ * @tbuf:	share config entry
+ * @len:	length of @tbuf, including terminating NUL of text entries
+ * @sname:	share name
  *
- * Return:	0 on success ortherwise error
+ * Entries are coalesced into CIFSD_KEVENT_CONFIG_SHARES messages when
+ * the kernel announced CIFSD_CAP_SHARE_BATCH, and sent one per message
+ * otherwise, as are entries too big for a batch.
+ *
+ * Return:	0 on success, -1 on error
  */
-int validate_share_path(char *path, char *sname)
+static int push_share_config(struct nl_sock *nlsock, struct cifsd_uevent *ev,
+		struct share_batch **batchp, char *tbuf, int len,
+		const char *sname)
 {
-	struct stat st;
+	struct share_batch *batch;
+
+	if (!(nlsock->peer_caps & CIFSD_CAP_SHARE_BATCH))
+		return send_share_config(nlsock, ev, tbuf, len, sname);
 
-	if (stat(path, &st) == -1) {
-		fprintf(stderr, "Failed to add SMB %s \t", sname);
-		fprintf(stderr, "%s: %s\n", path, strerror(errno));
-		return -errno;
+	batch = *batchp;
+	if (batch && (batch->nr == CIFSD_SHARES_PER_MSG ||
+		      batch->len + len > sizeof(batch->buf))) {
+		if (config_shares_send(nlsock, batchp))
+			return -1;
+		batch = NULL;
 	}
 
+	/* keep the entry order when one is sent on its own */
+	if (len > sizeof(batch->buf))
+		return send_share_config(nlsock, ev, tbuf, len, sname);
+
+	if (!batch) {
+		batch = calloc(1, sizeof(struct share_batch));
+		if (!batch)
+			return -1;
+		*batchp = batch;
+	}
+
+	batch->names[batch->nr] = strdup(sname);
+	if (!batch->names[batch->nr])
+		return -1;
+
+	memcpy(batch->buf + batch->len, tbuf, len);
+	batch->len += len;
+	batch->nr++;
 	return 0;
 }
 
 /**
- * get_share_path() - get share path for a share
+ * apply_global_config() - set daemon tunables from the [global] section
+ * @conf:	config model
+ * @sec:	global section
+ */
+static void apply_global_config(struct cifsd_conf *conf,
+		struct conf_section *sec)
+{
+	struct conf_param *param;
+	unsigned int i;
+
+	for (i = 0; i < sec->nr; i++) {
+		param = &conf->params[sec->first + i];
+		switch (param->key) {
+		case CONF_SERVER_STRING:
+			strncpy(server_string, conf_str(conf, param->val),
+					MAX_SERVER_NAME_LEN - 1);
+			break;
+		case CONF_WORKGROUP:
+			strncpy(workgroup, conf_str(conf, param->val),
+					MAX_SERVER_WRKGRP_LEN - 1);
+			break;
+		case CONF_NETLINK_BATCH_SIZE:
+			netlink_batch_size = param->num;
+			break;
+		case CONF_IPC_WORKERS:
+			ipc_workers = param->num;
+			break;
+		case CONF_NETLINK_RCVBUF:
+			netlink_rcvbuf = param->num;
+			break;
+		case CONF_NETLINK_SNDBUF:
+			netlink_sndbuf = param->num;
+			break;
+		}
+	}
+}
+
+/**
+ * push_share_text() - push one config section as text entries
+ * @nlsock:	netlink socket
+ * @ev:		config share event header
+ * @batchp:	share batch being filled
+ * @conf:	config model
+ * @sec:	section
+ *
+ * Entries are "<sharename = name<key = value..." strings of at most
+ * PAGE_SZ bytes. A section not fitting in one entry is split, every
+ * entry starting with the share name.
  *
- * @dst:	destination buffer for share path
- * @src:	source string to be scanned
- * @sharename:	share name string
- * Return:	lenth of share path on success otherwise zero or error
+ * Return:	0 on success, -1 on error
  */
-int get_share_path(char *dst, char *src, char *sharename)
+static int push_share_text(struct nl_sock *nlsock,
+		struct cifsd_uevent *ev, struct share_batch **batchp,
+		struct cifsd_conf *conf, struct conf_section *sec)
 {
-	char *pname;
-	char *tmp, *dup;
-	int len;
-	int ret;
+	char lshare[PAGE_SZ], tbuf[PAGE_SZ];
+	struct conf_param *param;
+	int lssz, limit, len;
+	unsigned int i;
+
+	lssz = snprintf(lshare, PAGE_SZ, "sharename = %s",
+			conf_str(conf, sec->name));
+	if (lssz >= PAGE_SZ / 2) {
+		cifsd_err("share name too long, skipped\n");
+		return 0;
+	}
+	limit = snprintf(tbuf, PAGE_SZ, "<%s", lshare);
+
+	for (i = 0; i < sec->nr; i++) {
+		param = &conf->params[sec->first + i];
+		len = 1 + conf->keys[param->key].len + 3 + param->vlen;
+		if (lssz + 1 + len + 1 > PAGE_SZ) {
+			cifsd_err("share[%s] %s too long, skipped\n",
+					conf_str(conf, sec->name),
+					conf_key_name(conf, param->key));
+			continue;
+		}
+
+		if (limit + len + 1 > PAGE_SZ) {
+			if (push_share_config(nlsock, ev, batchp, tbuf,
+					limit + 1, conf_str(conf, sec->name)) < 0)
+				return -1;
+			limit = snprintf(tbuf, PAGE_SZ, "<%s", lshare);
+		}
+
+		limit += snprintf(tbuf + limit, PAGE_SZ - limit, "<%s = %s",
+				conf_key_name(conf, param->key),
+				conf_str(conf, param->val));
+	}
+
+	return push_share_config(nlsock, ev, batchp, tbuf, limit + 1,
+			conf_str(conf, sec->name));
+}
+
+/* wire ids of known parameters, 0 for those sent by name */
+static const __u16 conf_tlv_type[CONF_NR_KNOWN] = {
+	[CONF_SERVER_STRING]	= CIFSD_TLV_SERVER_STRING,
+	[CONF_WORKGROUP]	= CIFSD_TLV_WORKGROUP,
+	[CONF_NETBIOS_NAME]	= CIFSD_TLV_NETBIOS_NAME,
+	[CONF_COMMENT]		= CIFSD_TLV_COMMENT,
+	[CONF_PATH]		= CIFSD_TLV_PATH,
+	[CONF_GUEST_OK]		= CIFSD_TLV_GUEST_OK,
+	[CONF_ALLOW_HOSTS]	= CIFSD_TLV_ALLOW_HOSTS,
+	[CONF_DENY_HOSTS]	= CIFSD_TLV_DENY_HOSTS,
+	[CONF_VALID_USERS]	= CIFSD_TLV_VALID_USERS,
+	[CONF_INVALID_USERS]	= CIFSD_TLV_INVALID_USERS,
+};
+
+static __u16 param_tlv_type(struct cifsd_conf *conf, struct conf_param *param)
+{
+	if (param->key < CONF_NR_KNOWN && conf_tlv_type[param->key])
+		return conf_tlv_type[param->key];
+	return CIFSD_TLV_PARAM;
+}
+
+/**
+ * param_tlv_len() - value length of a parameter TLV
+ * @conf:	config model
+ * @param:	parameter
+ *
+ * Known numeric parameters are a __u32, other known ones their string
+ * and the rest "name\0value".
+ *
+ * Return:	length, -1 if the value does not fit in a TLV
+ */
+static int param_tlv_len(struct cifsd_conf *conf, struct conf_param *param)
+{
+	unsigned int len;
+
+	if (param_tlv_type(conf, param) == CIFSD_TLV_PARAM)
+		len = conf->keys[param->key].len + 1 + param->vlen;
+	else if (conf->keys[param->key].type != CONF_TYPE_STR)
+		len = sizeof(__u32);
+	else
+		len = param->vlen;
+	return len > CIFSD_TLV_MAX_VALUE ? -1 : (int)len;
+}
+
+/* put a TLV whose value is @a followed by @b, and its padding */
+static char *tlv_put(char *p, __u16 type, const void *a, unsigned int alen,
+		const void *b, unsigned int blen)
+{
+	struct cifsd_tlv *tlv = (struct cifsd_tlv *)p;
+	unsigned int len = alen + blen;
+
+	tlv->type = type;
+	tlv->len = len;
+	memcpy(tlv->value, a, alen);
+	if (blen)
+		memcpy(tlv->value + alen, b, blen);
+	memset(tlv->value + len, 0, CIFSD_TLV_ALIGN(len) - len);
+	return p + CIFSD_TLV_SPACE(len);
+}
 
-	if (!src || !dst)
+/**
+ * push_share_tlv() - push one config section as a TLV entry
+ * @nlsock:	netlink socket
+ * @ev:		config share event header
+ * @batchp:	share batch being filled
+ * @conf:	config model
+ * @sec:	section
+ *
+ * The whole section is one entry, which is sent as a multipart message
+ * when it is bigger than a netlink payload.
+ *
+ * Return:	0 on success, -1 on error
+ */
+static int push_share_tlv(struct nl_sock *nlsock,
+		struct cifsd_uevent *ev, struct share_batch **batchp,
+		struct cifsd_conf *conf, struct conf_section *sec)
+{
+	const char *sname = conf_str(conf, sec->name);
+	struct conf_param *param;
+	unsigned int i, size;
+	char *buf, *p;
+	__u16 type;
+	__u32 num;
+	int len, ret;
+
+	if (sec->nlen > CIFSD_TLV_MAX_VALUE) {
+		cifsd_err("share name too long, skipped\n");
 		return 0;
+	}
+
+	size = CIFSD_TLV_SPACE(sec->nlen);
+	for (i = 0; i < sec->nr; i++) {
+		len = param_tlv_len(conf, &conf->params[sec->first + i]);
+		if (len >= 0)
+			size += CIFSD_TLV_SPACE(len);
+	}
 
-	/* global config does not have share path */
-	if (strcasestr(sharename, "sharename = global"))
+	if (size > nl_max_payload(nlsock)) {
+		cifsd_err("share[%s] config too long, skipped\n", sname);
 		return 0;
+	}
 
-	tmp = dup = strdup(src);
-	if (strcasestr(dup, "path = "))
-	{
-		pname = strtok(dup, "= ");
-		pname = strtok(NULL, "= ");
-		if (pname)
-		{
-			len = strlen(pname);
-			strncpy(dst, pname, len);
-			dst[len] = '\0';
-			free(tmp);
-			ret = validate_share_path(dst, sharename);
-			if (ret < 0)
-				return ret;
-			else
-				return len;
+	buf = malloc(size);
+	if (!buf)
+		return -1;
+
+	p = tlv_put(buf, CIFSD_TLV_SHARE_NAME, sname, sec->nlen, NULL, 0);
+	for (i = 0; i < sec->nr; i++) {
+		param = &conf->params[sec->first + i];
+		if (param_tlv_len(conf, param) < 0) {
+			cifsd_err("share[%s] %s too long, skipped\n", sname,
+					conf_key_name(conf, param->key));
+			continue;
+		}
+
+		type = param_tlv_type(conf, param);
+		if (type == CIFSD_TLV_PARAM) {
+			p = tlv_put(p, type, conf_key_name(conf, param->key),
+					conf->keys[param->key].len + 1,
+					conf_str(conf, param->val), param->vlen);
+		} else if (conf->keys[param->key].type != CONF_TYPE_STR) {
+			num = param->num;
+			p = tlv_put(p, type, &num, sizeof(num), NULL, 0);
+		} else {
+			p = tlv_put(p, type, conf_str(conf, param->val),
+					param->vlen, NULL, 0);
 		}
 	}
 
-	free(tmp);
-	return 0;
+	ret = push_share_config(nlsock, ev, batchp, buf, p - buf, sname);
+	free(buf);
+	return ret;
 }
 
 /**
- * getfchar() - helper function to locate valid starting character
- *              and copies characters till i/p LINE length.
- *              Here valid data means:
- *              i) not commented line (starting with ';' or '#')
- *              ii) ascii values between- a-z || A-Z || 0-9
- * @sz: current LINE length
- * @c:          first valid character
- * @dst:        initialize destination string with LINE data starting from 'c'
- * @ssz:        total length of copied destination data
+ * push_share_section() - push the kernel entries of one config section
+ * @nlsock:	netlink socket
+ * @ev:		config share event header
+ * @batchp:	share batch being filled
+ * @conf:	config model
+ * @sec:	section
+ *
+ * Return:	0 on success, -1 on error
  */
-void getfchar(char *LINE, int sz, char *c, char *dst, int *ssz)
-{
-	int cnt = 0;
-	int i = 0;
-	int len = 0;
-
-	while ((cnt < sz) && ((LINE[cnt] != ';') &&
-	       (LINE[cnt] != '#') && (LINE[cnt] != '[') &&
-	       !(LINE[cnt] >= 'A' && LINE[cnt] <= 'Z') &&
-	       !(LINE[cnt] >= 'a' && LINE[cnt] <= 'z') &&
-	       !(LINE[cnt] >= '0' && LINE[cnt] <= '9')))
-		cnt++;
-
-	cnt == sz ? (*c = ' ') : (*c = LINE[cnt]);
-
-	if ((LINE[cnt] != ';') && (LINE[cnt] != '#')) {
-		while ((cnt < sz) && (LINE[cnt] != ';') &&
-			(LINE[cnt] != '#')) {
-			dst[i++] = LINE[cnt++];
-			len++;
-		}
-	}
+static int push_share_section(struct nl_sock *nlsock,
+		struct cifsd_uevent *ev, struct share_batch **batchp,
+		struct cifsd_conf *conf, struct conf_section *sec)
+{
+	if (nlsock->peer_caps & CIFSD_CAP_SHARE_TLV)
+		return push_share_tlv(nlsock, ev, batchp, conf, sec);
+	return push_share_text(nlsock, ev, batchp, conf, sec);
+}
+
+/**
+ * set_held_shares() - remember the shares held back by a config push
+ * @conf:	config model
+ * @status:	per section status of validate_share_paths()
+ */
+static void set_held_shares(struct cifsd_conf *conf, int *status)
+{
+	struct conf_param *param;
+	unsigned int i, nr = 0;
+
+	for (i = 0; i < nr_held_shares; i++)
+		free(held_paths[i]);
+	free(held_paths);
+	nr_held_shares = 0;
 
-	*ssz = len;
+	held_paths = calloc(conf->nr_sections, sizeof(char *));
+	if (!held_paths)
+		goto fail;
+
+	for (i = 0; i < conf->nr_sections; i++) {
+		if (status[i] != -ETIMEDOUT)
+			continue;
+		param = conf_find(conf, &conf->sections[i], CONF_PATH);
+		held_paths[nr] = strdup(conf_str(conf, param->val));
+		if (!held_paths[nr])
+			goto fail;
+		nr++;
+	}
+	nr_held_shares = nr;
+	return;
+
+fail:
+	cifsd_err("held back shares are exported on the next reload\n");
+	if (held_paths) {
+		while (nr--)
+			free(held_paths[nr]);
+	}
+	free(held_paths);
+	held_paths = NULL;
 }
 
 /**
  * config_shares() - function to initialize cifsd with share settings.
- *		     This function parses local configuration file and
- *		     initializes cifsd with [share] settings
+ *		     This function initializes cifsd with [share] settings
+ *		     of the local configuration file
+ * @nlsock:	netlink socket
+ * @conf:	config model, parsed or from the config snapshot
+ *
+ * The model feeds both the kernel entries and the share registry.
+ * Shares whose path does not answer in time are held back and counted
+ * in nr_held_shares, cifsd_retry_held_shares() exports them once it does.
+ * Requests are left in flight, cifsd_early_setup() waits for them.
  *
  * Return:	success: CIFS_SUCCESS; fail: CIFS_FAIL
  */
-int config_shares(struct nl_sock *nlsock, char *conf_path)
+int config_shares(struct nl_sock *nlsock, struct cifsd_conf *conf)
 {
-	char lshare[PAGE_SZ] = "", sharepath[PAGE_SZ] = "", tbuf[PAGE_SZ];
-	int sharepath_len = 0, cnt = 0, lssz = 0, limit = 0, eof = 0;
-	FILE *fd_share;
+	struct share_batch *batch = NULL;
+	struct share_registry *reg;
+	struct cifsd_share *share;
+	struct conf_section *sec;
+	struct conf_param *param;
 	struct cifsd_uevent ev;
+	unsigned int i;
+	int *status;
+
+	status = validate_share_paths(conf);
+	if (!status)
+		return CIFS_FAIL;
+
+	reg = new_share_registry();
+	if (!reg) {
+		free(status);
+		return CIFS_FAIL;
+	}
 
 	memset(&ev, 0, sizeof(ev));
 	ev.type = CIFSD_KEVENT_CONFIG_SHARE;
+	nlsock->event_handle_cb = cifsd_request_handler;
+
+	for (i = 0; i < conf->nr_sections; i++) {
+		sec = &conf->sections[i];
+		if (sec->flags & CONF_SECTION_GLOBAL) {
+			apply_global_config(conf, sec);
+			global_conf_hash = conf_section_hash(conf, sec);
+		} else if (status[i]) {
+			/* shares with a missing or hung path are not exported */
+			continue;
+		}
 
-	fd_share = fopen(conf_path, "r");
-	if (fd_share == NULL) {
-		cifsd_err("[%s] is not existing, err %d\n", conf_path, errno);
-		return CIFS_FAIL;
+		if (push_share_section(nlsock, &ev, &batch, conf, sec))
+			goto fail;
+
+		if (!(sec->flags & CONF_SECTION_GLOBAL)) {
+			param = conf_find(conf, sec, CONF_COMMENT);
+			share = share_registry_add(reg,
+					conf_str(conf, sec->name),
+					param ? conf_str(conf, param->val) : NULL,
+					conf_section_hash(conf, sec));
+			if (!share)
+				goto fail;
+			startup_count(STARTUP_NR_SHARES, 1);
+		}
 	}
 
-	memset(tbuf, 0, PAGE_SZ);
+	if (batch && config_shares_send(nlsock, &batch))
+		goto fail;
 
-	while (!eof) {
-		char ch;
-		char stro[PAGE_SZ] = "";
-		char str[PAGE_SZ] = "";
-		char cont_str[PAGE_SZ] = "";
-		int contsz = 0, ssz = 0;
-		char *line;
-
-		cnt = readline(fd_share, &line, &eof, 1);
-		if (cnt < 0)
-			goto out;
-		else if (!cnt) {
-			free(line);
+	share_registry_publish(reg);
+	set_held_shares(conf, status);
+	free(status);
+	return CIFS_SUCCESS;
+
+fail:
+	free_share_batch(batch);
+	share_registry_put(reg);
+	free(status);
+	nl_async_cancel(nlsock);
+	return CIFS_FAIL;
+}
+
+/**
+ * remove_share_done() - report kernel response to a share removal
+ * @nlsock:	netlink socket
+ * @nlh:	response, NULL if none arrived
+ * @priv:	share name, freed here
+ */
+static void remove_share_done(struct nl_sock *nlsock, struct nlmsghdr *nlh,
+		void *priv)
+{
+	char *share = (char *)priv;
+	struct cifsd_uevent *ev;
+
+	if (!nlh) {
+		cifsd_err("share[%s] removal got no response\n", share);
+	} else {
+		ev = NLMSG_DATA(nlh);
+		if (ev->error)
+			cifsd_err("share[%s] removal failed : %d\n",
+					share, ev->error);
+	}
+	free(share);
+}
+
+/**
+ * send_remove_share() - ask the kernel to stop exporting a share
+ * @nlsock:	netlink socket
+ * @sharename:	share name
+ *
+ * Return:	0 on success, -1 on error
+ */
+static int send_remove_share(struct nl_sock *nlsock, const char *sharename)
+{
+	struct cifsd_uevent ev;
+	char *name;
+
+	name = strdup(sharename);
+	if (!name)
+		return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = CIFSD_KEVENT_REMOVE_SHARE;
+	ev.buflen = strlen(name) + 1;
+	if (nl_async_send(nlsock, &ev, name, ev.buflen,
+			CIFSD_UEVENT_REMOVE_SHARE_RSP,
+			remove_share_done, name) < 0) {
+		cifsd_err("cifsd event sending failed\n");
+		free(name);
+		return -1;
+	}
+
+	return nl_async_wait(nlsock, NETLINK_CIFSD_ASYNC_WINDOW) < 0 ? -1 : 0;
+}
+
+/* share request sent by a reload, logged if the reload fails */
+struct reload_sent {
+	const char *name;
+	const char *op;
+};
+
+/**
+ * cifsd_reload_config() - apply the current smb.conf to a running server
+ * @nlsock:	netlink socket
+ *
+ * The new share set is diffed against the published share registry.
+ * Only added and changed shares are pushed to the kernel, shares gone
+ * from the file are removed. The new registry is built aside and
+ * published once the kernel answered every request, pipe handlers keep
+ * using the generation they hold. [global] settings apply on restart
+ * only. A share whose path does not answer in time keeps its current
+ * state and is counted in nr_held_shares.
+ *
+ * Runs on the config reload thread while the event loop reads the
+ * socket, one reload at a time, so it stays the only publisher of
+ * registries.
+ *
+ * On error the published registry is left as it was, but requests sent
+ * before the failure may already be applied by the kernel. Those shares
+ * are logged; they still differ from the registry, so the next reload
+ * sends them again.
+ *
+ * Return:	0 on success, -errno on error
+ */
+int cifsd_reload_config(struct nl_sock *nlsock)
+{
+	unsigned int nr_added = 0, nr_changed = 0, nr_removed = 0;
+	unsigned int nr_held = 0, nr_sent = 0;
+	struct reload_sent *sent = NULL;
+	struct share_registry *old = NULL, *reg = NULL;
+	struct share_batch *batch = NULL;
+	struct cifsd_share *share, *prev;
+	struct conf_section *sec;
+	struct conf_param *param;
+	struct cifsd_conf *conf;
+	struct cifsd_uevent ev;
+	unsigned long long hash;
+	unsigned int i;
+	int ret = -ENOMEM;
+	int *status = NULL;
+
+	conf = conf_load(cifsd_conf_path);
+	if (!conf) {
+		cifsd_err("failed to load %s, keeping current shares\n",
+				cifsd_conf_path);
+		return -EINVAL;
+	}
+
+	old = share_registry_get();
+	reg = new_share_registry();
+	if (!old || !reg)
+		goto out;
+
+	status = validate_share_paths(conf);
+	sent = calloc(conf->nr_sections + old->nr, sizeof(*sent));
+	if (!status || !sent)
+		goto out;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = CIFSD_KEVENT_CONFIG_SHARE;
+
+	for (i = 0; i < conf->nr_sections; i++) {
+		sec = &conf->sections[i];
+		hash = conf_section_hash(conf, sec);
+		if (sec->flags & CONF_SECTION_GLOBAL) {
+			if (hash != global_conf_hash)
+				cifsd_info("[global] changes apply on restart\n");
 			continue;
 		}
 
-		if (line[cnt - 1] == '\\') {
-			do {
-				strncat(cont_str, line, cnt - 1);
-				free(line);
-				cnt = readline(fd_share, &line, &eof, 1);
-			} while ((cnt > 0) && (line[cnt - 1] == '\\'));
-
-			if (cnt > 0)
-				strncat(cont_str, line, cnt);
-			free(line);
-
-			contsz = strlen(cont_str);
-			line = (char *)malloc(contsz + 1);
-			memset(line, 0, contsz + 1);
-			strncpy(line, cont_str, contsz);
-			cnt = contsz;
+		if (status[i] && status[i] != -ETIMEDOUT)
+			continue;
+
+		prev = share_registry_lookup(old, conf_str(conf, sec->name));
+		if (status[i]) {
+			/* retried later, an exported share stays as it is */
+			nr_held++;
+			if (prev && !share_registry_add(reg, prev->sharename,
+					prev->config.comment, prev->conf_hash))
+				goto fail;
+			continue;
 		}
 
-		getfchar(line, cnt, &ch, stro, &ssz);
-		free(line);
-		tlws(stro, str, &ssz);
-
-		if ((ch == '[') || (ch >= 'A' && ch <= 'Z') ||
-		    (ch >= 'a' && ch <= 'z')) {
-			/* writeout previous export entry */
-			if (ch == '[' && limit > 0) {
-				if (sharepath_len >= 0) {
-					tbuf[limit] = '\0';
-					limit += 1;
-					ev.buflen = limit;
-					if (cifsd_common_sendmsg(nlsock, &ev,
-						tbuf, limit) < 0) {
-						cifsd_err("cifsd event sending"
-								" failed\n");
-						return -1;
-					}
-					nlsock->event_handle_cb =
-							cifsd_request_handler;
-					if (nl_handle_event(nlsock) < 0)
-						cifsd_err("config share failed\n");
-					parse_share_config(tbuf);
-				}
-
-				memset(tbuf, 0, PAGE_SZ);
-				limit = 0;
-				sharepath_len = 0;
-			}
+		if (!prev || prev->conf_hash != hash) {
+			sent[nr_sent].name = conf_str(conf, sec->name);
+			sent[nr_sent++].op = prev ? "change" : "addition";
+			if (push_share_section(nlsock, &ev, &batch, conf, sec))
+				goto fail;
+			if (prev)
+				nr_changed++;
+			else
+				nr_added++;
+		}
 
-			if (ch == '[') {
-				prefix_share_name(str, &ssz);
-				memset(lshare, 0, PAGE_SZ);
-				strncpy(lshare, str, ssz);
-				lssz = ssz;
-			}
+		param = conf_find(conf, sec, CONF_COMMENT);
+		share = share_registry_add(reg, conf_str(conf, sec->name),
+				param ? conf_str(conf, param->val) : NULL, hash);
+		if (!share)
+			goto fail;
+	}
 
-			if (!sharepath_len)
-				sharepath_len =
-					get_share_path(sharepath, str, lshare);
-again:
-			if ((limit + ssz + 1) < PAGE_SZ) {
-				strncat(tbuf+limit, "<", 1);
-				strncat(tbuf+limit + 1, str, ssz);
-				limit += ssz + 1;
-			} else {
-				if (sharepath_len >= 0) {
-					tbuf[limit] = '\0';
-					limit += 1;
-					ev.buflen = limit;
-					if (cifsd_common_sendmsg(nlsock, &ev,
-						tbuf, limit) < 0) {
-						cifsd_err("cifsd event sending"
-								" failed\n");
-						return -1;
-					}
-					nlsock->event_handle_cb =
-							cifsd_request_handler;
-					if (nl_handle_event(nlsock) < 0)
-						cifsd_err("config share failed\n");
-				}
-
-				memset(tbuf, 0, PAGE_SZ);
-
-				if (ch != '[') {
-					strncat(tbuf, "<", 1);
-					strncat(tbuf + 1, lshare, lssz);
-					limit = lssz + 1;
-				} else {
-					sharepath_len = 0;
-					limit = 0;
-				}
-
-				goto again;
-			}
+	if (batch && config_shares_send(nlsock, &batch))
+		goto fail;
+
+	for (i = 0; i < old->nr; i++) {
+		prev = old->shares[i];
+		if (share_registry_lookup(reg, prev->sharename))
+			continue;
+
+		if (nlsock->peer_caps & CIFSD_CAP_SHARE_REMOVE) {
+			sent[nr_sent].name = prev->sharename;
+			sent[nr_sent++].op = "removal";
+			if (send_remove_share(nlsock, prev->sharename))
+				goto fail;
+			nr_removed++;
+			continue;
 		}
+
+		/* the kernel keeps exporting it, so does the registry */
+		cifsd_info("share[%s] removal applies on restart\n",
+				prev->sharename);
+		if (!share_registry_add(reg, prev->sharename,
+				prev->config.comment, prev->conf_hash))
+			goto fail;
 	}
 
+	if (nl_async_wait(nlsock, 0) < 0)
+		goto fail;
+
+	share_registry_publish(reg);
+	reg = NULL;
+	set_held_shares(conf, status);
+
+	cifsd_info("reloaded %s : %u added, %u changed, %u removed, "
+			"%u held back\n", cifsd_conf_path, nr_added,
+			nr_changed, nr_removed, nr_held);
+	ret = 0;
+	goto out;
+
+fail:
+	cifsd_err("failed to reload %s, keeping current shares\n",
+			cifsd_conf_path);
+	for (i = 0; i < nr_sent; i++)
+		cifsd_err("share[%s] %s may already be applied by the kernel\n",
+				sent[i].name, sent[i].op);
+	free_share_batch(batch);
+	ret = -EIO;
 out:
-	if (sharepath_len >= 0 && limit > 0) {
-		tbuf[limit] = '\0';
-		limit += 1;
-		ev.buflen = limit;
-		if (cifsd_common_sendmsg(nlsock, &ev, tbuf, limit) < 0) {
-			cifsd_err("cifsd event sending failed\n");
-			return -1;
-		}
-		nlsock->event_handle_cb = cifsd_request_handler;
-		if (nl_handle_event(nlsock) < 0)
-			cifsd_err("config share failed\n");
-		parse_share_config(tbuf);
-		sharepath_len = 0;
+	if (reg)
+		share_registry_put(reg);
+	if (old)
+		share_registry_put(old);
+	free(sent);
+	free(status);
+	conf_free(conf);
+	return ret;
+}
+
+/**
+ * cifsd_retry_held_shares() - export held back shares which answer again
+ * @nlsock:	netlink socket
+ *
+ * Only the paths of the held back shares are checked, one still stuck
+ * in an earlier check is not stat()ed again. The config is reloaded once
+ * any of them answers.
+ *
+ * Return:	0 on success, -errno on error
+ */
+int cifsd_retry_held_shares(struct nl_sock *nlsock)
+{
+	unsigned int i, nr_back = 0;
+	int *status;
+
+	if (!nr_held_shares)
+		return 0;
+
+	status = calloc(nr_held_shares, sizeof(int));
+	if (!status)
+		return -ENOMEM;
+
+	if (path_check((const char **)held_paths, nr_held_shares, status,
+			PATH_CHECK_TIMEOUT_MS)) {
+		free(status);
+		return -ENOMEM;
 	}
 
-	fclose(fd_share);
+	for (i = 0; i < nr_held_shares; i++) {
+		if (status[i] != -ETIMEDOUT && status[i] != -EAGAIN)
+			nr_back++;
+	}
+	free(status);
 
-	return CIFS_SUCCESS;
+	if (!nr_back) {
+		cifsd_debug("%u held back shares still not responding\n",
+				nr_held_shares);
+		return 0;
+	}
+
+	cifsd_info("%u held back share paths answer again\n", nr_back);
+	return cifsd_reload_config(nlsock);
 }
 
 /**
@@ -649,24 +1389,98 @@ out:
  */
 int cifsd_early_setup(struct nl_sock *nlsock, char *cifspwd, char *cifsconf)
 {
-	int ret;
+	struct snap_source sources[SNAP_NR_SOURCES];
+	struct cifsd_snapshot *snap = NULL;
+	struct user_table users = { 0 };
+	struct cifsd_conf *conf = NULL;
+	int keyed, ret;
+
+	startup_phase(STARTUP_EARLY_INIT);
+	nlsock->event_handle_cb = cifsd_request_handler;
+	if (nl_handle_early_init_cifsd(nlsock))
+		return CIFS_FAIL;
+
+	startup_phase(STARTUP_LOAD);
+	/* unchanged sources are pushed from the snapshot, without parsing */
+	keyed = !snapshot_sources(sources, cifsconf, cifspwd);
+	if (keyed)
+		snap = snapshot_load(PATH_SNAPSHOT, sources, ID_CACHE_TTL);
+
+	if (snap) {
+		cifsd_info("using config snapshot %s\n", PATH_SNAPSHOT);
+		conf = &snap->conf;
+	} else {
+		ret = load_users(cifspwd, &users);
+		if (ret != CIFS_SUCCESS)
+			goto out;
+
+		conf = conf_load(cifsconf);
+		if (!conf) {
+			ret = CIFS_FAIL;
+			goto out;
+		}
+	}
+
 	/* import user account */
-	nl_handle_early_init_cifsd(nlsock);
-	ret = config_users(nlsock, cifspwd);
+	startup_phase(STARTUP_USERS);
+	if (snap)
+		ret = config_users(nlsock, snap->users, snap->nr_users);
+	else
+		ret = config_users(nlsock, users.recs, users.nr);
 	if (ret != CIFS_SUCCESS)
-		return ret;
+		goto out;
 
 	/* import shares info */
-	ret = config_shares(nlsock, cifsconf);
+	startup_phase(STARTUP_SHARES);
+	ret = config_shares(nlsock, conf);
 	if (ret != CIFS_SUCCESS)
-		return ret;
+		goto out;
+
+	/* every user and share is acknowledged before serving requests */
+	startup_phase(STARTUP_ACKS);
+	if (nl_async_wait(nlsock, 0) < 0) {
+		nl_async_cancel(nlsock);
+		ret = CIFS_FAIL;
+		goto out;
+	}
+
+	if (!snap && keyed) {
+		ret = snapshot_save(PATH_SNAPSHOT, sources, conf, users.recs,
+				users.nr);
+		if (ret)
+			cifsd_debug("snapshot %s not saved : %d\n",
+					PATH_SNAPSHOT, ret);
+		ret = CIFS_SUCCESS;
+	}
+
+out:
+	if (snap)
+		snapshot_free(snap);
+	else
+		conf_free(conf);
+	free(users.recs);
 	return ret;
 }
 
+/* long only options */
+enum {
+	OPT_STARTUP_PROFILE = 256,
+};
+
+static const struct option cifsd_options[] = {
+	{ "help",		no_argument,		NULL, 'h' },
+	{ "configure",		required_argument,	NULL, 'c' },
+	{ "import-users",	required_argument,	NULL, 'i' },
+	{ "startup-profile",	required_argument,	NULL,
+		OPT_STARTUP_PROFILE },
+	{ NULL,			0,			NULL, 0 },
+};
+
 int main(int argc, char**argv)
 {
 	char *cifspwd = PATH_PWDDB;
 	char *cifsconf = PATH_SHARECONF;
+	char *profile = NULL;
 	int c;
 	int ret;
 	struct nl_sock *nlsock = nl_init();
@@ -678,7 +1492,8 @@ int main(int argc, char**argv)
 
 	/* Parse the command line options and arguments. */
 	opterr = 0;
-	while ((c = getopt(argc, argv, "c:i:vh")) != EOF)
+	while ((c = getopt_long(argc, argv, "c:i:vh", cifsd_options,
+					NULL)) != EOF)
 		switch (c) {
 		case 'c':
 			cifsconf = strdup(optarg);
@@ -693,6 +1508,9 @@ int main(int argc, char**argv)
 			}
 			vflags |= F_VERBOSE;
 			break;
+		case OPT_STARTUP_PROFILE:
+			profile = strdup(optarg);
+			break;
 		case '?':
 		case 'h':
 		default:
@@ -702,7 +1520,10 @@ int main(int argc, char**argv)
 	cifsd_info("starting work (vers : %s, date : %s)\n",
 		CIFSD_TOOLS_VERSION, CIFSD_TOOLS_DATE);
 
+	startup_init(nlsock, profile);
+	startup_phase(STARTUP_SHARE_INIT);
 	init_share_config();
+	cifsd_conf_path = cifsconf;
 
 	/* cifsd early setup */
 	ret = cifsd_early_setup(nlsock, cifspwd, cifsconf);
@@ -710,11 +1531,16 @@ int main(int argc, char**argv)
 		goto out;
 
 	/* netlink communication loop */
+	startup_phase(STARTUP_NETLINK_SETUP);
 	cifsd_netlink_setup(nlsock);
 
 	exit_share_config();
 
 out:
+	if (vflags) {
+		nl_dump_stats(nlsock);
+		conv_dump_stats();
+	}
 	nl_exit(nlsock);
 	cifsd_info("terminated\n");
 	
@@ -20,10 +20,15 @@
  */
 
 #include <iconv.h>
+#include <strings.h>
 #include "cifsd.h"
 #include "ntlmssp.h"
+#include "cptables.h"
 #include <stdlib.h>
 #include <time.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #define COPY_UCS2_CHAR(dest, src) (((unsigned char *)(dest))[0] =\
 		((unsigned char *)(src))[0], ((unsigned char *)(dest))[1] =\
@@ -91,25 +96,771 @@ static void close_conversion(iconv_t conv)
 	iconv_close(conv);
 }
 
+/*
+ * Codepage names are interned once, when a pipe or notify client is
+ * set up, and conversions take the small integer ID. An entry is never
+ * changed or removed once added, so it is read without lock. Names
+ * beyond the table get an ID of CIFSD_CODEPAGE_MAX or more and are
+ * converted by iconv, without cached descriptors.
+ */
+#define CP_ASCII		0x1	/* ASCII compatible, see below */
+#define CP_UTF8			0x2
+#define CP_TO_UTF16		0x4	/* iconv can convert to UTF-16LE */
+#define CP_FROM_UTF16		0x8	/* and back */
+
+struct cifsd_codepage {
+	char name[CIFSD_CODEPAGE_LEN];
+	unsigned int flags;
+	const __u16 *to_ucs;		/* built-in table, or NULL */
+	unsigned char **from_ucs;	/* its inverse, by code point page */
+	int id;				/* beyond the table only */
+	struct cifsd_codepage *next;
+};
+
+static pthread_mutex_t codepage_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cifsd_codepage codepages[CIFSD_CODEPAGE_MAX];
+static int nr_codepages;
+/* names beyond the table, newest first */
+static struct cifsd_codepage *codepage_overflow;
+
+/**
+ * codepage_get() - get the codepage of an ID
+ * @cp:		codepage ID
+ *
+ * Return:	codepage
+ */
+static const struct cifsd_codepage *codepage_get(int cp)
+{
+	struct cifsd_codepage *o;
+
+	if (cp < CIFSD_CODEPAGE_MAX)
+		return &codepages[cp];
+
+	o = __atomic_load_n(&codepage_overflow, __ATOMIC_ACQUIRE);
+	while (o->id != cp)
+		o = o->next;
+	return o;
+}
+
+/*
+ * Descriptors are kept per thread, iconv_t is not safe to share. A
+ * handful covers the codepages clients use, the least recently used is
+ * only closed when one more codepage shows up.
+ */
+#define CONV_CACHE_SIZE		4
+
+struct conv_entry {
+	int cp;
+	int fromUTF16;
+	iconv_t conv;
+	unsigned long last_use;
+};
+
+struct conv_cache {
+	struct conv_entry entries[CONV_CACHE_SIZE];
+	unsigned int nr;
+	unsigned long clock;
+};
+
+static pthread_key_t conv_cache_key;
+static pthread_once_t conv_cache_once = PTHREAD_ONCE_INIT;
+
+static struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+} conv_stats;
+
+static void conv_cache_free(void *data)
+{
+	struct conv_cache *cache = (struct conv_cache *)data;
+	unsigned int i;
+
+	for (i = 0; i < cache->nr; i++)
+		close_conversion(cache->entries[i].conv);
+	free(cache);
+}
+
+static void conv_cache_init(void)
+{
+	pthread_key_create(&conv_cache_key, conv_cache_free);
+}
+
+/**
+ * get_conversion() - get the conversion descriptor of this thread
+ * @cp:		codepage ID
+ * @fromUTF16:	convert from UTF-16LE to @cp, or the other way
+ *
+ * The descriptor is reset to its initial state. Release it with
+ * put_conversion(), which only closes it for codepages beyond the
+ * table.
+ *
+ * Return:	conversion descriptor, (iconv_t)-1 on error
+ */
+static iconv_t get_conversion(int cp, int fromUTF16)
+{
+	const struct cifsd_codepage *cpg = codepage_get(cp);
+	struct conv_cache *cache;
+	struct conv_entry *e;
+	unsigned int i;
+	iconv_t conv;
+
+	if (!(cpg->flags & (fromUTF16 ? CP_FROM_UTF16 : CP_TO_UTF16)))
+		return (iconv_t)-1;
+
+	if (cp >= CIFSD_CODEPAGE_MAX) {
+		__atomic_add_fetch(&conv_stats.misses, 1, __ATOMIC_RELAXED);
+		return init_conversion(cpg->name, fromUTF16);
+	}
+
+	pthread_once(&conv_cache_once, conv_cache_init);
+	cache = pthread_getspecific(conv_cache_key);
+	if (!cache) {
+		cache = calloc(1, sizeof(struct conv_cache));
+		if (!cache || pthread_setspecific(conv_cache_key, cache)) {
+			free(cache);
+			return (iconv_t)-1;
+		}
+	}
+
+	cache->clock++;
+	for (i = 0; i < cache->nr; i++) {
+		e = &cache->entries[i];
+		if (e->cp != cp || e->fromUTF16 != fromUTF16)
+			continue;
+
+		__atomic_add_fetch(&conv_stats.hits, 1, __ATOMIC_RELAXED);
+		e->last_use = cache->clock;
+		iconv(e->conv, NULL, NULL, NULL, NULL);
+		return e->conv;
+	}
+
+	__atomic_add_fetch(&conv_stats.misses, 1, __ATOMIC_RELAXED);
+	conv = init_conversion(cpg->name, fromUTF16);
+	if (conv == (iconv_t)-1)
+		return conv;
+
+	if (cache->nr < CONV_CACHE_SIZE) {
+		e = &cache->entries[cache->nr++];
+	} else {
+		e = &cache->entries[0];
+		for (i = 1; i < CONV_CACHE_SIZE; i++) {
+			if (cache->entries[i].last_use < e->last_use)
+				e = &cache->entries[i];
+		}
+		close_conversion(e->conv);
+		__atomic_add_fetch(&conv_stats.evictions, 1,
+				__ATOMIC_RELAXED);
+	}
+
+	e->cp = cp;
+	e->fromUTF16 = fromUTF16;
+	e->conv = conv;
+	e->last_use = cache->clock;
+	return conv;
+}
+
+/**
+ * put_conversion() - release a descriptor from get_conversion()
+ * @cp:		codepage ID
+ * @conv:	conversion descriptor
+ */
+static void put_conversion(int cp, iconv_t conv)
+{
+	if (cp >= CIFSD_CODEPAGE_MAX)
+		close_conversion(conv);
+}
+
+/**
+ * conv_dump_stats() - print conversion descriptor cache counters
+ */
+void conv_dump_stats(void)
+{
+	cifsd_info("iconv: %d codepages, %lu cache hits, %lu misses, "
+			"%lu evictions\n",
+			__atomic_load_n(&nr_codepages, __ATOMIC_ACQUIRE),
+			__atomic_load_n(&conv_stats.hits, __ATOMIC_RELAXED),
+			__atomic_load_n(&conv_stats.misses, __ATOMIC_RELAXED),
+			__atomic_load_n(&conv_stats.evictions,
+				__ATOMIC_RELAXED));
+}
+
+/*
+ * Codepages where bytes 0x00-0x7f always stand for the same code
+ * points, so an ASCII prefix converts alike whatever follows it.
+ * CP1255 and CP1258 are left out: iconv composes a combining mark
+ * following an ASCII letter into one character.
+ */
+static const struct {
+	const char *name;
+	int prefix;			/* names a family, e.g. ISO-8859-1..16 */
+} ascii_codepages[] = {
+	{ "UTF-8", 0 }, { "UTF8", 0 }, { "ASCII", 0 }, { "US-ASCII", 0 },
+	{ "ANSI_X3.4-1968", 0 }, { "ISO-8859-", 1 }, { "ISO8859-", 1 },
+	{ "ISO_8859-", 1 }, { "CP1250", 0 }, { "CP1251", 0 },
+	{ "CP1252", 0 }, { "CP1253", 0 }, { "CP1254", 0 }, { "CP1256", 0 },
+	{ "CP1257", 0 }, { "WINDOWS-1250", 0 }, { "WINDOWS-1251", 0 },
+	{ "WINDOWS-1252", 0 }, { "WINDOWS-1253", 0 }, { "WINDOWS-1254", 0 },
+	{ "WINDOWS-1256", 0 }, { "WINDOWS-1257", 0 }, { "CP437", 0 },
+	{ "CP850", 0 }, { "CP852", 0 }, { "CP858", 0 }, { "CP866", 0 },
+	{ "CP949", 0 }, { "EUC-KR", 0 }, { "KOI8-R", 0 }, { "KOI8-U", 0 },
+};
+
+static int is_ascii_codepage(const char *codepage)
+{
+	const char *name;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(ascii_codepages) / sizeof(ascii_codepages[0]);
+	     i++) {
+		name = ascii_codepages[i].name;
+		if (ascii_codepages[i].prefix ?
+		    !strncasecmp(codepage, name, strlen(name)) :
+		    !strcasecmp(codepage, name))
+			return 1;
+	}
+	return 0;
+}
+
+static size_t ascii_to_utf16_scalar(const unsigned char *src, size_t len,
+		__le16 *dst)
+{
+	size_t i;
+
+	for (i = 0; i < len && src[i] < 0x80; i++)
+		dst[i] = cpu_to_le16(src[i]);
+	return i;
+}
+
+#ifdef __SSE2__
+static size_t ascii_to_utf16_sse2(const unsigned char *src, size_t len,
+		__le16 *dst)
+{
+	__m128i zero = _mm_setzero_si128(), v;
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		if (_mm_movemask_epi8(v))
+			break;
+		_mm_storeu_si128((__m128i *)(dst + i),
+				_mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i *)(dst + i + 8),
+				_mm_unpackhi_epi8(v, zero));
+	}
+	/* the tail, or the block holding the first non-ASCII byte */
+	return i + ascii_to_utf16_scalar(src + i, len - i, dst + i);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_ASCII_AVX2
+__attribute__((target("avx2")))
+static size_t ascii_to_utf16_avx2(const unsigned char *src, size_t len,
+		__le16 *dst)
+{
+	__m256i v;
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		if (_mm256_movemask_epi8(v))
+			break;
+		_mm256_storeu_si256((__m256i *)(dst + i),
+			_mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+		_mm256_storeu_si256((__m256i *)(dst + i + 16),
+			_mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+	}
+	return i + ascii_to_utf16_scalar(src + i, len - i, dst + i);
+}
+#endif
+#endif
+
+static size_t (*ascii_to_utf16)(const unsigned char *src, size_t len,
+		__le16 *dst) = ascii_to_utf16_scalar;
+static pthread_once_t ascii_once = PTHREAD_ONCE_INIT;
+
+static void ascii_select(void)
+{
+#ifdef __SSE2__
+	ascii_to_utf16 = ascii_to_utf16_sse2;
+#ifdef HAVE_ASCII_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		ascii_to_utf16 = ascii_to_utf16_avx2;
+#endif
+#endif
+}
+
+static int is_utf8_codepage(const char *codepage)
+{
+	return !strcasecmp(codepage, "UTF-8") || !strcasecmp(codepage, "UTF8");
+}
+
+#define UTF16_UNIT(s, i)	((s)[2 * (i)] | (s)[2 * (i) + 1] << 8)
+
+/**
+ * cptable_to_utf16() - widen a string with a built-in codepage table
+ * @table:	codepage table
+ * @src:	source string
+ * @len:	number of bytes
+ * @dst:	output, room for @len code units
+ *
+ * Return:	0 on success, -EINVAL if a byte has no character
+ */
+static int cptable_to_utf16(const __u16 *table, const unsigned char *src,
+		size_t len, __le16 *dst)
+{
+	unsigned int none = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		dst[i] = cpu_to_le16(table[src[i]]);
+		none |= table[src[i]] == CPTABLE_NONE;
+	}
+	return none ? -EINVAL : 0;
+}
+
+/**
+ * cptable_strndup() - narrow a UTF-16LE string with a built-in table
+ * @cp:		codepage with a table
+ * @src:	UTF-16LE string
+ * @len:	maximum number of code units
+ *
+ * Return:	allocated NUL terminated string, ERR_PTR() on error
+ */
+static char *cptable_strndup(const struct cifsd_codepage *cp,
+		const unsigned char *src, size_t len)
+{
+	unsigned char *page;
+	unsigned int c;
+	size_t i, n;
+	char *dst;
+
+	for (n = 0; n < len && UTF16_UNIT(src, n); n++)
+		;
+
+	dst = (char *) malloc(n + 1);
+	if (!dst)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < n; i++) {
+		c = UTF16_UNIT(src, i);
+		page = cp->from_ucs[c >> 8];
+		/* only U+0000 maps to 0x00, and it ends the string */
+		if (!page || !page[c & 0xFF]) {
+			cifsd_err("Error in conversion of string, U+%04X is "
+					"not in %s\n", c, cp->name);
+			free(dst);
+			return ERR_PTR(-EINVAL);
+		}
+		dst[i] = page[c & 0xFF];
+	}
+	dst[n] = '\0';
+	return dst;
+}
+
+/* "iso-8859-1", "ISO_8859-1" and "iso88591" all name one table */
+static void cptable_name(const char *name, char *buf)
+{
+	char *p = buf;
+
+	for (; *name && p < buf + CIFSD_CODEPAGE_LEN - 1; name++) {
+		if (*name != '-' && *name != '_' && *name != ' ')
+			*p++ = toupper((unsigned char)*name);
+	}
+	*p = '\0';
+
+	if (!strncmp(buf, "WINDOWS", 7))
+		memmove(buf + 2, buf + 7, strlen(buf + 7) + 1);
+	else if (!strncmp(buf, "IBM", 3))
+		memmove(buf + 2, buf + 3, strlen(buf + 3) + 1);
+	else
+		return;
+	memcpy(buf, "CP", 2);
+}
+
+static const __u16 *cptable_find(const char *name)
+{
+	char key[CIFSD_CODEPAGE_LEN], table_key[CIFSD_CODEPAGE_LEN];
+	const struct cptable *t;
+
+	cptable_name(name, key);
+	for (t = cptables; t->name; t++) {
+		cptable_name(t->name, table_key);
+		if (!strcmp(key, table_key))
+			return t->to_ucs;
+	}
+	return NULL;
+}
+
+/**
+ * cptable_bind() - bind a built-in table to a codepage
+ * @cp:		codepage being interned
+ * @table:	its table
+ *
+ * Return:	0 on success, -ENOMEM on error
+ */
+static int cptable_bind(struct cifsd_codepage *cp, const __u16 *table)
+{
+	unsigned int b, c;
+
+	cp->from_ucs = calloc(256, sizeof(unsigned char *));
+	if (!cp->from_ucs)
+		return -ENOMEM;
+
+	/* the lowest byte wins where several map to one code point */
+	for (b = 255; b > 0; b--) {
+		c = table[b];
+		if (c == CPTABLE_NONE)
+			continue;
+		if (!cp->from_ucs[c >> 8]) {
+			cp->from_ucs[c >> 8] = calloc(1, 256);
+			if (!cp->from_ucs[c >> 8])
+				goto fail;
+		}
+		cp->from_ucs[c >> 8][c & 0xFF] = b;
+	}
+
+	cp->to_ucs = table;
+	cp->flags = CP_ASCII;
+	for (b = 0; b < 0x80; b++) {
+		if (table[b] != b)
+			cp->flags = 0;
+	}
+	return 0;
+
+fail:
+	for (c = 0; c < 256; c++)
+		free(cp->from_ucs[c]);
+	free(cp->from_ucs);
+	cp->from_ucs = NULL;
+	return -ENOMEM;
+}
+
+/**
+ * codepage_probe() - set the flags of a codepage without built-in table
+ * @cp:		codepage being interned
+ */
+static void codepage_probe(struct cifsd_codepage *cp)
+{
+	iconv_t conv;
+
+	if (is_ascii_codepage(cp->name))
+		cp->flags |= CP_ASCII;
+	if (is_utf8_codepage(cp->name))
+		cp->flags |= CP_UTF8;
+
+	conv = init_conversion(cp->name, 0);
+	if (conv != (iconv_t)-1) {
+		cp->flags |= CP_TO_UTF16;
+		close_conversion(conv);
+	}
+	conv = init_conversion(cp->name, 1);
+	if (conv != (iconv_t)-1) {
+		cp->flags |= CP_FROM_UTF16;
+		close_conversion(conv);
+	}
+}
+
+/**
+ * codepage_overflow_add() - get the ID of a codepage beyond the table
+ * @name:	codepage name
+ *
+ * Such codepages take the plain iconv path, opening a descriptor for
+ * each conversion. Called with codepage_lock held.
+ *
+ * Return:	codepage ID, -ENOMEM on error
+ */
+static int codepage_overflow_add(const char *name)
+{
+	struct cifsd_codepage *cp;
+
+	for (cp = codepage_overflow; cp; cp = cp->next) {
+		if (!strcmp(cp->name, name))
+			return cp->id;
+	}
+
+	cp = calloc(1, sizeof(struct cifsd_codepage));
+	if (!cp)
+		return -ENOMEM;
+
+	strcpy(cp->name, name);
+	codepage_probe(cp);
+	cp->id = codepage_overflow ? codepage_overflow->id + 1 :
+		CIFSD_CODEPAGE_MAX;
+	cp->next = codepage_overflow;
+	__atomic_store_n(&codepage_overflow, cp, __ATOMIC_RELEASE);
+	cifsd_info("codepage table full, %s is converted uncached\n", name);
+	return cp->id;
+}
+
+/**
+ * codepage_intern() - get the ID of a codepage
+ * @name:	codepage name, as sent by the kernel
+ *
+ * The first time a name is seen, it is bound to its built-in table if
+ * there is one. Otherwise the conversions iconv has for it are probed,
+ * so an unknown codepage is reported once and its conversions fail
+ * without asking iconv again. Once the table is full, names are only
+ * remembered, see codepage_overflow_add().
+ *
+ * Return:	codepage ID, -errno on error
+ */
+int codepage_intern(const char *name)
+{
+	struct cifsd_codepage *cp;
+	const __u16 *table;
+	int i, ret;
+
+	if (strnlen(name, CIFSD_CODEPAGE_LEN) >= CIFSD_CODEPAGE_LEN)
+		return -EINVAL;
+
+	pthread_mutex_lock(&codepage_lock);
+	for (i = 0; i < nr_codepages; i++) {
+		if (!strcmp(codepages[i].name, name))
+			goto out;
+	}
+
+	if (nr_codepages == CIFSD_CODEPAGE_MAX) {
+		i = codepage_overflow_add(name);
+		goto out;
+	}
+
+	cp = &codepages[i];
+	strcpy(cp->name, name);
+	cp->flags = 0;
+	table = cptable_find(name);
+	if (table) {
+		ret = cptable_bind(cp, table);
+		if (ret) {
+			pthread_mutex_unlock(&codepage_lock);
+			return ret;
+		}
+		goto add;
+	}
+
+	codepage_probe(cp);
+add:
+	__atomic_store_n(&nr_codepages, i + 1, __ATOMIC_RELEASE);
+	cifsd_debug("codepage %s has ID %d, flags 0x%x\n", name, i,
+			cp->flags);
+out:
+	pthread_mutex_unlock(&codepage_lock);
+	return i;
+}
+
+/*
+ * The UTF-16LE decoder runs twice over the string: once to validate it
+ * and size the output, then to encode into a buffer of exactly that
+ * size. SSE2 takes 8 code units at a time where no surrogate, NUL or
+ * mix of widths gets in the way, the scalar step handles the rest.
+ */
+
+/* scalar step: size one character, return units used or -EINVAL */
+static int utf16_char_len(const unsigned char *src, size_t i, size_t len,
+		size_t *bytes)
+{
+	unsigned int c = UTF16_UNIT(src, i);
+
+	if (c < 0x80) {
+		*bytes += 1;
+	} else if (c < 0x800) {
+		*bytes += 2;
+	} else if ((c & 0xF800) != 0xD800) {
+		*bytes += 3;
+	} else {
+		if (c >= 0xDC00 || i + 1 >= len ||
+		    (UTF16_UNIT(src, i + 1) & 0xFC00) != 0xDC00)
+			return -EINVAL;
+		*bytes += 4;
+		return 2;
+	}
+	return 1;
+}
+
+/**
+ * utf16_utf8_len() - validate a UTF-16LE string and size its UTF-8 form
+ * @src:	UTF-16LE string
+ * @len:	maximum number of code units
+ * @units:	set to the number of code units up to the first NUL
+ *
+ * Return:	UTF-8 length without NUL, -EINVAL on unpaired surrogate
+ */
+static long utf16_utf8_len(const unsigned char *src, size_t len,
+		size_t *units)
+{
+	size_t i = 0, end, bytes = 0;
+	int ret;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i m80 = _mm_set1_epi16((short)0xFF80);
+	__m128i m800 = _mm_set1_epi16((short)0xF800);
+	__m128i sur = _mm_set1_epi16((short)0xD800);
+	__m128i ones = _mm_set1_epi16(1);
+	__m128i saved = _mm_setzero_si128(), v, hi;
+	int lanes[4];
+#endif
+
+	while (i < len) {
+#ifdef __SSE2__
+		for (; i + 8 <= len; i += 8) {
+			v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+			hi = _mm_and_si128(v, m800);
+			if (_mm_movemask_epi8(_mm_or_si128(
+					_mm_cmpeq_epi16(v, zero),
+					_mm_cmpeq_epi16(hi, sur))))
+				break;
+			/* 3 bytes each, one less below 0x800, two below 0x80 */
+			bytes += 24;
+			saved = _mm_sub_epi32(saved, _mm_madd_epi16(
+				_mm_add_epi16(_mm_cmpeq_epi16(
+					_mm_and_si128(v, m80), zero),
+					_mm_cmpeq_epi16(hi, zero)), ones));
+		}
+#endif
+		for (end = i + 8; i < len && i < end; i += ret) {
+			if (!UTF16_UNIT(src, i))
+				goto out;
+			ret = utf16_char_len(src, i, len, &bytes);
+			if (ret < 0)
+				return ret;
+		}
+	}
+out:
+#ifdef __SSE2__
+	_mm_storeu_si128((__m128i *)lanes, saved);
+	bytes -= (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+	*units = i;
+	return bytes;
+}
+
+/**
+ * utf16_to_utf8() - encode a string checked by utf16_utf8_len()
+ * @src:	UTF-16LE string
+ * @len:	code units to encode
+ * @dst:	output, large enough for the size found by utf16_utf8_len()
+ */
+static void utf16_to_utf8(const unsigned char *src, size_t len,
+		unsigned char *dst)
+{
+	size_t i = 0, end;
+	unsigned int c;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i m80 = _mm_set1_epi16((short)0xFF80);
+	__m128i m800 = _mm_set1_epi16((short)0xF800);
+	__m128i v;
+	int ascii, narrow;
+#endif
+
+	while (i < len) {
+#ifdef __SSE2__
+		for (; i + 8 <= len; i += 8) {
+			v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+			ascii = _mm_movemask_epi8(_mm_cmpeq_epi16(
+					_mm_and_si128(v, m80), zero));
+			if (ascii == 0xFFFF) {
+				_mm_storel_epi64((__m128i *)dst,
+						_mm_packus_epi16(v, v));
+				dst += 8;
+				continue;
+			}
+			narrow = _mm_movemask_epi8(_mm_cmpeq_epi16(
+					_mm_and_si128(v, m800), zero));
+			if (ascii || narrow != 0xFFFF)
+				break;
+			/* 0x80-0x7ff: 110xxxxx 10xxxxxx, one LE word each */
+			_mm_storeu_si128((__m128i *)dst, _mm_or_si128(
+				_mm_or_si128(_mm_srli_epi16(v, 6),
+					_mm_slli_epi16(_mm_and_si128(v,
+						_mm_set1_epi16(0x3F)), 8)),
+				_mm_set1_epi16((short)0x80C0)));
+			dst += 16;
+		}
+#endif
+		for (end = i + 8; i < len && i < end; i++) {
+			c = UTF16_UNIT(src, i);
+			if (c < 0x80) {
+				*dst++ = c;
+				continue;
+			}
+			if (c < 0x800) {
+				*dst++ = 0xC0 | c >> 6;
+			} else {
+				if ((c & 0xF800) == 0xD800) {
+					i++;
+					c = 0x10000 + ((c - 0xD800) << 10) +
+						(UTF16_UNIT(src, i) - 0xDC00);
+					*dst++ = 0xF0 | c >> 18;
+					*dst++ = 0x80 | (c >> 12 & 0x3F);
+				} else {
+					*dst++ = 0xE0 | c >> 12;
+				}
+				*dst++ = 0x80 | (c >> 6 & 0x3F);
+			}
+			*dst++ = 0x80 | (c & 0x3F);
+		}
+	}
+}
+
+/**
+ * smb_strndup_from_utf16() - convert a UTF-16LE string to codepage @cp
+ * @src:	source string
+ * @maxlen:	maximum number of characters to convert
+ * @is_unicode:	@src is UTF-16LE, otherwise it is copied as is
+ * @cp:		codepage ID of the result
+ *
+ * UTF-8, codepages with a built-in table, and plain ASCII for codepages
+ * extending it, are decoded here, other strings go through iconv.
+ *
+ * Return:	allocated NUL terminated string, ERR_PTR() on error
+ */
 char *smb_strndup_from_utf16(char *src, const int maxlen,
-		const int is_unicode, const char *codepage)
+		const int is_unicode, int cp)
 {
-	size_t dstlen, srclen;
+	const struct cifsd_codepage *cpg = codepage_get(cp);
+	size_t dstlen, srclen, units;
 	size_t ret;
 	char *dst, *start_dst;
+	unsigned int flags;
 	iconv_t conv;
+	long len;
 	srclen = maxlen;
 
 	if (is_unicode) {
+		if (maxlen < 0)
+			return ERR_PTR(-EINVAL);
+		if (cpg->to_ucs)
+			return cptable_strndup(cpg, (unsigned char *)src,
+					maxlen);
+
+		flags = cpg->flags;
+		len = utf16_utf8_len((unsigned char *)src, maxlen, &units);
+		if (len >= 0 && (flags & CP_UTF8 ||
+		    ((size_t)len == units && flags & CP_ASCII))) {
+			dst = (char *) malloc(len + 1);
+			if (!dst)
+				return ERR_PTR(-ENOMEM);
+			utf16_to_utf8((unsigned char *)src, units,
+					(unsigned char *)dst);
+			dst[len] = '\0';
+			return dst;
+		}
+		if (len < 0 && flags & CP_UTF8) {
+			cifsd_err("Error in conversion of string, "
+					"unpaired surrogate\n");
+			return ERR_PTR(-EINVAL);
+		}
+
 		srclen = maxlen * 2;
-		conv = init_conversion(codepage, 1);
+		conv = get_conversion(cp, 1);
 		if (conv == (iconv_t) -1)
 			return ERR_PTR(-EINVAL);
 
 		dstlen = UNICODE_LEN(srclen);
-		dst = (char*) malloc(dstlen);
+		dst = (char*) malloc(dstlen + 1);
 		if (!dst) {
-			close_conversion(conv);
+			put_conversion(cp, conv);
 			return ERR_PTR(-ENOMEM);
 		}
 		start_dst = dst;
@@ -117,11 +868,12 @@ char *smb_strndup_from_utf16(char *src, const int maxlen,
 		if (ret == -1) {
 			cifsd_err("Error in conversion of string, errno %d\n",
 					errno);
+			put_conversion(cp, conv);
 			free(start_dst);
-			close_conversion(conv);
 			return ERR_PTR(-EINVAL);
 		}
-		close_conversion(conv);
+		put_conversion(cp, conv);
+		*dst = '\0';
 		dst = start_dst;
 	} else {
 		dstlen = strnlen(src, srclen);
@@ -135,37 +887,62 @@ char *smb_strndup_from_utf16(char *src, const int maxlen,
 }
 
 int smbConvertToUTF16(__le16 *target, char *source, int slen,
-		int targetlen, const char *codepage)
+		int targetlen, int cp)
 {
+	const struct cifsd_codepage *cpg = codepage_get(cp);
 	iconv_t conv;
 	size_t ret;
 	size_t srclen, dstlen;
 	char *tmp = (char*) target;
 
 	srclen = slen;
-	dstlen = targetlen;	
+	dstlen = targetlen;
+
+	/* the ASCII prefix is widened here, the table or iconv the rest */
+	if (cpg->flags & CP_ASCII) {
+		pthread_once(&ascii_once, ascii_select);
+		ret = ascii_to_utf16((unsigned char *)source,
+				srclen < dstlen / 2 ? srclen : dstlen / 2,
+				target);
+		source += ret;
+		srclen -= ret;
+		tmp += ret * 2;
+		dstlen -= ret * 2;
+		if (!srclen)
+			return 0;
+	}
 
-	conv = init_conversion(codepage, 0);
+	if (cpg->to_ucs) {
+		ret = srclen <= dstlen / 2 ? srclen : dstlen / 2;
+		if (cptable_to_utf16(cpg->to_ucs,
+				(unsigned char *)source, ret, (__le16 *)tmp) ||
+		    ret < srclen) {
+			cifsd_err("Error in conversion of string\n");
+			return -EINVAL;
+		}
+		return 0;
+	}
+
+	conv = get_conversion(cp, 0);
 	if (conv == (iconv_t) -1)
 		return -EINVAL;
 
 	ret = iconv(conv, &source, &srclen, &tmp, &dstlen);
+	put_conversion(cp, conv);
 	if (ret == -1) {
 		cifsd_err("Error in conversion of string\n");
-		close_conversion(conv);
 		return -EINVAL;
 	}
-	close_conversion(conv);	
 	return 0;
 }
 
 /**
  * build_ntlmssp_challenge_blob() - helper function to construct challenge blob
  * @chgblob:	challenge blob source pointer to initialize
- * @codepage:	character codepage type
+ * @cp:		codepage ID
  *
  */
-unsigned int build_ntlmssp_challenge_blob(CHALLENGE_MESSAGE *chgblob, char *codepage)
+unsigned int build_ntlmssp_challenge_blob(CHALLENGE_MESSAGE *chgblob, int cp)
 {
 	TargetInfo *tinfo;
 	__le16 name[8];
@@ -185,7 +962,7 @@ unsigned int build_ntlmssp_challenge_blob(CHALLENGE_MESSAGE *chgblob, char *code
 	chgblob->NegotiateFlags = cpu_to_le32(flags);
 
 	ret = smbConvertToUTF16(name, netbios_name, strlen(netbios_name), 8,
-			codepage);
+			cp);
 	if (ret < 0 )
 		return -EINVAL;
 
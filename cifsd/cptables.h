@@ -0,0 +1,36 @@
+/*
+ *   cifsd-tools/cifsd/cptables.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_CPTABLES_H
+#define __CIFSD_CPTABLES_H
+
+/* byte without a character in the codepage */
+#define CPTABLE_NONE		0xFFFF
+
+/* single-byte codepage, to_ucs[] maps each byte to its code point */
+struct cptable {
+	const char *name;
+	const __u16 *to_ucs;
+};
+
+/* generated by mkcptables.sh, ends with a NULL name */
+extern const struct cptable cptables[];
+
+#endif /* __CIFSD_CPTABLES_H */
@@ -22,6 +22,7 @@
 #include"dcerpc.h"
 #include"winreg.h"
 #include"ntlmssp.h"
+#include"sharereg.h"
 
 struct cifsd_pipe_table cifsd_pipes[] = {
 	{"\\srvsvc", SRVSVC},
@@ -758,15 +759,17 @@ void dcerpc_header_init(RPC_HDR *header, int packet_type,
  * init_srvsvc_share_info1() - initialize srvsvc pipe share information
  * @server:		TCP server instance of connection
  * @rpc_request_req:	rpc request
+ * @reg:		share registry
  *
  * Return:      0 on success or error number
  */
 static int init_srvsvc_share_info1(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct share_registry *reg)
 {
 	int num_shares = 0, cnt = 0, len = 0, ret;
 	int total_pipe_data = 0, data_copied = 0;
-	struct list_head *tmp;
+	unsigned int i;
 	struct cifsd_share *share;
 	SRVSVC_SHARE_INFO1 *share_info;
 	PTR_INFO1 *ptr_info;
@@ -775,7 +778,7 @@ static int init_srvsvc_share_info1(struct cifsd_pipe *pipe,
 	SRVSVC_SHARE_INFO_CTR *sharectr;
 	char *buf = NULL;
 
-	num_shares = cifsd_num_shares; // TBD: cifsd_num_shares;
+	num_shares = reg->nr;
 	sharectr = (SRVSVC_SHARE_INFO_CTR *)
 			calloc(1, sizeof(SRVSVC_SHARE_INFO_CTR));
 	if (!sharectr) {
@@ -816,10 +819,10 @@ static int init_srvsvc_share_info1(struct cifsd_pipe *pipe,
  * need to decide complete logic to get this information
  */
 #if 1
-	list_for_each(tmp, &cifsd_share_list) {
+	for (i = 0; i < reg->nr; i++) {
 		share_info = &sharectr->shares[cnt];
 		ptr_info = &sharectr->ptrs[cnt];
-		share = list_entry(tmp, struct cifsd_share, list);
+		share = reg->shares[i];
 		share_name_len = strlen(share->sharename) + 1;
 
 		if (share_name_len > 13) {
@@ -927,6 +930,7 @@ static int srvsvc_net_share_enum_all(struct cifsd_pipe *pipe, char *data,
 				RPC_REQUEST_REQ *rpc_request_req)
 {
 	SRVSVC_REQ *req = (SRVSVC_REQ *)data;
+	struct share_registry *reg;
 	SERVER_HANDLE handle;
 	char *server_unc_ptr, *server_unc;
 	int server_unc_len = 0;
@@ -955,7 +959,11 @@ static int srvsvc_net_share_enum_all(struct cifsd_pipe *pipe, char *data,
 		cifsd_debug("GOT SRVSVC pipe info level %u\n",
 			       req->info_level);
 
-		ret = init_srvsvc_share_info1(pipe, rpc_request_req);
+		reg = share_registry_get();
+		if (!reg)
+			return -ENOENT;
+		ret = init_srvsvc_share_info1(pipe, rpc_request_req, reg);
+		share_registry_put(reg);
 		break;
 
 	default:
@@ -972,14 +980,15 @@ static int srvsvc_net_share_enum_all(struct cifsd_pipe *pipe, char *data,
  * @server:		TCP server instance of connection
  * @rpc_request_req:	rpc request
  * @share_name:		share_name for which information is requested
+ * @reg:		share registry
  *
  * Return:      0 on success or error number
  */
 int init_srvsvc_share_info2(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *share_name)
+			RPC_REQUEST_REQ *rpc_request_req, char *share_name,
+			struct share_registry *reg)
 {
 	int num_shares = 1, cnt = 0, len = 0;
-	struct list_head *tmp;
 	struct cifsd_share *share;
 	SRVSVC_SHARE_INFO1 *share_info;
 	SRVSVC_SHARE_GETINFO *shareinfo;
@@ -1023,57 +1032,50 @@ int init_srvsvc_share_info2(struct cifsd_pipe *pipe,
  * need to decide complete logic to get this information
  */
 #if 1
-	list_for_each(tmp, &cifsd_share_list) {
+	share = share_registry_lookup(reg, share_name);
+	if (share && strlen(share->sharename) + 1 > 13) {
+		cifsd_err("Not displaying share = %s", share->sharename);
+		share = NULL;
+	}
+
+	if (share) {
 		share_info = &shareinfo->shares[cnt];
 		ptr_info = &shareinfo->ptrs[cnt];
-		share = list_entry(tmp, struct cifsd_share, list);
 		share_name_len = strlen(share->sharename) + 1;
 
-		if (share_name_len > 13) {
-			cifsd_err("Not displaying share = %s",
-					share->sharename);
-			continue;
+		ptr_info->type = STYPE_DISKTREE;
+		if (share->config.comment) {
+			len = smbConvertToUTF16((__le16 *)share_info->comment,
+			share->config.comment, strlen(share->config.comment),
+			256, pipe->codepage);
+			comment_len = strlen(share->config.comment) + 1;
+		} else {
+			len = smbConvertToUTF16((__le16 *)share_info->comment,
+			share->sharename, strlen(share->sharename),
+			256, pipe->codepage);
+			comment_len = strlen(share->sharename) + 1;
 		}
+		cifsd_debug("share %s added\n", share->sharename);
 
-		if (strcmp(share->sharename, share_name) == 0) {
-			ptr_info->type = STYPE_DISKTREE;
-			if (share->config.comment) {
-				len =
-				smbConvertToUTF16((__le16 *)share_info->comment,
-				share->config.comment,
-				strlen(share->config.comment),
-				256, pipe->codepage);
-				comment_len = strlen(share->config.comment) + 1;
-			} else {
-				len =
-				smbConvertToUTF16((__le16 *)share_info->comment,
-				share->sharename, strlen(share->sharename),
-				256, pipe->codepage);
-				comment_len = strlen(share->sharename) + 1;
-			}
-			cifsd_debug("share %s added\n", share->sharename);
+		shareinfo->switch_value = cpu_to_le32(1);
+		cifsd_debug("comment len = %d share len = %d uni len = %d\n",
+			      comment_len, share_name_len, len);
 
-			shareinfo->switch_value = cpu_to_le32(1);
-			cifsd_debug("comment len = %d share len = %d uni len = %d\n",
-				      comment_len, share_name_len, len);
-
-			/* Since sharename and comment are non-null*/
-			ptr_info->ptr_netname = 1;
-			ptr_info->ptr_remark = 1;
-
-			smbConvertToUTF16((__le16 *)share_info->sharename,
-					  share->sharename,
-					  strlen(share->sharename),
-					  256, pipe->codepage);
-			share_info->str_info1.max_count = share_name_len;
-			share_info->str_info1.offset = 0;
-			share_info->str_info1.actual_count = share_name_len;
-
-			share_info->str_info2.max_count = comment_len;
-			share_info->str_info2.offset = 0;
-			share_info->str_info2.actual_count = comment_len;
-			shareinfo->status = cpu_to_le32(WERR_OK);
-		}
+		/* Since sharename and comment are non-null*/
+		ptr_info->ptr_netname = 1;
+		ptr_info->ptr_remark = 1;
+
+		smbConvertToUTF16((__le16 *)share_info->sharename,
+				  share->sharename, strlen(share->sharename),
+				  256, pipe->codepage);
+		share_info->str_info1.max_count = share_name_len;
+		share_info->str_info1.offset = 0;
+		share_info->str_info1.actual_count = share_name_len;
+
+		share_info->str_info2.max_count = comment_len;
+		share_info->str_info2.offset = 0;
+		share_info->str_info2.actual_count = comment_len;
+		shareinfo->status = cpu_to_le32(WERR_OK);
 	}
 #endif
 	return 0;
@@ -1094,6 +1096,7 @@ int srvsvc_net_share_info(struct cifsd_pipe *pipe, char *data,
 				RPC_REQUEST_REQ *rpc_request_req)
 {
 	SRVSVC_REQ *req = (SRVSVC_REQ *)data;
+	struct share_registry *reg;
 	char *server_unc_ptr, *server_unc;
 	int server_unc_len = 0;
 	int ret = 0;
@@ -1134,8 +1137,14 @@ int srvsvc_net_share_info(struct cifsd_pipe *pipe, char *data,
 	case INFO_1:
 		cifsd_debug("GOT SRVSVC pipe info level %u\n",
 			       req->info_level);
+		reg = share_registry_get();
+		if (!reg) {
+			free(share_name);
+			return -ENOENT;
+		}
 		ret = init_srvsvc_share_info2(pipe, rpc_request_req,
-								share_name);
+						share_name, reg);
+		share_registry_put(reg);
 		free(share_name);
 		break;
 
@@ -1575,15 +1584,17 @@ int rpc_bind(struct cifsd_pipe *pipe, char *in_data)
  * @server:	TCP server instance of connection
  * @in_params:	LANMAN request parameters
  * @out_data:	output response buffer
+ * @reg:	share registry
  *
  * Return:      response buffer size or error number
  */
 static int handle_netshareenum_info1(struct cifsd_pipe *pipe,
-				     LANMAN_PARAMS *in_params, char *out_data)
+				     LANMAN_PARAMS *in_params, char *out_data,
+				     struct share_registry *reg)
 {
 	LANMAN_NETSHAREENUM_RESP *resp;
 	NETSHAREINFO1 *info1;
-	struct list_head *tmp;
+	unsigned int i;
 	struct cifsd_share *share;
 	int out_buffersize, comment_len = 0, comment_offset;
 	int num_shares = 0;
@@ -1591,7 +1602,7 @@ static int handle_netshareenum_info1(struct cifsd_pipe *pipe,
 
 	resp = (LANMAN_NETSHAREENUM_RESP *)out_data;
 	info1 = (NETSHAREINFO1 *)resp->RAPOutData;
-	num_shares = cifsd_num_shares;
+	num_shares = reg->nr;
 	comment_offset = num_shares * sizeof(NETSHAREINFO1);
 
 /*
@@ -1599,9 +1610,9 @@ static int handle_netshareenum_info1(struct cifsd_pipe *pipe,
  * need to decide complete logic to get this information
  */
 #if 1
-	list_for_each(tmp, &cifsd_share_list) {
+	for (i = 0; i < reg->nr; i++) {
 		memset(info1, 0, sizeof(NETSHAREINFO1));
-		share = list_entry(tmp, struct cifsd_share, list);
+		share = reg->shares[i];
 		memcpy(info1->NetworkName, share->sharename,
 			strlen(share->sharename));
 
@@ -1666,6 +1677,7 @@ static int handle_netshareenum(struct cifsd_pipe *pipe, LANMAN_REQ *req,
 	char *paramdesc, *datadesc;
 	int paramdesc_len, datadesc_len;
 	LANMAN_PARAMS *in_params;
+	struct share_registry *reg;
 	int info_level;
 	int ret = 0;
 
@@ -1694,7 +1706,12 @@ static int handle_netshareenum(struct cifsd_pipe *pipe, LANMAN_REQ *req,
 	switch (info_level) {
 	case INFO_1:
 		cifsd_debug("GOT RAP_NetshareEnum Info1\n");
-		ret = handle_netshareenum_info1(pipe, in_params, out_data);
+		reg = share_registry_get();
+		if (!reg)
+			return -ENOENT;
+		ret = handle_netshareenum_info1(pipe, in_params, out_data,
+						reg);
+		share_registry_put(reg);
 		break;
 	default:
 		cifsd_debug("Info level = %d not supported\n", info_level);
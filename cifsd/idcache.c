@@ -0,0 +1,352 @@
+/*
+ *   cifsd-tools/cifsd/idcache.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <limits.h>
+#include <libgen.h>
+#include "cifsd.h"
+#include "idcache.h"
+#include "startup.h"
+
+#define ID_CACHE_HEADER		"# cifsd id cache v1\n"
+
+static unsigned int id_hash(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* slot holding @name, or the empty slot it would be added to */
+static struct id_entry *id_cache_slot(struct id_entry *entries,
+		unsigned int size, const char *name)
+{
+	unsigned int i = id_hash(name) & (size - 1);
+
+	while (entries[i].name && strcmp(entries[i].name, name))
+		i = (i + 1) & (size - 1);
+	return &entries[i];
+}
+
+static int id_cache_grow(struct id_cache *cache)
+{
+	unsigned int size = cache->size ? cache->size * 2 : 1024;
+	struct id_entry *entries, *e;
+	unsigned int i;
+
+	entries = calloc(size, sizeof(struct id_entry));
+	if (!entries)
+		return -ENOMEM;
+
+	for (i = 0; i < cache->size; i++) {
+		if (!cache->entries[i].name)
+			continue;
+		e = id_cache_slot(entries, size, cache->entries[i].name);
+		*e = cache->entries[i];
+	}
+
+	free(cache->entries);
+	cache->entries = entries;
+	cache->size = size;
+	return 0;
+}
+
+static struct id_entry *id_cache_add(struct id_cache *cache,
+		const char *name, unsigned int uid, unsigned int gid, int found)
+{
+	struct id_entry *e;
+
+	/* keep the table at most half full */
+	if ((cache->nr + 1) * 2 > cache->size && id_cache_grow(cache))
+		return NULL;
+
+	e = id_cache_slot(cache->entries, cache->size, name);
+	if (!e->name) {
+		e->name = strdup(name);
+		if (!e->name)
+			return NULL;
+		cache->nr++;
+	}
+
+	e->uid = uid;
+	e->gid = gid;
+	e->found = found;
+	return e;
+}
+
+/**
+ * id_cache_enumerate() - fill the cache from the whole passwd database
+ * @cache:	id cache
+ *
+ * Return:	0 on success, -ENOMEM on error
+ */
+static int id_cache_enumerate(struct id_cache *cache)
+{
+	struct passwd *pw;
+	int ret = 0;
+
+	setpwent();
+	while ((pw = getpwent())) {
+		startup_count(STARTUP_NR_NSS, 1);
+		if (!id_cache_add(cache, pw->pw_name, pw->pw_uid,
+				pw->pw_gid, 1)) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
+	endpwent();
+	return ret;
+}
+
+/**
+ * id_cache_read() - fill the cache from the on-disk cache
+ * @cache:	id cache
+ * @path:	cache file
+ * @ttl:	seconds since last update the file is trusted
+ *
+ * Lines are "name:uid:gid", or "name::" for names without account.
+ * A file not newer than PATH_PASSWD is stale, since a changed uid or a
+ * new account would otherwise be hidden by it until @ttl expires.
+ *
+ * Return:	0 on success, -ESTALE if the file is too old, -errno on error
+ */
+static int id_cache_read(struct id_cache *cache, const char *path,
+		unsigned int ttl)
+{
+	char *buf, *line, *next, *uid, *gid;
+	struct stat st, pw;
+	ssize_t len;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (!ttl || st.st_mtime + ttl < time(NULL)) {
+		ret = -ESTALE;
+		goto out;
+	}
+
+	if (!stat(PATH_PASSWD, &pw) &&
+	    (pw.st_mtim.tv_sec > st.st_mtim.tv_sec ||
+	     (pw.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+	      pw.st_mtim.tv_nsec >= st.st_mtim.tv_nsec))) {
+		ret = -ESTALE;
+		goto out;
+	}
+
+	buf = malloc(st.st_size + 1);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	len = read(fd, buf, st.st_size);
+	if (len != st.st_size ||
+	    strncmp(buf, ID_CACHE_HEADER, strlen(ID_CACHE_HEADER))) {
+		free(buf);
+		ret = -EINVAL;
+		goto out;
+	}
+	buf[len] = '\0';
+
+	for (line = buf + strlen(ID_CACHE_HEADER); *line; line = next) {
+		next = strchrnul(line, '\n');
+		if (*next)
+			*next++ = '\0';
+
+		uid = strchr(line, ':');
+		gid = uid ? strchr(uid + 1, ':') : NULL;
+		if (!gid)
+			continue;
+		*uid++ = '\0';
+		*gid++ = '\0';
+
+		if (!id_cache_add(cache, line, strtoul(uid, NULL, 10),
+				strtoul(gid, NULL, 10), *uid != '\0')) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
+	free(buf);
+
+out:
+	close(fd);
+	return ret;
+}
+
+/**
+ * id_cache_load() - build the name to uid/gid map used at account import
+ * @path:	on-disk cache, NULL to always enumerate
+ * @ttl:	seconds since last update the on-disk cache is trusted
+ *
+ * A fresh on-disk cache is used as is. Otherwise the passwd database is
+ * enumerated once with getpwent().
+ *
+ * Return:	id cache on success, NULL on error
+ */
+struct id_cache *id_cache_load(const char *path, unsigned int ttl)
+{
+	struct id_cache *cache;
+	int ret;
+
+	cache = calloc(1, sizeof(struct id_cache));
+	if (!cache)
+		return NULL;
+
+	cache->path = path;
+	if (path) {
+		ret = id_cache_read(cache, path, ttl);
+		if (!ret) {
+			cifsd_debug("%u ids from %s\n", cache->nr, path);
+			return cache;
+		}
+		cifsd_debug("id cache %s not used : %d\n", path, ret);
+	}
+
+	if (id_cache_enumerate(cache)) {
+		id_cache_free(cache);
+		return NULL;
+	}
+
+	cifsd_debug("%u ids from passwd database\n", cache->nr);
+	cache->dirty = 1;
+	return cache;
+}
+
+/**
+ * id_cache_lookup() - resolve a user name to its local uid and gid
+ * @cache:	id cache
+ * @name:	user name
+ *
+ * Names missing from the map are resolved with getpwnam(), and the
+ * result, found or not, is added to the map.
+ *
+ * Return:	entry of the local account, NULL if there is none
+ */
+const struct id_entry *id_cache_lookup(struct id_cache *cache,
+		const char *name)
+{
+	struct id_entry *e;
+	struct passwd *pw;
+
+	if (cache->size) {
+		e = id_cache_slot(cache->entries, cache->size, name);
+		if (e->name) {
+			cache->nr_hits++;
+			return e->found ? e : NULL;
+		}
+	}
+
+	cache->nr_misses++;
+	startup_count(STARTUP_NR_NSS, 1);
+	pw = getpwnam(name);
+	e = id_cache_add(cache, name, pw ? pw->pw_uid : 0,
+			pw ? pw->pw_gid : 0, pw != NULL);
+	if (!e)
+		return NULL;
+
+	cache->dirty = 1;
+	return e->found ? e : NULL;
+}
+
+/**
+ * id_cache_save() - write the map to the on-disk cache
+ * @cache:	id cache
+ *
+ * The file is replaced atomically and only written when it changed.
+ *
+ * Return:	0 on success, -errno on error
+ */
+int id_cache_save(struct id_cache *cache)
+{
+	char tmp[PATH_MAX], dir[PATH_MAX];
+	struct id_entry *e;
+	unsigned int i;
+	FILE *fp;
+	int fd, ret = 0;
+
+	if (!cache->path || !cache->dirty)
+		return 0;
+
+	strncpy(dir, cache->path, PATH_MAX - 1);
+	dir[PATH_MAX - 1] = '\0';
+	mkdir(dirname(dir), 0700);
+
+	snprintf(tmp, PATH_MAX, "%s.tmp", cache->path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		ret = -errno;
+		close(fd);
+		unlink(tmp);
+		return ret;
+	}
+
+	fputs(ID_CACHE_HEADER, fp);
+	for (i = 0; i < cache->size; i++) {
+		e = &cache->entries[i];
+		if (!e->name)
+			continue;
+		if (e->found)
+			fprintf(fp, "%s:%u:%u\n", e->name, e->uid, e->gid);
+		else
+			fprintf(fp, "%s::\n", e->name);
+	}
+
+	if (fclose(fp) || rename(tmp, cache->path)) {
+		ret = -errno;
+		unlink(tmp);
+		return ret;
+	}
+
+	cache->dirty = 0;
+	return 0;
+}
+
+/**
+ * id_cache_free() - release an id cache
+ * @cache:	id cache
+ */
+void id_cache_free(struct id_cache *cache)
+{
+	unsigned int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < cache->size; i++)
+		free(cache->entries[i].name);
+	free(cache->entries);
+	free(cache);
+}
@@ -0,0 +1,53 @@
+/*
+ *   cifsd-tools/cifsd/idcache.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_IDCACHE_H
+#define __CIFSD_IDCACHE_H
+
+#define PATH_PASSWD		"/etc/passwd"
+
+/* seconds an on-disk id cache is trusted before enumerating again */
+#define ID_CACHE_TTL		3600
+
+/* name to uid/gid mapping, found is 0 for names without local account */
+struct id_entry {
+	char *name;
+	unsigned int uid;
+	unsigned int gid;
+	int found;
+};
+
+struct id_cache {
+	struct id_entry *entries;	/* open addressing by name hash */
+	unsigned int size;
+	unsigned int nr;
+	unsigned int nr_hits;
+	unsigned int nr_misses;		/* resolved through getpwnam() */
+	int dirty;			/* differs from the on-disk cache */
+	const char *path;
+};
+
+struct id_cache *id_cache_load(const char *path, unsigned int ttl);
+const struct id_entry *id_cache_lookup(struct id_cache *cache,
+		const char *name);
+int id_cache_save(struct id_cache *cache);
+void id_cache_free(struct id_cache *cache);
+
+#endif /* __CIFSD_IDCACHE_H */
@@ -0,0 +1,135 @@
+#!/bin/sh
+#
+#   cifsd-tools/cifsd/mkcptables.sh
+#
+#   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+#
+# Generate cptables.c, the built-in single-byte codepage tables, from
+# the Unicode mapping files:
+#
+#	wget -r -np -nH --cut-dirs=2 \
+#		https://www.unicode.org/Public/MAPPINGS/
+#	./mkcptables.sh MAPPINGS > cptables.c
+#
+# Each line of a mapping file is "0xNN<tab>0xUUUU<tab>#name", bytes
+# without a character are left out or have no code point. cptables.c
+# is committed, the build does not need the mapping files.
+
+if [ $# -ne 1 ] || [ ! -d "$1" ]; then
+	echo "usage: $0 <unicode MAPPINGS directory>" >&2
+	exit 1
+fi
+dir=$1
+
+# codepage name, then mapping file under $dir
+CODEPAGES="
+CP437		VENDORS/MICSFT/PC/CP437.TXT
+CP850		VENDORS/MICSFT/PC/CP850.TXT
+CP852		VENDORS/MICSFT/PC/CP852.TXT
+CP866		VENDORS/MICSFT/PC/CP866.TXT
+CP1250		VENDORS/MICSFT/WINDOWS/CP1250.TXT
+CP1251		VENDORS/MICSFT/WINDOWS/CP1251.TXT
+CP1252		VENDORS/MICSFT/WINDOWS/CP1252.TXT
+CP1253		VENDORS/MICSFT/WINDOWS/CP1253.TXT
+CP1254		VENDORS/MICSFT/WINDOWS/CP1254.TXT
+CP1256		VENDORS/MICSFT/WINDOWS/CP1256.TXT
+CP1257		VENDORS/MICSFT/WINDOWS/CP1257.TXT
+ISO8859-1	ISO8859/8859-1.TXT
+ISO8859-2	ISO8859/8859-2.TXT
+ISO8859-3	ISO8859/8859-3.TXT
+ISO8859-4	ISO8859/8859-4.TXT
+ISO8859-5	ISO8859/8859-5.TXT
+ISO8859-6	ISO8859/8859-6.TXT
+ISO8859-7	ISO8859/8859-7.TXT
+ISO8859-8	ISO8859/8859-8.TXT
+ISO8859-9	ISO8859/8859-9.TXT
+ISO8859-10	ISO8859/8859-10.TXT
+ISO8859-11	ISO8859/8859-11.TXT
+ISO8859-13	ISO8859/8859-13.TXT
+ISO8859-14	ISO8859/8859-14.TXT
+ISO8859-15	ISO8859/8859-15.TXT
+ISO8859-16	ISO8859/8859-16.TXT
+KOI8-R		VENDORS/MISC/KOI8-R.TXT
+KOI8-U		VENDORS/MISC/KOI8-U.TXT
+"
+
+echo "$CODEPAGES" | while read name file; do
+	[ -n "$name" ] || continue
+	if [ ! -f "$dir/$file" ]; then
+		echo "$0: $dir/$file not found" >&2
+		exit 1
+	fi
+done || exit 1
+
+cat <<EOF
+/*
+ *   cifsd-tools/cifsd/cptables.c
+ *
+ *   Generated by mkcptables.sh from the Unicode mapping files, do not
+ *   edit.
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include "cifsd.h"
+#include "cptables.h"
+EOF
+
+echo "$CODEPAGES" | while read name file; do
+	[ -n "$name" ] || continue
+	ident=$(echo "$name" | tr 'A-Z-' 'a-z_')
+	awk -v ident="$ident" -v file="$file" '
+		/^[ \t]*#/ || NF < 2 { next }
+		$1 ~ /^0x[0-9A-Fa-f][0-9A-Fa-f]$/ && $2 ~ /^0x[0-9A-Fa-f]+$/ {
+			map[tolower(substr($1, 3))] = toupper(substr($2, 3))
+		}
+		END {
+			printf("\n/* %s */\n", file)
+			printf("static const __u16 %s_table[256] = {\n", ident)
+			for (b = 0; b < 256; b++) {
+				key = sprintf("%02x", b)
+				val = (key in map) ? map[key] : "FFFF"
+				while (length(val) < 4)
+					val = "0" val
+				printf("%s0x%s,%s", b % 8 ? " " : "\t", val,
+						b % 8 == 7 ? "\n" : "")
+			}
+			printf("};\n")
+		}' "$dir/$file"
+done
+
+printf "\nconst struct cptable cptables[] = {\n"
+echo "$CODEPAGES" | while read name file; do
+	[ -n "$name" ] || continue
+	ident=$(echo "$name" | tr 'A-Z-' 'a-z_')
+	printf "\t{ \"%s\", %s_table },\n" "$name" "$ident"
+done
+printf "\t{ NULL, NULL },\n};\n"
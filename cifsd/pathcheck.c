@@ -0,0 +1,334 @@
+/*
+ *   cifsd-tools/cifsd/pathcheck.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <time.h>
+#include "cifsd.h"
+#include "list.h"
+#include "pathcheck.h"
+#include "startup.h"
+
+#define PATH_CHECK_PENDING	1
+
+/*
+ * Paths whose stat() is still stuck in a thread of an earlier run. They
+ * are reported timed out right away, so a hung mount costs one thread
+ * however often it is checked.
+ */
+struct stuck_path {
+	struct list_head list;
+	char *path;
+};
+
+static LIST_HEAD(stuck_paths);
+static pthread_mutex_t stuck_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A stat() stuck on a dead NFS or FUSE mount cannot be interrupted, so
+ * the thread running it is left behind. The run is shared by the caller
+ * and its threads and freed by whichever drops the last reference.
+ */
+struct path_check_run {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int refs;
+	int abandoned;
+	unsigned int nr;
+	unsigned int next;		/* next path to pick */
+	unsigned int nr_done;
+	char **paths;
+	int *status;			/* PATH_CHECK_PENDING until done */
+	unsigned long long *started;	/* monotonic ms, set when picked */
+};
+
+static unsigned long long path_check_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int path_is_stuck(const char *path)
+{
+	struct stuck_path *sp;
+
+	list_for_each_entry(sp, &stuck_paths, list) {
+		if (!strcmp(sp->path, path))
+			return 1;
+	}
+	return 0;
+}
+
+static void path_stuck(const char *path)
+{
+	struct stuck_path *sp;
+
+	sp = malloc(sizeof(struct stuck_path));
+	if (sp)
+		sp->path = strdup(path);
+	if (!sp || !sp->path) {
+		free(sp);
+		return;
+	}
+
+	pthread_mutex_lock(&stuck_lock);
+	list_add(&sp->list, &stuck_paths);
+	pthread_mutex_unlock(&stuck_lock);
+}
+
+static void path_unstuck(const char *path)
+{
+	struct stuck_path *sp;
+
+	pthread_mutex_lock(&stuck_lock);
+	list_for_each_entry(sp, &stuck_paths, list) {
+		if (!strcmp(sp->path, path)) {
+			list_del(&sp->list);
+			free(sp->path);
+			free(sp);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stuck_lock);
+}
+
+static void path_check_put(struct path_check_run *run)
+{
+	unsigned int i;
+	int last;
+
+	pthread_mutex_lock(&run->lock);
+	last = !--run->refs;
+	pthread_mutex_unlock(&run->lock);
+	if (!last)
+		return;
+
+	for (i = 0; i < run->nr; i++)
+		free(run->paths[i]);
+	free(run->paths);
+	free(run->status);
+	free(run->started);
+	pthread_cond_destroy(&run->cond);
+	pthread_mutex_destroy(&run->lock);
+	free(run);
+}
+
+static void *path_check_thread(void *arg)
+{
+	struct path_check_run *run = (struct path_check_run *)arg;
+	struct stat st;
+	unsigned int i;
+	int ret;
+
+	pthread_mutex_lock(&run->lock);
+	while (!run->abandoned && run->next < run->nr) {
+		i = run->next++;
+		if (run->status[i] != PATH_CHECK_PENDING)
+			continue;
+		run->started[i] = path_check_now();
+		pthread_mutex_unlock(&run->lock);
+
+		ret = stat(run->paths[i], &st) ? -errno : 0;
+		startup_count(STARTUP_NR_STAT, 1);
+
+		pthread_mutex_lock(&run->lock);
+		/* a path given up on stays timed out */
+		if (run->status[i] == PATH_CHECK_PENDING) {
+			run->status[i] = ret;
+			run->nr_done++;
+			pthread_cond_signal(&run->cond);
+		} else {
+			path_unstuck(run->paths[i]);
+		}
+	}
+	pthread_mutex_unlock(&run->lock);
+
+	path_check_put(run);
+	return NULL;
+}
+
+/**
+ * path_check_spawn() - start a detached thread checking paths of a run
+ * @run:	path check run, locked by the caller
+ *
+ * Signals stay blocked in the thread, so they are never delivered to a
+ * thread stuck in stat().
+ *
+ * Return:	0 on success, -errno on error
+ */
+static int path_check_spawn(struct path_check_run *run)
+{
+	sigset_t all, old;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&thread, &attr, path_check_thread, run);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret)
+		return -ret;
+
+	run->refs++;
+	return 0;
+}
+
+static struct path_check_run *path_check_alloc(const char **paths,
+		unsigned int nr)
+{
+	struct path_check_run *run;
+	pthread_condattr_t attr;
+	unsigned int i;
+
+	run = calloc(1, sizeof(struct path_check_run));
+	if (!run)
+		return NULL;
+
+	run->paths = calloc(nr, sizeof(char *));
+	run->status = calloc(nr, sizeof(int));
+	run->started = calloc(nr, sizeof(unsigned long long));
+	if (!run->paths || !run->status || !run->started)
+		goto fail;
+
+	for (i = 0; i < nr; i++) {
+		run->paths[i] = strdup(paths[i]);
+		if (!run->paths[i])
+			goto fail;
+		run->status[i] = PATH_CHECK_PENDING;
+	}
+
+	pthread_mutex_init(&run->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&run->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	run->nr = nr;
+	run->refs = 1;
+	return run;
+
+fail:
+	if (run->paths) {
+		for (i = 0; i < nr; i++)
+			free(run->paths[i]);
+	}
+	free(run->paths);
+	free(run->status);
+	free(run->started);
+	free(run);
+	return NULL;
+}
+
+/**
+ * path_check() - stat() paths in parallel, giving up on slow ones
+ * @paths:	paths to check
+ * @nr:		number of paths
+ * @status:	per path result: 0, -errno of stat(), -ETIMEDOUT when
+ *		stat() did not return within @timeout_ms, or -EAGAIN when
+ *		no thread was left to check the path
+ * @timeout_ms:	time a single path may take
+ *
+ * Paths are checked by up to PATH_CHECK_THREADS threads. A thread stuck
+ * on a path is replaced, so one hung mount delays the others by at most
+ * @timeout_ms. Until that thread returns, the path is reported as
+ * -ETIMEDOUT without being checked again.
+ *
+ * Return:	0 on success, -ENOMEM on error
+ */
+int path_check(const char **paths, unsigned int nr, int *status,
+		unsigned int timeout_ms)
+{
+	struct path_check_run *run;
+	unsigned long long deadline;
+	unsigned int oldest = 0, i;
+	struct timespec ts;
+
+	if (!nr)
+		return 0;
+
+	run = path_check_alloc(paths, nr);
+	if (!run)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&stuck_lock);
+	for (i = 0; i < nr; i++) {
+		if (path_is_stuck(run->paths[i])) {
+			cifsd_debug("%s still not responding\n", run->paths[i]);
+			run->status[i] = -ETIMEDOUT;
+			run->nr_done++;
+		}
+	}
+	pthread_mutex_unlock(&stuck_lock);
+
+	pthread_mutex_lock(&run->lock);
+	for (i = 0; i < nr - run->nr_done && i < PATH_CHECK_THREADS; i++) {
+		if (path_check_spawn(run))
+			break;
+	}
+	if (!i && run->nr_done < nr) {
+		pthread_mutex_unlock(&run->lock);
+		path_check_put(run);
+		return -ENOMEM;
+	}
+
+	while (run->nr_done < nr) {
+		/* paths are picked in order, the oldest pending one expires first */
+		while (oldest < run->next &&
+		       run->status[oldest] != PATH_CHECK_PENDING)
+			oldest++;
+
+		if (oldest < run->next)
+			deadline = run->started[oldest] + timeout_ms;
+		else
+			deadline = path_check_now() + timeout_ms;
+
+		if (path_check_now() >= deadline) {
+			cifsd_debug("%s timed out\n", run->paths[oldest]);
+			run->status[oldest] = -ETIMEDOUT;
+			run->nr_done++;
+			path_stuck(run->paths[oldest]);
+			/* its thread is stuck, let another take over */
+			if (run->next < nr && path_check_spawn(run)) {
+				for (i = run->next; i < nr; i++) {
+					if (run->status[i] != PATH_CHECK_PENDING)
+						continue;
+					run->status[i] = -EAGAIN;
+					run->nr_done++;
+				}
+				run->next = nr;
+			}
+			continue;
+		}
+
+		ts.tv_sec = deadline / 1000;
+		ts.tv_nsec = (deadline % 1000) * 1000000;
+		pthread_cond_timedwait(&run->cond, &run->lock, &ts);
+	}
+
+	memcpy(status, run->status, nr * sizeof(int));
+	run->abandoned = 1;
+	pthread_mutex_unlock(&run->lock);
+
+	path_check_put(run);
+	return 0;
+}
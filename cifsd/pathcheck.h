@@ -0,0 +1,32 @@
+/*
+ *   cifsd-tools/cifsd/pathcheck.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_PATHCHECK_H
+#define __CIFSD_PATHCHECK_H
+
+/* threads stat()ing share paths at once */
+#define PATH_CHECK_THREADS	8
+/* time a single share path may take to answer stat() */
+#define PATH_CHECK_TIMEOUT_MS	3000
+
+int path_check(const char **paths, unsigned int nr, int *status,
+		unsigned int timeout_ms);
+
+#endif /* __CIFSD_PATHCHECK_H */
@@ -23,10 +23,11 @@
 #include "cifsd.h"
 #include "list.h"
 #include "netlink.h"
+#include "worker.h"
+#include "startup.h"
 #include <sys/inotify.h>
+#include <sys/eventfd.h>
 #include <limits.h>
-#include <pthread.h>
-#include <sys/prctl.h>
 
 #define CREATE	0x1
 #define REMOVE	0x2
@@ -34,10 +35,31 @@
 #define WRITE	0x8
 #define TRANS	0x10
 
-static int notifyd_exist;
-static int fd;
-static pthread_mutex_t mtx_notifyd_exist = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t mtx_cifsd_notify_clients =  PTHREAD_MUTEX_INITIALIZER;
+/* event loop of netlink setup, runs notify delivery and signals */
+static struct evloop *cifsd_loop;
+static int inotify_fd = -1;
+/* watch of the config file directory, and timer of the pending reload */
+static int conf_watch_fd = -1;
+static int conf_reload_tfd = -1;
+static char *conf_watch_name;
+
+/* quiet time after the last change of the config file before reloading */
+#define CONF_RELOAD_DELAY_MS	500
+/* config reload thread, its state is only touched by the event loop */
+static pthread_t conf_reload_thread;
+static int conf_reload_efd = -1;
+static int conf_reload_running;
+static int conf_reload_again;
+static int conf_reload_retry;		/* only retry held back shares */
+static int cifsd_stopping;
+/* timer retrying held back shares */
+static int share_retry_tfd = -1;
+#define SHARE_RETRY_MS		30000
+/* set when pipe requests are handled by worker threads */
+static struct cifsd_worker_pool *cifsd_workers;
+static pthread_mutex_t mtx_cifsd_clients = PTHREAD_MUTEX_INITIALIZER;
+/* winreg keeps one registry tree shared by all pipes */
+static pthread_mutex_t mtx_winreg = PTHREAD_MUTEX_INITIALIZER;
 
 void initialize(void)
 {
@@ -52,11 +74,13 @@ struct cifsd_client_info *lookup_client(__u64 clienthash)
 	struct cifsd_client_info *client;
 	struct list_head *tmp;
 
+	pthread_mutex_lock(&mtx_cifsd_clients);
 	if (!list_empty(&cifsd_clients)) {
 		list_for_each(tmp, &cifsd_clients) {
 			client = list_entry(tmp, struct cifsd_client_info, list);
 			if (client->hash == clienthash) {
 				cifsd_debug("found matching clienthash %llu, client %p\n", clienthash, client);
+				pthread_mutex_unlock(&mtx_cifsd_clients);
 				return client;
 			}
 		}
@@ -70,6 +94,7 @@ struct cifsd_client_info *lookup_client(__u64 clienthash)
 		list_add(&client->list, &cifsd_clients);
 		cifsd_debug("added clienthash %llu\n", clienthash);
 	}
+	pthread_mutex_unlock(&mtx_cifsd_clients);
 	return client;
 }
 
@@ -100,13 +125,13 @@ struct cifsd_pipe *lookup_pipe(__u64 clienthash, int pipetype)
 	return NULL;
 }
 
-static struct cifsd_pipe *initpipe(int pipetype, char *codepage)
+static struct cifsd_pipe *initpipe(int pipetype, int codepage)
 {
 	struct cifsd_pipe *pipe = NULL;
 	pipe = (struct cifsd_pipe*) calloc(1, sizeof(struct cifsd_pipe));
 	if (pipe) {
 		pipe->pipe_type = pipetype;
-		strncpy(pipe->codepage, codepage, CIFSD_CODEPAGE_LEN - 1);
+		pipe->codepage = codepage;
 		INIT_LIST_HEAD(&pipe->list);
 	}
 	return pipe;
@@ -116,8 +141,13 @@ static int cifsd_create_pipe(__u64 clienthash, int pipetype, char *codepage)
 {
         struct cifsd_pipe *pipe;
 	struct cifsd_client_info *client;
+	int cp;
 
-	pipe = initpipe(pipetype, codepage);
+	cp = codepage_intern(codepage);
+	if (cp < 0)
+		return cp;
+
+	pipe = initpipe(pipetype, cp);
 	if (!pipe) {
 		cifsd_err("Failed to allocate memory for cifsd pipe\n");
 		return -ENOMEM;
@@ -154,9 +184,8 @@ static int cifsd_remove_pipe(__u64 clienthash, int pipetype)
 	return 0;
 }
 
-static int handle_create_pipe_event(void *msg)
+static int handle_create_pipe_event(struct nlmsghdr *nlh)
 {
-	struct nlmsghdr *nlh = (struct nlmsghdr *)msg;
 	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
 	int ret;
 
@@ -172,9 +201,8 @@ static int handle_create_pipe_event(void *msg)
 	return ret;
 }
 
-static int handle_remove_pipe_event(void *msg)
+static int handle_remove_pipe_event(struct nlmsghdr *nlh)
 {
-	struct nlmsghdr *nlh = (struct nlmsghdr *)msg;
 	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
 	int ret;
 
@@ -189,9 +217,9 @@ static int handle_remove_pipe_event(void *msg)
 	return ret;
 }
 
-static int handle_read_pipe_event(struct nl_sock *nlsock)
+static int handle_read_pipe_event(struct nl_sock *nlsock,
+		struct nlmsghdr *nlh)
 {
-	struct nlmsghdr *nlh = (struct nlmsghdr *)nlsock->nlsk_rcv_buf;
 	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
 	struct cifsd_uevent rsp_ev;
 	struct cifsd_pipe *pipe;
@@ -200,8 +228,10 @@ static int handle_read_pipe_event(struct nl_sock *nlsock)
 	int nbytes = 0;
 
 	cifsd_debug("READ: on server handle 0x%llx\n", ev->server_handle);
-	assert(ev->k.r_pipe.out_buflen <= NETLINK_CIFSD_MAX_PAYLOAD);
-	buf = calloc(1, NETLINK_CIFSD_MAX_PAYLOAD);
+	/* multipart responses let the kernel ask for more than a page */
+	assert(ev->k.r_pipe.out_buflen <= nl_max_payload(nlsock));
+	buf = calloc(1, ev->k.r_pipe.out_buflen > NETLINK_CIFSD_MAX_PAYLOAD ?
+			ev->k.r_pipe.out_buflen : NETLINK_CIFSD_MAX_PAYLOAD);
 	if (!buf) {
 		cifsd_debug("failed to allocate memory\n");
 		ret = -ENOMEM;
@@ -240,9 +270,9 @@ out:
 	return ret;
 }
 
-static int handle_write_pipe_event(struct nl_sock *nlsock)
+static int handle_write_pipe_event(struct nl_sock *nlsock,
+		struct nlmsghdr *nlh)
 {
-	struct nlmsghdr *nlh = (struct nlmsghdr *)nlsock->nlsk_rcv_buf;
 	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
 	struct cifsd_uevent rsp_ev;
 	struct cifsd_pipe *pipe;
@@ -276,9 +306,9 @@ out:
 	return ret;
 }
 
-static int handle_ioctl_pipe_event(struct nl_sock *nlsock)
+static int handle_ioctl_pipe_event(struct nl_sock *nlsock,
+		struct nlmsghdr *nlh)
 {
-	struct nlmsghdr *nlh = (struct nlmsghdr *)nlsock->nlsk_rcv_buf;
 	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
 	struct cifsd_uevent rsp_ev;
 	struct cifsd_pipe *pipe;
@@ -287,8 +317,9 @@ static int handle_ioctl_pipe_event(struct nl_sock *nlsock)
 	int nbytes = 0;
 
 	cifsd_debug("IOCTL: on server handle %llu\n", ev->server_handle);
-	assert(ev->k.i_pipe.out_buflen <= NETLINK_CIFSD_MAX_PAYLOAD);
-	buf = calloc(1, NETLINK_CIFSD_MAX_PAYLOAD);
+	assert(ev->k.i_pipe.out_buflen <= nl_max_payload(nlsock));
+	buf = calloc(1, ev->k.i_pipe.out_buflen > NETLINK_CIFSD_MAX_PAYLOAD ?
+			ev->k.i_pipe.out_buflen : NETLINK_CIFSD_MAX_PAYLOAD);
 	if (!buf) {
 		cifsd_debug("failed to allocate memory\n");
 		ret = -ENOMEM;
@@ -333,9 +364,9 @@ out:
 	return ret;
 }
 
-static int handle_lanman_pipe_event(struct nl_sock *nlsock)
+static int handle_lanman_pipe_event(struct nl_sock *nlsock,
+		struct nlmsghdr *nlh)
 {
-	struct nlmsghdr *nlh = (struct nlmsghdr *)nlsock->nlsk_rcv_buf;
 	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
 	struct cifsd_uevent rsp_ev;
 	struct cifsd_pipe *pipe;
@@ -479,90 +510,105 @@ static void send_rsp_ev(struct nl_sock *nlsock,
 		sizeof(struct FileNotifyInformation) + NAME_MAX);
 }
 
-static void *read_inotify_event(void *nlsock)
+/**
+ * complete_notify_clients() - answer every notify request waiting on a
+ *			watch descriptor and drop the watch
+ * @nlsock:	netlink socket
+ * @event:	inotify event for the watch descriptor
+ */
+static void complete_notify_clients(struct nl_sock *nlsock,
+	struct inotify_event *event)
 {
 	struct smb2_inotify_res_info *noti_info_res_buf;
-	struct cifsd_notify_client_info *notify_client = NULL;
-	struct list_head *tmp;
-	int num_event;
-	int wd;
-	const int event_size = (sizeof(struct inotify_event) + NAME_MAX + 1);
-	const int BUF_LEN = (10 * event_size);
-	char inotify_event_buf[BUF_LEN];
-	struct inotify_event *ie_buf = NULL;
+	struct cifsd_notify_client_info *notify_client;
+	struct list_head *tmp, *t;
 
-	for (;;) {
-		num_event = read(fd, inotify_event_buf, BUF_LEN);
-		if (num_event == 0)
-			cifsd_err("num_event is zero\n");
-		else if (num_event == -1)
-			cifsd_err("inotify read failure\n");
-		cifsd_debug("%ld bytes read from inodify fd(%d)\n",
-			(long)num_event, fd);
+	noti_info_res_buf = (struct smb2_inotify_res_info *)malloc(
+		sizeof(struct smb2_inotify_res_info) +
+		sizeof(struct FileNotifyInformation) + NAME_MAX);
+	if (!noti_info_res_buf)
+		return;
 
-		/*
-		 * len == 0 means event occurred on the base directory.
-		 * just ignore the event in that case.
-		 */
-		ie_buf = (struct inotify_event *)inotify_event_buf;
-		if (ie_buf->len == 0)
+	list_for_each_safe(tmp, t, &cifsd_notify_clients) {
+		notify_client = list_entry(tmp,
+			struct cifsd_notify_client_info, list);
+		if (notify_client->wd != event->wd)
 			continue;
 
-		noti_info_res_buf = (struct smb2_inotify_res_info *)malloc(
+		cifsd_debug("netlink event target : notify_client->hash %llu\n",
+			notify_client->hash);
+		memset(noti_info_res_buf, 0,
 			sizeof(struct smb2_inotify_res_info) +
 			sizeof(struct FileNotifyInformation) + NAME_MAX);
-		if (!noti_info_res_buf) {
-			close(fd);
-			pthread_mutex_lock(&mtx_notifyd_exist);
-			notifyd_exist = 0;
-			pthread_mutex_unlock(&mtx_notifyd_exist);
-			return (void *)NULL;
-		}
-
-		pthread_mutex_lock(&mtx_cifsd_notify_clients);
-		list_for_each(tmp, &cifsd_notify_clients) {
-			notify_client = list_entry(tmp,
-				struct cifsd_notify_client_info, list);
-			ie_buf = (struct inotify_event *)inotify_event_buf;
-			wd = ie_buf->wd;
-			if (notify_client->wd == wd) {
-				cifsd_debug("netlink event target : notify_client->hash %llu\n",
-					notify_client->hash);
-				break;
-			}
-		}
-		pthread_mutex_unlock(&mtx_cifsd_notify_clients);
-
-		fill_noti_info_res(notify_client,
-			inotify_event_buf, noti_info_res_buf);
+		fill_noti_info_res(notify_client, (char *)event,
+			noti_info_res_buf);
 		/* TODO : handle multiple inotify events */
 		noti_info_res_buf->output_buffer_length =
 			sizeof(struct FileNotifyInformation)
 			+ noti_info_res_buf->file_notify_info[0].FileNameLength;
 		cifsd_debug("noti_info_res_buf->output_buffer_length : %d\n",
 			noti_info_res_buf->output_buffer_length);
-		send_rsp_ev((struct nl_sock *)nlsock, notify_client,
-				noti_info_res_buf);
-		free(noti_info_res_buf);
+		send_rsp_ev(nlsock, notify_client, noti_info_res_buf);
 		list_del(&notify_client->list);
 		free(notify_client);
-		close(fd);
-
-		break;
 	}
 
-	pthread_mutex_lock(&mtx_notifyd_exist);
-	notifyd_exist = 0;
-	pthread_mutex_unlock(&mtx_notifyd_exist);
-	return (void *)NULL;
+	free(noti_info_res_buf);
+	inotify_rm_watch(inotify_fd, event->wd);
+}
+
+/**
+ * read_inotify_event() - event loop callback for the inotify descriptor
+ * @loop:	event loop
+ * @fd:		inotify descriptor
+ * @events:	ready epoll events
+ * @nlsock:	netlink socket to send notify responses on
+ */
+static void read_inotify_event(struct evloop *loop, int fd,
+	unsigned int events, void *nlsock)
+{
+	const int event_size = (sizeof(struct inotify_event) + NAME_MAX + 1);
+	const int BUF_LEN = (10 * event_size);
+	char inotify_event_buf[BUF_LEN]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ie_buf;
+	char *ptr;
+	int num_event;
+
+	for (;;) {
+		num_event = read(fd, inotify_event_buf, BUF_LEN);
+		if (num_event <= 0) {
+			if (num_event == -1 && errno != EAGAIN)
+				cifsd_err("inotify read failure\n");
+			break;
+		}
+		cifsd_debug("%ld bytes read from inodify fd(%d)\n",
+			(long)num_event, fd);
+
+		for (ptr = inotify_event_buf;
+		     ptr < inotify_event_buf + num_event;
+		     ptr += sizeof(struct inotify_event) + ie_buf->len) {
+			ie_buf = (struct inotify_event *)ptr;
+
+			/*
+			 * len == 0 means event occurred on the base directory.
+			 * just ignore the event in that case.
+			 */
+			if (ie_buf->len == 0)
+				continue;
+
+			complete_notify_clients((struct nl_sock *)nlsock,
+				ie_buf);
+		}
+	}
 }
 
 struct cifsd_notify_client_info *lookup_notify_client(struct cifsd_uevent *ev)
 {
 	struct cifsd_notify_client_info *notify_client;
 	struct list_head *tmp;
+	int cp;
 
-	pthread_mutex_lock(&mtx_cifsd_notify_clients);
 	if (!list_empty(&cifsd_notify_clients)) {
 		list_for_each(tmp, &cifsd_notify_clients) {
 			notify_client = list_entry(tmp,
@@ -572,24 +618,22 @@ struct cifsd_notify_client_info *lookup_notify_client(struct cifsd_uevent *ev)
 			if (notify_client->hash == ev->server_handle) {
 				cifsd_debug("found matching ev->server_handle %llu, client %p\n",
 					ev->server_handle, notify_client);
-				pthread_mutex_unlock(&mtx_cifsd_notify_clients);
 				return notify_client;
 			}
 		}
 	}
-	pthread_mutex_unlock(&mtx_cifsd_notify_clients);
 
 	/* no notify_client matched */
+	cp = codepage_intern(ev->codepage);
+	if (cp < 0)
+		return NULL;
+
 	notify_client = calloc(1, sizeof(struct cifsd_notify_client_info));
 	if (notify_client) {
 		INIT_LIST_HEAD(&notify_client->list);
 		notify_client->hash = ev->server_handle;
-		strncpy(notify_client->codepage, ev->codepage,
-			CIFSD_CODEPAGE_LEN);
-		notify_client->codepage[CIFSD_CODEPAGE_LEN-1] = 0;
-		pthread_mutex_lock(&mtx_cifsd_notify_clients);
+		notify_client->codepage = cp;
 		list_add(&notify_client->list, &cifsd_notify_clients);
-		pthread_mutex_unlock(&mtx_cifsd_notify_clients);
 		cifsd_debug("added ev->server_handle : %llu\n",
 			ev->server_handle);
 	}
@@ -611,45 +655,52 @@ static int cifsd_set_wd(struct cifsd_uevent *ev, int wd)
 	return 0;
 }
 
-static int make_inotify_handler_thread(void *nlsock)
+/**
+ * init_inotify() - create the inotify descriptor shared by all notify
+ *		requests and watch it from the event loop
+ * @nlsock:	netlink socket to send notify responses on
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int init_inotify(struct nl_sock *nlsock)
 {
-	pthread_t th;
-	pthread_attr_t attr;
-	const char th_name[] = "cifsd_notifyd";
-	int ret = 0;
+	if (inotify_fd >= 0)
+		return 0;
 
-	ret = pthread_attr_init(&attr);
-	if (ret) {
-		cifsd_err("pthread_attr_init failed : %d\n", ret);
-		goto out;
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		cifsd_err("inotify_init failed!\n");
+		return -ENOENT;
 	}
 
-	ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	if (ret) {
-		cifsd_err("pthread_attr_setdetachstate failed : %d\n", ret);
-		goto out;
+	if (evloop_add_fd(cifsd_loop, inotify_fd, EPOLLIN,
+				read_inotify_event, nlsock)) {
+		close(inotify_fd);
+		inotify_fd = -1;
+		return -ENOENT;
 	}
 
-	ret = pthread_create(&th, &attr, read_inotify_event, nlsock);
-	if (ret) {
-		cifsd_err("pthread_attr_create failed : %d\n", ret);
-		goto out;
-	}
+	return 0;
+}
 
-	ret = pthread_setname_np(th, th_name);
-	if (ret) {
-		cifsd_err("pthread_setname_np failed : %d\n", ret);
-		goto out;
-	}
+static void exit_inotify(void)
+{
+	struct cifsd_notify_client_info *notify_client;
+	struct list_head *tmp, *t;
 
-	ret = pthread_attr_destroy(&attr);
-	if (ret) {
-		cifsd_err("pthread_attr_destroy failed : %d\n", ret);
-		goto out;
+	list_for_each_safe(tmp, t, &cifsd_notify_clients) {
+		notify_client = list_entry(tmp,
+			struct cifsd_notify_client_info, list);
+		list_del(&notify_client->list);
+		free(notify_client);
 	}
 
-out:
-	return ret;
+	if (inotify_fd < 0)
+		return;
+
+	evloop_del_fd(cifsd_loop, inotify_fd);
+	close(inotify_fd);
+	inotify_fd = -1;
 }
 
 static int handle_inotify_request_event(struct nl_sock *nlsock)
@@ -666,18 +717,11 @@ static int handle_inotify_request_event(struct nl_sock *nlsock)
 	inotify_req_info = (struct smb2_inotify_req_info *)buf;
 	mask = convert_completion_filter(inotify_req_info->CompletionFilter);
 
-	pthread_mutex_lock(&mtx_notifyd_exist);
-	if (!notifyd_exist) {
-		pthread_mutex_unlock(&mtx_notifyd_exist);
-		fd = inotify_init();
-		if (fd == -1) {
-			cifsd_err("inotify_init failed!\n");
-			return -ENOENT;
-		}
-	}
-	pthread_mutex_unlock(&mtx_notifyd_exist);
+	ret = init_inotify(nlsock);
+	if (ret)
+		return ret;
 
-	wd = inotify_add_watch(fd,
+	wd = inotify_add_watch(inotify_fd,
 		inotify_req_info->dir_path, mask);
 	if (wd == -1) {
 		cifsd_err("inotify_add_watch failed!\n");
@@ -690,52 +734,83 @@ static int handle_inotify_request_event(struct nl_sock *nlsock)
 		return ret;
 	}
 
-	pthread_mutex_lock(&mtx_notifyd_exist);
-	if (!notifyd_exist)
-		pthread_mutex_unlock(&mtx_notifyd_exist);
-		ret = make_inotify_handler_thread(nlsock);
-		return ret;
-	pthread_mutex_unlock(&mtx_notifyd_exist);
-
 	return ret;
 }
 
-/*
- * once the pipe is available, utilize the code from process_rpc/process_rpc_rsp
- * modify the rpc request/response to use the pipe from above methods
+/**
+ * handle_pipe_request() - handle a pipe event of one server handle
+ * @nlsock:	netlink socket to send the response on
+ * @nlh:	netlink message of the event
+ *
+ * Runs on the netlink thread, or on a worker thread when worker pool is
+ * enabled. Events of the same server handle never run concurrently.
+ *
+ * Return:	0 on success, otherwise error
  */
-int request_handler(struct nl_sock *nlsock)
+static int handle_pipe_request(struct nl_sock *nlsock, struct nlmsghdr *nlh)
 {
-	struct nlmsghdr *nlh = (struct nlmsghdr *)nlsock->nlsk_rcv_buf;
 	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
 	int ret = 0;
 
-	cifsd_debug("got %u event, pipe type %u\n", nlh->nlmsg_type,
-			ev->pipe_type);
+	if (ev->pipe_type == WINREG)
+		pthread_mutex_lock(&mtx_winreg);
 
 	switch (nlh->nlmsg_type) {
 	case CIFSD_KEVENT_CREATE_PIPE:
-		ret = handle_create_pipe_event(nlsock->nlsk_rcv_buf);
+		ret = handle_create_pipe_event(nlh);
 		break;
 
 	case CIFSD_KEVENT_DESTROY_PIPE:
-		ret = handle_remove_pipe_event(nlsock->nlsk_rcv_buf);
+		ret = handle_remove_pipe_event(nlh);
 		break;
 
 	case CIFSD_KEVENT_READ_PIPE:
-		ret = handle_read_pipe_event(nlsock);
+		ret = handle_read_pipe_event(nlsock, nlh);
 		break;
 
 	case CIFSD_KEVENT_WRITE_PIPE:
-		ret = handle_write_pipe_event(nlsock);
+		ret = handle_write_pipe_event(nlsock, nlh);
 		break;
 
 	case CIFSD_KEVENT_IOCTL_PIPE:
-		ret = handle_ioctl_pipe_event(nlsock);
+		ret = handle_ioctl_pipe_event(nlsock, nlh);
 		break;
 
 	case CIFSD_KEVENT_LANMAN_PIPE:
-		ret = handle_lanman_pipe_event(nlsock);
+		ret = handle_lanman_pipe_event(nlsock, nlh);
+		break;
+	}
+
+	if (ev->pipe_type == WINREG)
+		pthread_mutex_unlock(&mtx_winreg);
+
+	return ret;
+}
+
+/*
+ * once the pipe is available, utilize the code from process_rpc/process_rpc_rsp
+ * modify the rpc request/response to use the pipe from above methods
+ */
+int request_handler(struct nl_sock *nlsock)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)nlsock->nlsk_rcv_buf;
+	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
+	int ret = 0;
+
+	cifsd_debug("got %u event, pipe type %u\n", nlh->nlmsg_type,
+			ev->pipe_type);
+
+	switch (nlh->nlmsg_type) {
+	case CIFSD_KEVENT_CREATE_PIPE:
+	case CIFSD_KEVENT_DESTROY_PIPE:
+	case CIFSD_KEVENT_READ_PIPE:
+	case CIFSD_KEVENT_WRITE_PIPE:
+	case CIFSD_KEVENT_IOCTL_PIPE:
+	case CIFSD_KEVENT_LANMAN_PIPE:
+		if (cifsd_workers)
+			ret = worker_pool_queue(cifsd_workers, nlh);
+		else
+			ret = handle_pipe_request(nlsock, nlh);
 		break;
 
 	case CFISD_KEVENT_USER_DAEMON_EXIST:
@@ -756,15 +831,389 @@ int request_handler(struct nl_sock *nlsock)
 	return ret;
 }
 
+/**
+ * init_workers() - start worker pool for pipe requests
+ * @nlsock:	netlink socket
+ *
+ * Responses of worker threads are queued to the netlink thread, which
+ * stays the only writer of the socket.
+ */
+static void init_workers(struct nl_sock *nlsock)
+{
+	if (!ipc_workers)
+		return;
+
+	if (!nlsock->txq) {
+		cifsd_err("no netlink writer, no workers\n");
+		return;
+	}
+
+	cifsd_workers = worker_pool_create(ipc_workers, nlsock,
+			handle_pipe_request);
+	if (!cifsd_workers) {
+		cifsd_err("failed to start %u workers\n", ipc_workers);
+		return;
+	}
+
+	cifsd_info("handling pipe requests on %d workers\n",
+			cifsd_workers->nr_workers);
+}
+
+static void exit_workers(void)
+{
+	if (!cifsd_workers)
+		return;
+
+	worker_pool_destroy(cifsd_workers);
+	cifsd_workers = NULL;
+}
+
+/**
+ * schedule_share_retry() - arm the retry of held back shares
+ *
+ * A retry only checks the held back paths, and a path still stuck in
+ * an earlier check costs no new thread, so retries need no back off.
+ */
+static void schedule_share_retry(void)
+{
+	if (share_retry_tfd < 0)
+		return;
+
+	if (!nr_held_shares) {
+		evloop_set_timer(share_retry_tfd, 0, 0);
+		return;
+	}
+
+	cifsd_debug("retrying %u held back shares in %us\n", nr_held_shares,
+			SHARE_RETRY_MS / 1000);
+	evloop_set_timer(share_retry_tfd, SHARE_RETRY_MS, 0);
+}
+
+/**
+ * run_reload() - reload the config, or only retry held back shares
+ * @nlsock:	netlink socket
+ * @retry:	only retry held back shares
+ */
+static void run_reload(struct nl_sock *nlsock, int retry)
+{
+	if (retry)
+		cifsd_retry_held_shares(nlsock);
+	else
+		cifsd_reload_config(nlsock);
+}
+
+static void *conf_reload_fn(void *data)
+{
+	uint64_t one = 1;
+
+	run_reload((struct nl_sock *)data, conf_reload_retry);
+	if (write(conf_reload_efd, &one, sizeof(one)) != sizeof(one))
+		perror("eventfd write");
+	return NULL;
+}
+
+/**
+ * start_reload() - reload the config file off the event loop
+ * @nlsock:	netlink socket
+ * @retry:	only retry held back shares
+ *
+ * Checking share paths and waiting for the kernel to take the pushed
+ * shares would stall pipe traffic on the loop, so the reload runs on
+ * its own thread and sends through the netlink writer queue. A reload
+ * asked for while one runs follows once it is done. Retries of held
+ * back shares take the same thread, and are dropped while it is busy.
+ */
+static void start_reload(struct nl_sock *nlsock, int retry)
+{
+	if (conf_reload_efd < 0) {
+		run_reload(nlsock, retry);
+		schedule_share_retry();
+		return;
+	}
+
+	if (conf_reload_running) {
+		if (!retry)
+			conf_reload_again = 1;
+		return;
+	}
+
+	conf_reload_retry = retry;
+
+	if (pthread_create(&conf_reload_thread, NULL, conf_reload_fn,
+				nlsock)) {
+		cifsd_err("failed to start config reload\n");
+		return;
+	}
+	conf_reload_running = 1;
+}
+
+static void conf_reload_done(struct evloop *loop, int fd,
+	unsigned int events, void *data)
+{
+	uint64_t cnt;
+
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return;
+
+	pthread_join(conf_reload_thread, NULL);
+	conf_reload_running = 0;
+
+	if (cifsd_stopping) {
+		evloop_stop(loop);
+		return;
+	}
+
+	if (conf_reload_again) {
+		conf_reload_again = 0;
+		start_reload((struct nl_sock *)data, 0);
+		return;
+	}
+	schedule_share_retry();
+}
+
+static void share_retry_cb(struct evloop *loop, int tfd, void *nlsock)
+{
+	start_reload((struct nl_sock *)nlsock, 1);
+}
+
+/**
+ * init_reload() - prepare config reloads on a thread of their own
+ * @nlsock:	netlink socket
+ *
+ * Without a netlink writer the reload has to read the socket itself,
+ * so it runs on the event loop. Shares held back at startup are retried
+ * from here on.
+ */
+static void init_reload(struct nl_sock *nlsock)
+{
+	share_retry_tfd = evloop_add_timer(cifsd_loop, 0, 0, share_retry_cb,
+			nlsock);
+	if (share_retry_tfd < 0)
+		cifsd_err("failed to add share retry timer\n");
+	schedule_share_retry();
+
+	if (!nlsock->txq)
+		return;
+
+	conf_reload_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (conf_reload_efd < 0) {
+		perror("eventfd");
+		return;
+	}
+
+	if (evloop_add_fd(cifsd_loop, conf_reload_efd, EPOLLIN,
+				conf_reload_done, nlsock)) {
+		close(conf_reload_efd);
+		conf_reload_efd = -1;
+	}
+}
+
+/**
+ * exit_reload() - wait for a running config reload
+ * @nlsock:	netlink socket
+ *
+ * Nothing reads the socket any more, so the requests the reload waits
+ * for are cancelled.
+ */
+static void exit_reload(struct nl_sock *nlsock)
+{
+	if (conf_reload_efd < 0)
+		return;
+
+	if (conf_reload_running) {
+		nl_async_cancel(nlsock);
+		pthread_join(conf_reload_thread, NULL);
+		conf_reload_running = 0;
+	}
+
+	evloop_del_fd(cifsd_loop, conf_reload_efd);
+	close(conf_reload_efd);
+	conf_reload_efd = -1;
+}
+
+static void conf_reload_cb(struct evloop *loop, int tfd, void *nlsock)
+{
+	start_reload((struct nl_sock *)nlsock, 0);
+}
+
+/**
+ * read_conf_watch_event() - event loop callback for the config file watch
+ * @loop:	event loop
+ * @fd:		inotify descriptor
+ * @events:	ready epoll events
+ * @data:	unused
+ *
+ * Editors write the file in place or rename a new one over it, which
+ * may take several events. The reload runs once they settled.
+ */
+static void read_conf_watch_event(struct evloop *loop, int fd,
+	unsigned int events, void *data)
+{
+	const int BUF_LEN = 10 * (sizeof(struct inotify_event) + NAME_MAX + 1);
+	char buf[BUF_LEN]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ie;
+	int changed = 0;
+	char *ptr;
+	int len;
+
+	while ((len = read(fd, buf, BUF_LEN)) > 0) {
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + ie->len) {
+			ie = (struct inotify_event *)ptr;
+			if (ie->len && !strcmp(ie->name, conf_watch_name))
+				changed = 1;
+		}
+	}
+
+	if (changed)
+		evloop_set_timer(conf_reload_tfd, CONF_RELOAD_DELAY_MS, 0);
+}
+
+/**
+ * init_conf_watch() - reload the config file whenever it changes
+ * @nlsock:	netlink socket
+ *
+ * The directory is watched rather than the file, so a file replaced by
+ * rename is still followed.
+ */
+static void init_conf_watch(struct nl_sock *nlsock)
+{
+	char *path, *dir, *name;
+
+	path = strdup(cifsd_conf_path);
+	if (!path)
+		goto fail;
+
+	name = strrchr(path, '/');
+	if (name) {
+		*name++ = '\0';
+		dir = *path ? path : "/";
+	} else {
+		name = path;
+		dir = ".";
+	}
+
+	conf_watch_name = strdup(name);
+	if (!conf_watch_name)
+		goto fail;
+
+	conf_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (conf_watch_fd == -1)
+		goto fail;
+
+	if (inotify_add_watch(conf_watch_fd, dir,
+			IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+		goto fail;
+
+	conf_reload_tfd = evloop_add_timer(cifsd_loop, 0, 0, conf_reload_cb,
+			nlsock);
+	if (conf_reload_tfd < 0)
+		goto fail;
+
+	if (evloop_add_fd(cifsd_loop, conf_watch_fd, EPOLLIN,
+				read_conf_watch_event, NULL))
+		goto fail;
+
+	free(path);
+	return;
+
+fail:
+	cifsd_err("failed to watch %s, reload with SIGHUP\n",
+			cifsd_conf_path);
+	if (conf_watch_fd >= 0)
+		close(conf_watch_fd);
+	conf_watch_fd = -1;
+	free(conf_watch_name);
+	conf_watch_name = NULL;
+	free(path);
+}
+
+static void exit_conf_watch(void)
+{
+	if (conf_watch_fd < 0)
+		return;
+
+	evloop_del_fd(cifsd_loop, conf_watch_fd);
+	close(conf_watch_fd);
+	conf_watch_fd = -1;
+	free(conf_watch_name);
+	conf_watch_name = NULL;
+}
+
+static void cifsd_signal_cb(struct evloop *loop, int signo, void *data)
+{
+	struct nl_sock *nlsock = (struct nl_sock *)data;
+
+	switch (signo) {
+	case SIGINT:
+	case SIGTERM:
+		cifsd_info("received signal %d, exiting\n", signo);
+		/* the reload needs the loop to complete its requests */
+		cifsd_stopping = 1;
+		if (!conf_reload_running)
+			evloop_stop(loop);
+		break;
+	case SIGUSR1:
+		nl_dump_stats(nlsock);
+		conv_dump_stats();
+		break;
+	case SIGHUP:
+		start_reload(nlsock, 0);
+		break;
+	}
+}
+
 int cifsd_netlink_setup(struct nl_sock *nlsock)
 {
+	sigset_t mask;
+
 	initialize();
+
+	cifsd_loop = evloop_create();
+	if (!cifsd_loop) {
+		cifsd_err("failed to create event loop\n");
+		return -ENOMEM;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	if (evloop_add_signal(cifsd_loop, &mask, cifsd_signal_cb, nlsock) < 0)
+		cifsd_err("failed to handle signals from event loop\n");
+
 	nl_handle_init_cifsd(nlsock);
 
+	if (nl_set_bufsize(nlsock, netlink_rcvbuf, netlink_sndbuf))
+		cifsd_err("failed to set netlink buffer sizes\n");
+
+	if (nl_set_batch(nlsock, netlink_batch_size))
+		cifsd_err("failed to set netlink batch size %u\n",
+				netlink_batch_size);
+
+	/* pipe workers and config reloads send through the loop */
+	if (nl_set_writer(nlsock, cifsd_loop))
+		cifsd_err("failed to set netlink writer\n");
+
+	init_workers(nlsock);
+	init_reload(nlsock);
+	init_conf_watch(nlsock);
+
 	nlsock->event_handle_cb = request_handler;
-	nl_loop(nlsock);
+	startup_done();
+	nl_loop(nlsock, cifsd_loop);
 
+	exit_reload(nlsock);
+	exit_workers();
+	nl_clear_writer(nlsock);
 	nl_handle_exit_cifsd(nlsock);
 
+	exit_conf_watch();
+	exit_inotify();
+	evloop_destroy(cifsd_loop);
+	cifsd_loop = NULL;
+
 	return 0;
 }
@@ -0,0 +1,252 @@
+/*
+ *   cifsd-tools/cifsd/sharereg.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <strings.h>
+#include "cifsd.h"
+#include "sharereg.h"
+
+/* current generation, only held to take a reference or replace it */
+static pthread_mutex_t share_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct share_registry *share_registry_current;
+
+/* share names compare case insensitively, as clients send them */
+static unsigned int share_name_hash(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)tolower((unsigned char)*name++);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* index slot holding @name, or the empty slot it would be added to */
+static unsigned int *share_registry_slot(struct share_registry *reg,
+		unsigned int *index, unsigned int size, const char *name)
+{
+	unsigned int i = share_name_hash(name) & (size - 1);
+
+	while (index[i] &&
+	       strcasecmp(reg->shares[index[i] - 1]->sharename, name))
+		i = (i + 1) & (size - 1);
+	return &index[i];
+}
+
+static int share_registry_grow(struct share_registry *reg)
+{
+	unsigned int max = reg->max ? reg->max * 2 : 64;
+	struct cifsd_share **shares;
+	unsigned int *index, i;
+
+	shares = realloc(reg->shares, max * sizeof(struct cifsd_share *));
+	if (!shares)
+		return -ENOMEM;
+	reg->shares = shares;
+
+	/* keep the index at most half full */
+	index = calloc(2 * max, sizeof(unsigned int));
+	if (!index)
+		return -ENOMEM;
+
+	for (i = 0; i < reg->nr; i++)
+		*share_registry_slot(reg, index, 2 * max,
+				reg->shares[i]->sharename) = i + 1;
+
+	free(reg->index);
+	reg->index = index;
+	reg->index_size = 2 * max;
+	reg->max = max;
+	return 0;
+}
+
+static void free_share(struct cifsd_share *share)
+{
+	free(share->config.comment);
+	free(share->sharename);
+	free(share);
+}
+
+/**
+ * alloc_new_share() - allocate new share
+ *
+ * Return:	success: allocated share; fail: NULL
+ */
+static struct cifsd_share *alloc_new_share(void)
+{
+	struct cifsd_share *share = NULL;
+	share = (struct cifsd_share *) calloc(1,
+			sizeof(struct cifsd_share));
+	if (!share)
+		return NULL;
+
+	share->sharename = (char *) calloc(1, SHARE_MAX_NAME_LEN);
+	if (!share->sharename) {
+		free(share);
+		return NULL;
+	}
+
+	share->config.comment = (char *) calloc(1, SHARE_MAX_COMMENT_LEN);
+	if (!share->config.comment) {
+		free(share->sharename);
+		free(share);
+		return NULL;
+	}
+
+	return share;
+}
+
+/**
+ * share_registry_alloc() - allocate an empty, unpublished registry
+ *
+ * Return:	registry holding one reference, NULL on error
+ */
+struct share_registry *share_registry_alloc(void)
+{
+	struct share_registry *reg;
+
+	reg = calloc(1, sizeof(struct share_registry));
+	if (!reg)
+		return NULL;
+
+	if (share_registry_grow(reg)) {
+		free(reg->shares);
+		free(reg);
+		return NULL;
+	}
+
+	reg->refs = 1;
+	return reg;
+}
+
+/**
+ * share_registry_add() - add a share to a registry being built
+ * @reg:	registry, not published yet
+ * @name:	share name
+ * @comment:	comment decribing share
+ * @hash:	fingerprint of the share config section
+ *
+ * A name already in the registry keeps its first definition.
+ *
+ * Return:	share with @name, NULL on error
+ */
+struct cifsd_share *share_registry_add(struct share_registry *reg,
+		const char *name, const char *comment, unsigned long long hash)
+{
+	struct cifsd_share *share;
+	unsigned int *slot;
+
+	if (reg->nr == reg->max && share_registry_grow(reg))
+		return NULL;
+
+	slot = share_registry_slot(reg, reg->index, reg->index_size, name);
+	if (*slot) {
+		cifsd_debug("share[%s] defined twice, first one kept\n", name);
+		return reg->shares[*slot - 1];
+	}
+
+	share = alloc_new_share();
+	if (!share)
+		return NULL;
+
+	strncpy(share->sharename, name, SHARE_MAX_NAME_LEN - 1);
+	if (comment)
+		strncpy(share->config.comment, comment,
+				SHARE_MAX_COMMENT_LEN - 1);
+	share->conf_hash = hash;
+
+	reg->shares[reg->nr++] = share;
+	*slot = reg->nr;
+	return share;
+}
+
+/**
+ * share_registry_lookup() - find a share by name
+ * @reg:	registry
+ * @name:	share name, in any case
+ *
+ * Return:	share, NULL if there is none with @name
+ */
+struct cifsd_share *share_registry_lookup(struct share_registry *reg,
+		const char *name)
+{
+	unsigned int *slot;
+
+	slot = share_registry_slot(reg, reg->index, reg->index_size, name);
+	return *slot ? reg->shares[*slot - 1] : NULL;
+}
+
+/**
+ * share_registry_publish() - make a registry the current generation
+ * @reg:	registry, its reference is handed over; NULL to drop the
+ *		current generation
+ *
+ * The previous generation is freed once its last reader is done.
+ */
+void share_registry_publish(struct share_registry *reg)
+{
+	struct share_registry *old;
+
+	pthread_mutex_lock(&share_registry_lock);
+	old = share_registry_current;
+	share_registry_current = reg;
+	pthread_mutex_unlock(&share_registry_lock);
+
+	if (old)
+		share_registry_put(old);
+}
+
+/**
+ * share_registry_get() - reference the current generation
+ *
+ * The registry stays valid and unchanged until share_registry_put(),
+ * whatever is published meanwhile.
+ *
+ * Return:	current registry, NULL if none is published
+ */
+struct share_registry *share_registry_get(void)
+{
+	struct share_registry *reg;
+
+	pthread_mutex_lock(&share_registry_lock);
+	reg = share_registry_current;
+	if (reg)
+		__atomic_add_fetch(&reg->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&share_registry_lock);
+	return reg;
+}
+
+/**
+ * share_registry_put() - drop a registry reference
+ * @reg:	registry
+ */
+void share_registry_put(struct share_registry *reg)
+{
+	unsigned int i;
+
+	if (__atomic_sub_fetch(&reg->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (i = 0; i < reg->nr; i++)
+		free_share(reg->shares[i]);
+	free(reg->shares);
+	free(reg->index);
+	free(reg);
+}
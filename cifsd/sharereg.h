@@ -0,0 +1,49 @@
+/*
+ *   cifsd-tools/cifsd/sharereg.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_SHAREREG_H
+#define __CIFSD_SHAREREG_H
+
+/*
+ * A registry is one generation of the exported shares. It is filled by
+ * the config loader, then published and never changed again: readers
+ * take a reference on the current generation and use it without lock,
+ * a reload publishes a new one and the old one goes away with its last
+ * reader.
+ */
+struct share_registry {
+	int refs;
+	unsigned int nr;
+	unsigned int max;
+	struct cifsd_share **shares;	/* in config order, IPC$ first */
+	unsigned int *index;		/* shares[] index + 1 by name hash */
+	unsigned int index_size;
+};
+
+struct share_registry *share_registry_alloc(void);
+struct cifsd_share *share_registry_add(struct share_registry *reg,
+		const char *name, const char *comment, unsigned long long hash);
+struct cifsd_share *share_registry_lookup(struct share_registry *reg,
+		const char *name);
+void share_registry_publish(struct share_registry *reg);
+struct share_registry *share_registry_get(void);
+void share_registry_put(struct share_registry *reg);
+
+#endif /* __CIFSD_SHAREREG_H */
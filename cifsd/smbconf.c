@@ -0,0 +1,582 @@
+/*
+ *   cifsd-tools/cifsd/smbconf.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <ctype.h>
+#include <sys/mman.h>
+#include "cifsd.h"
+#include "smbconf.h"
+
+static const struct {
+	const char *name;
+	unsigned int type;
+} conf_known_keys[CONF_NR_KNOWN] = {
+	[CONF_SERVER_STRING]		= { "server string",	CONF_TYPE_STR },
+	[CONF_WORKGROUP]		= { "workgroup",	CONF_TYPE_STR },
+	[CONF_NETBIOS_NAME]		= { "netbios name",	CONF_TYPE_STR },
+	[CONF_NETLINK_BATCH_SIZE]	= { "netlink batch size", CONF_TYPE_UINT },
+	[CONF_IPC_WORKERS]		= { "ipc workers",	CONF_TYPE_UINT },
+	[CONF_NETLINK_RCVBUF]		= { "netlink rcvbuf",	CONF_TYPE_UINT },
+	[CONF_NETLINK_SNDBUF]		= { "netlink sndbuf",	CONF_TYPE_UINT },
+	[CONF_COMMENT]			= { "comment",		CONF_TYPE_STR },
+	[CONF_PATH]			= { "path",		CONF_TYPE_STR },
+	[CONF_GUEST_OK]			= { "guest ok",		CONF_TYPE_BOOL },
+	[CONF_ALLOW_HOSTS]		= { "allow hosts",	CONF_TYPE_STR },
+	[CONF_DENY_HOSTS]		= { "deny hosts",	CONF_TYPE_STR },
+	[CONF_VALID_USERS]		= { "valid users",	CONF_TYPE_STR },
+	[CONF_INVALID_USERS]		= { "invalid users",	CONF_TYPE_STR },
+};
+
+static const char conf_fmt_err[] =
+	"Format Err, expected single space around '='";
+
+static int conf_grow(void **array, unsigned int *max, unsigned int nr,
+		size_t size)
+{
+	unsigned int new_max;
+	void *p;
+
+	if (nr < *max)
+		return 0;
+
+	new_max = *max ? *max * 2 : 64;
+	p = realloc(*array, new_max * size);
+	if (!p)
+		return -ENOMEM;
+
+	*array = p;
+	*max = new_max;
+	return 0;
+}
+
+/**
+ * conf_arena_add() - copy a string into the arena
+ * @conf:	config model
+ * @s:		string, need not be NUL terminated
+ * @len:	length of @s
+ * @off:	arena offset of the copy
+ *
+ * Return:	0 on success, -ENOMEM on error
+ */
+static int conf_arena_add(struct cifsd_conf *conf, const char *s,
+		unsigned int len, unsigned int *off)
+{
+	unsigned int size;
+	char *p;
+
+	if (conf->arena_len + len + 1 > conf->arena_size) {
+		size = conf->arena_size * 2;
+		while (size < conf->arena_len + len + 1)
+			size *= 2;
+		p = realloc(conf->arena, size);
+		if (!p)
+			return -ENOMEM;
+		conf->arena = p;
+		conf->arena_size = size;
+	}
+
+	*off = conf->arena_len;
+	memcpy(conf->arena + conf->arena_len, s, len);
+	conf->arena[conf->arena_len + len] = '\0';
+	conf->arena_len += len + 1;
+	return 0;
+}
+
+static unsigned int conf_hash(const char *s, unsigned int len)
+{
+	unsigned int hash = 2166136261U;
+
+	while (len--) {
+		hash ^= (unsigned char)*s++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static int conf_rehash(struct cifsd_conf *conf)
+{
+	unsigned int size = conf->key_hash_size ? conf->key_hash_size * 2 : 64;
+	unsigned int *table, i, h;
+	struct conf_key *key;
+
+	table = calloc(size, sizeof(unsigned int));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i < conf->nr_keys; i++) {
+		key = &conf->keys[i];
+		h = conf_hash(conf->arena + key->name, key->len) & (size - 1);
+		while (table[h])
+			h = (h + 1) & (size - 1);
+		table[h] = i + 1;
+	}
+
+	free(conf->key_hash);
+	conf->key_hash = table;
+	conf->key_hash_size = size;
+	return 0;
+}
+
+/**
+ * conf_intern() - look up or add a parameter name
+ * @conf:	config model
+ * @name:	parameter name, matched case insensitively
+ * @len:	length of @name
+ *
+ * Unknown names get a new id and are typed as strings.
+ *
+ * Return:	key id on success, -EINVAL or -ENOMEM on error
+ */
+int conf_intern(struct cifsd_conf *conf, const char *name, unsigned int len)
+{
+	char lname[CONF_MAX_KEY_LEN];
+	struct conf_key *key;
+	unsigned int i, h;
+	int ret;
+
+	if (!len || len > CONF_MAX_KEY_LEN)
+		return -EINVAL;
+
+	for (i = 0; i < len; i++)
+		lname[i] = tolower((unsigned char)name[i]);
+
+	h = conf_hash(lname, len);
+	for (i = h & (conf->key_hash_size - 1); conf->key_hash[i];
+	     i = (i + 1) & (conf->key_hash_size - 1)) {
+		key = &conf->keys[conf->key_hash[i] - 1];
+		if (key->len == len &&
+		    !memcmp(conf->arena + key->name, lname, len))
+			return conf->key_hash[i] - 1;
+	}
+
+	ret = conf_grow((void **)&conf->keys, &conf->max_keys, conf->nr_keys,
+			sizeof(struct conf_key));
+	if (ret)
+		return ret;
+
+	key = &conf->keys[conf->nr_keys];
+	ret = conf_arena_add(conf, lname, len, &key->name);
+	if (ret)
+		return ret;
+
+	key->len = len;
+	key->type = conf->nr_keys < CONF_NR_KNOWN ?
+		conf_known_keys[conf->nr_keys].type : CONF_TYPE_STR;
+	conf->key_hash[i] = ++conf->nr_keys;
+
+	/* keep the table at most half full */
+	if (conf->nr_keys * 2 > conf->key_hash_size)
+		return conf_rehash(conf) ? -ENOMEM : (int)conf->nr_keys - 1;
+	return conf->nr_keys - 1;
+}
+
+/**
+ * conf_known_keys_ok() - check that a model has the known keys of this
+ *			build
+ * @conf:	config model, e.g. mapped from a snapshot of another build
+ *
+ * Known keys are interned first, in enum order, and code refers to them
+ * by id, so a model whose table differs must not be used.
+ *
+ * Return:	1 if the first CONF_NR_KNOWN keys match, 0 otherwise
+ */
+int conf_known_keys_ok(struct cifsd_conf *conf)
+{
+	struct conf_key *key;
+	unsigned int i;
+
+	if (conf->nr_keys < CONF_NR_KNOWN)
+		return 0;
+
+	for (i = 0; i < CONF_NR_KNOWN; i++) {
+		key = &conf->keys[i];
+		if (key->type != conf_known_keys[i].type ||
+		    key->len != strlen(conf_known_keys[i].name) ||
+		    memcmp(conf->arena + key->name, conf_known_keys[i].name,
+				key->len))
+			return 0;
+	}
+	return 1;
+}
+
+static unsigned int conf_parse_bool(const char *val)
+{
+	return !strcasecmp(val, "yes") || !strcasecmp(val, "true") ||
+		!strcasecmp(val, "on") || !strcmp(val, "1");
+}
+
+static int conf_add_section(struct cifsd_conf *conf, const char *s,
+		unsigned int len)
+{
+	char name[PAGE_SZ];
+	struct conf_section *sec;
+	unsigned int i, nlen = 0;
+	int ret;
+
+	/* brackets are dropped wherever they are */
+	for (i = 0; i < len && nlen < sizeof(name) - 1; i++) {
+		if (s[i] != '[' && s[i] != ']')
+			name[nlen++] = s[i];
+	}
+	while (nlen && isspace((unsigned char)name[nlen - 1]))
+		nlen--;
+
+	ret = conf_grow((void **)&conf->sections, &conf->max_sections,
+			conf->nr_sections, sizeof(struct conf_section));
+	if (ret)
+		return ret;
+
+	sec = &conf->sections[conf->nr_sections];
+	ret = conf_arena_add(conf, name, nlen, &sec->name);
+	if (ret)
+		return ret;
+
+	sec->nlen = nlen;
+	sec->first = conf->nr_params;
+	sec->nr = 0;
+	sec->flags = 0;
+	if (!strcasecmp(conf->arena + sec->name, "global"))
+		sec->flags |= CONF_SECTION_GLOBAL;
+	conf->nr_sections++;
+	return 0;
+}
+
+static int conf_add_param(struct cifsd_conf *conf, const char *key,
+		unsigned int klen, const char *val, unsigned int vlen)
+{
+	struct conf_param *param;
+	int id, ret;
+
+	id = conf_intern(conf, key, klen);
+	if (id < 0)
+		return id;
+
+	ret = conf_grow((void **)&conf->params, &conf->max_params,
+			conf->nr_params, sizeof(struct conf_param));
+	if (ret)
+		return ret;
+
+	param = &conf->params[conf->nr_params];
+	ret = conf_arena_add(conf, val, vlen, &param->val);
+	if (ret)
+		return ret;
+
+	param->key = id;
+	param->vlen = vlen;
+	param->num = 0;
+	if (conf->keys[id].type == CONF_TYPE_UINT)
+		param->num = strtoul(conf->arena + param->val, NULL, 10);
+	else if (conf->keys[id].type == CONF_TYPE_BOOL)
+		param->num = conf_parse_bool(conf->arena + param->val);
+
+	conf->nr_params++;
+	conf->sections[conf->nr_sections - 1].nr++;
+	return 0;
+}
+
+/**
+ * conf_parse_line() - add one logical line to the model
+ * @conf:	config model
+ * @s:		line without newline
+ * @len:	length of @s
+ * @lineno:	line number for messages
+ *
+ * Return:	0 on success, -EINVAL on format error, -ENOMEM on error
+ */
+static int conf_parse_line(struct cifsd_conf *conf, const char *s,
+		unsigned int len, unsigned int lineno)
+{
+	const char *end, *eq, *key, *val;
+	unsigned int klen, vlen;
+	int ret;
+
+	/* skip to the first meaningful character */
+	while (len && *s != ';' && *s != '#' && *s != '[' &&
+	       !isalnum((unsigned char)*s)) {
+		s++;
+		len--;
+	}
+	if (!len || *s == ';' || *s == '#')
+		return 0;
+
+	/* ';' and '#' start a comment anywhere in the line */
+	for (end = s; end < s + len && *end != ';' && *end != '#'; end++)
+		;
+	while (end > s && isspace((unsigned char)end[-1]))
+		end--;
+	len = end - s;
+
+	if (*s == '[')
+		return conf_add_section(conf, s, len);
+
+	if (isdigit((unsigned char)*s))
+		return 0;
+
+	eq = memchr(s, '=', len);
+	if (!eq) {
+		cifsd_debug("[Line:%u] no value, ignored\n", lineno);
+		return 0;
+	}
+
+	if (eq[-1] != ' ' || (eq + 1 < end && eq[1] != ' ')) {
+		cifsd_err("[Line:%u] %s\n", lineno, conf_fmt_err);
+		return -EINVAL;
+	}
+
+	if (!conf->nr_sections) {
+		cifsd_err("[Line:%u] parameter outside of a section, ignored\n",
+				lineno);
+		return 0;
+	}
+
+	key = s;
+	klen = eq - s;
+	while (klen && isspace((unsigned char)key[klen - 1]))
+		klen--;
+
+	val = eq + 1;
+	while (val < end && isspace((unsigned char)*val))
+		val++;
+	vlen = end - val;
+
+	ret = conf_add_param(conf, key, klen, val, vlen);
+	if (ret == -EINVAL) {
+		cifsd_err("[Line:%u] bad parameter name, ignored\n", lineno);
+		return 0;
+	}
+	return ret;
+}
+
+/**
+ * conf_parse() - tokenize a whole config file in one pass
+ * @conf:	config model
+ * @buf:	file contents
+ * @size:	length of @buf
+ *
+ * A line ending with '\' continues on the next one.
+ *
+ * Return:	0 on success, -EINVAL on format error, -ENOMEM on error
+ */
+static int conf_parse(struct cifsd_conf *conf, const char *buf, size_t size)
+{
+	const char *p = buf, *end = buf + size, *eol;
+	char *joined = NULL, *tmp;
+	size_t jlen = 0, len;
+	unsigned int lineno = 0, first = 0;
+	int cont, ret = 0;
+
+	while (p < end && !ret) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		len = eol - p;
+		lineno++;
+
+		cont = len && p[len - 1] == '\\';
+		if (cont || joined) {
+			/* rare: collect continued lines in a scratch buffer */
+			if (!joined)
+				first = lineno;
+			if (cont)
+				len--;
+			tmp = realloc(joined, jlen + len + 1);
+			if (!tmp) {
+				ret = -ENOMEM;
+				break;
+			}
+			joined = tmp;
+			memcpy(joined + jlen, p, len);
+			jlen += len;
+
+			if (!cont || eol == end) {
+				ret = conf_parse_line(conf, joined, jlen, first);
+				free(joined);
+				joined = NULL;
+				jlen = 0;
+			}
+		} else {
+			ret = conf_parse_line(conf, p, len, lineno);
+		}
+
+		p = eol + 1;
+	}
+
+	free(joined);
+	return ret;
+}
+
+static struct cifsd_conf *conf_alloc(size_t size)
+{
+	struct cifsd_conf *conf;
+	unsigned int i;
+
+	conf = calloc(1, sizeof(struct cifsd_conf));
+	if (!conf)
+		return NULL;
+
+	/* values never outgrow the text they come from */
+	conf->arena_size = size + 512;
+	conf->arena = malloc(conf->arena_size);
+	if (!conf->arena || conf_rehash(conf))
+		goto err;
+
+	for (i = 0; i < CONF_NR_KNOWN; i++) {
+		if (conf_intern(conf, conf_known_keys[i].name,
+				strlen(conf_known_keys[i].name)) != (int)i)
+			goto err;
+	}
+	return conf;
+
+err:
+	conf_free(conf);
+	return NULL;
+}
+
+/**
+ * conf_load() - parse a config file into a typed model
+ * @path:	smb.conf path
+ *
+ * The file is mapped and tokenized once: sections, parameters with
+ * interned keys and their values are copied into the model.
+ *
+ * Return:	config model on success, NULL on error
+ */
+struct cifsd_conf *conf_load(const char *path)
+{
+	struct cifsd_conf *conf;
+	struct stat st;
+	void *map = NULL;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		cifsd_err("[%s] is not existing, err %d\n", path, errno);
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		cifsd_err("[%s] stat failed, err %d\n", path, errno);
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			cifsd_err("[%s] mmap failed, err %d\n", path, errno);
+			close(fd);
+			return NULL;
+		}
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	conf = conf_alloc(st.st_size);
+	if (!conf) {
+		ret = -ENOMEM;
+	} else {
+		ret = conf_parse(conf, map, st.st_size);
+		if (ret) {
+			conf_free(conf);
+			conf = NULL;
+		}
+	}
+
+	if (map)
+		munmap(map, st.st_size);
+	if (ret)
+		cifsd_err("[%s] parsing failed : %d\n", path, ret);
+	return conf;
+}
+
+/**
+ * conf_free() - release a config model
+ * @conf:	config model
+ */
+void conf_free(struct cifsd_conf *conf)
+{
+	if (!conf)
+		return;
+
+	free(conf->arena);
+	free(conf->sections);
+	free(conf->params);
+	free(conf->keys);
+	free(conf->key_hash);
+	free(conf);
+}
+
+/**
+ * conf_find() - look up the last value of a parameter in a section
+ * @conf:	config model
+ * @sec:	section
+ * @key:	key id, from enum conf_param_id or conf_intern()
+ *
+ * Return:	parameter, NULL if @sec does not set it
+ */
+struct conf_param *conf_find(struct cifsd_conf *conf,
+		struct conf_section *sec, unsigned int key)
+{
+	unsigned int i = sec->nr;
+
+	while (i--) {
+		if (conf->params[sec->first + i].key == key)
+			return &conf->params[sec->first + i];
+	}
+	return NULL;
+}
+
+static unsigned long long conf_hash64(unsigned long long hash, const char *s,
+		unsigned int len)
+{
+	/* strings are terminated, so "ab" "c" and "a" "bc" differ */
+	while (len--) {
+		hash ^= (unsigned char)*s++;
+		hash *= 1099511628211ULL;
+	}
+	return (hash ^ 0xff) * 1099511628211ULL;
+}
+
+/**
+ * conf_section_hash() - fingerprint the name and parameters of a section
+ * @conf:	config model
+ * @sec:	section
+ *
+ * Two sections with the same fingerprint produce the same kernel config
+ * entries, whichever model they belong to.
+ *
+ * Return:	64 bit FNV-1a hash
+ */
+unsigned long long conf_section_hash(struct cifsd_conf *conf,
+		struct conf_section *sec)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	struct conf_param *param;
+	unsigned int i;
+
+	hash = conf_hash64(hash, conf_str(conf, sec->name), sec->nlen);
+	for (i = 0; i < sec->nr; i++) {
+		param = &conf->params[sec->first + i];
+		hash = conf_hash64(hash, conf_key_name(conf, param->key),
+				conf->keys[param->key].len);
+		hash = conf_hash64(hash, conf_str(conf, param->val),
+				param->vlen);
+	}
+	return hash;
+}
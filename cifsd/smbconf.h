@@ -0,0 +1,118 @@
+/*
+ *   cifsd-tools/cifsd/smbconf.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_SMBCONF_H
+#define __CIFSD_SMBCONF_H
+
+/* parameters known to cifsd, ids of the first interned keys */
+enum conf_param_id {
+	CONF_SERVER_STRING,
+	CONF_WORKGROUP,
+	CONF_NETBIOS_NAME,
+	CONF_NETLINK_BATCH_SIZE,
+	CONF_IPC_WORKERS,
+	CONF_NETLINK_RCVBUF,
+	CONF_NETLINK_SNDBUF,
+	CONF_COMMENT,
+	CONF_PATH,
+	CONF_GUEST_OK,
+	CONF_ALLOW_HOSTS,
+	CONF_DENY_HOSTS,
+	CONF_VALID_USERS,
+	CONF_INVALID_USERS,
+	CONF_NR_KNOWN,
+};
+
+enum conf_type {
+	CONF_TYPE_STR,
+	CONF_TYPE_UINT,
+	CONF_TYPE_BOOL,
+};
+
+/* longest parameter name accepted */
+#define CONF_MAX_KEY_LEN	64
+
+/*
+ * The model refers to its strings by offset in the arena, so neither
+ * the arena nor the arrays hold pointers.
+ */
+struct conf_key {
+	unsigned int name;		/* lower case name, arena offset */
+	unsigned int len;
+	unsigned int type;
+};
+
+struct conf_param {
+	unsigned int key;		/* interned key id */
+	unsigned int val;		/* value, arena offset */
+	unsigned int vlen;
+	unsigned int num;		/* value of CONF_TYPE_UINT/BOOL keys */
+};
+
+#define CONF_SECTION_GLOBAL	0x01
+
+struct conf_section {
+	unsigned int name;		/* arena offset, without brackets */
+	unsigned int nlen;
+	unsigned int first;		/* first parameter in params[] */
+	unsigned int nr;		/* number of parameters */
+	unsigned int flags;
+};
+
+struct cifsd_conf {
+	char *arena;			/* NUL terminated strings */
+	unsigned int arena_len;
+	unsigned int arena_size;
+	struct conf_section *sections;
+	unsigned int nr_sections;
+	unsigned int max_sections;
+	struct conf_param *params;
+	unsigned int nr_params;
+	unsigned int max_params;
+	struct conf_key *keys;
+	unsigned int nr_keys;
+	unsigned int max_keys;
+	/* key ids + 1 by name hash, open addressing */
+	unsigned int *key_hash;
+	unsigned int key_hash_size;
+};
+
+static inline const char *conf_str(struct cifsd_conf *conf,
+		unsigned int off)
+{
+	return conf->arena + off;
+}
+
+static inline const char *conf_key_name(struct cifsd_conf *conf,
+		unsigned int key)
+{
+	return conf->arena + conf->keys[key].name;
+}
+
+struct cifsd_conf *conf_load(const char *path);
+void conf_free(struct cifsd_conf *conf);
+int conf_intern(struct cifsd_conf *conf, const char *name, unsigned int len);
+int conf_known_keys_ok(struct cifsd_conf *conf);
+struct conf_param *conf_find(struct cifsd_conf *conf,
+		struct conf_section *sec, unsigned int key);
+unsigned long long conf_section_hash(struct cifsd_conf *conf,
+		struct conf_section *sec);
+
+#endif /* __CIFSD_SMBCONF_H */
@@ -0,0 +1,372 @@
+/*
+ *   cifsd-tools/cifsd/snapshot.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <limits.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include "cifsd.h"
+#include "snapshot.h"
+#include "idcache.h"
+
+#define SNAP_ALIGN(x)		(((x) + 7) & ~7U)
+
+static __u64 snap_hash(__u64 hash, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+#define SNAP_HASH_INIT		14695981039346656037ULL
+
+static int snap_source_key(struct snap_source *src, const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(src, 0, sizeof(*src));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -errno;
+	}
+
+	src->mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+	src->size = st.st_size;
+	src->hash = snap_hash(SNAP_HASH_INIT, path, strlen(path) + 1);
+	if (st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return -errno;
+		}
+		src->hash = snap_hash(src->hash, map, st.st_size);
+		munmap(map, st.st_size);
+	}
+
+	close(fd);
+	return 0;
+}
+
+/**
+ * snapshot_sources() - compute the keys of the files a snapshot is
+ *			built from
+ * @sources:	SNAP_NR_SOURCES keys to fill
+ * @conf_path:	smb.conf
+ * @db_path:	user db
+ *
+ * Keys are taken before the files are parsed, so a file changed while
+ * being parsed never matches the snapshot built from it.
+ *
+ * Return:	0 on success, -errno if a file can not be read
+ */
+int snapshot_sources(struct snap_source *sources, const char *conf_path,
+		const char *db_path)
+{
+	int ret;
+
+	ret = snap_source_key(&sources[SNAP_SRC_CONF], conf_path);
+	if (!ret)
+		ret = snap_source_key(&sources[SNAP_SRC_USERS], db_path);
+	if (!ret)
+		ret = snap_source_key(&sources[SNAP_SRC_PASSWD], PATH_PASSWD);
+	return ret;
+}
+
+static int snap_range_ok(const struct snap_header *hdr, __u32 off,
+		__u32 nr, size_t size)
+{
+	return off >= hdr->hdr_size && off <= hdr->size &&
+		(__u64)nr * size <= hdr->size - off;
+}
+
+/**
+ * snap_model_ok() - check that every offset of the model stays inside
+ *			and that its known keys are those of this build
+ * @snap:	snapshot
+ *
+ * Return:	1 if the model can be used, 0 otherwise
+ */
+static int snap_model_ok(struct cifsd_snapshot *snap)
+{
+	struct cifsd_conf *conf = &snap->conf;
+	struct conf_section *sec;
+	struct conf_param *param;
+	unsigned int i;
+
+	if (!conf->arena_len || conf->arena[conf->arena_len - 1])
+		return 0;
+
+	for (i = 0; i < conf->nr_keys; i++) {
+		if (conf->keys[i].name >= conf->arena_len ||
+		    conf->keys[i].len > conf->arena_len - conf->keys[i].name)
+			return 0;
+	}
+
+	if (!conf_known_keys_ok(conf))
+		return 0;
+
+	for (i = 0; i < conf->nr_sections; i++) {
+		sec = &conf->sections[i];
+		if (sec->name >= conf->arena_len ||
+		    sec->first > conf->nr_params ||
+		    sec->nr > conf->nr_params - sec->first)
+			return 0;
+	}
+
+	for (i = 0; i < conf->nr_params; i++) {
+		param = &conf->params[i];
+		if (param->key >= conf->nr_keys ||
+		    param->val >= conf->arena_len)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * snapshot_load() - map the snapshot of unchanged source files
+ * @path:	snapshot file
+ * @sources:	keys of the current source files
+ * @ttl:	seconds since creation the snapshot is trusted
+ *
+ * User records hold uid and gid resolved when the snapshot was built,
+ * which may come from NSS without any file changing, so the snapshot
+ * expires like the id cache it was resolved from.
+ *
+ * Return:	snapshot, NULL if there is none usable for @sources
+ */
+struct cifsd_snapshot *snapshot_load(const char *path,
+		const struct snap_source *sources, unsigned int ttl)
+{
+	struct cifsd_snapshot *snap;
+	const struct snap_header *hdr;
+	struct stat st;
+	time_t now;
+	char *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(struct snap_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = (const struct snap_header *)map;
+	if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != SNAP_VERSION ||
+	    hdr->hdr_size != sizeof(struct snap_header) ||
+	    hdr->size != st.st_size) {
+		cifsd_debug("snapshot %s has another format\n", path);
+		goto fail;
+	}
+
+	now = time(NULL);
+	if (memcmp(hdr->sources, sources,
+			SNAP_NR_SOURCES * sizeof(struct snap_source)) ||
+	    hdr->created > (__u64)now || hdr->created + ttl < (__u64)now) {
+		cifsd_debug("snapshot %s is out of date\n", path);
+		goto fail;
+	}
+
+	if (!snap_range_ok(hdr, hdr->users_off, hdr->nr_users,
+			sizeof(struct cifsd_user_rec)) ||
+	    !snap_range_ok(hdr, hdr->arena_off, hdr->arena_len, 1) ||
+	    !snap_range_ok(hdr, hdr->sections_off, hdr->nr_sections,
+			sizeof(struct conf_section)) ||
+	    !snap_range_ok(hdr, hdr->params_off, hdr->nr_params,
+			sizeof(struct conf_param)) ||
+	    !snap_range_ok(hdr, hdr->keys_off, hdr->nr_keys,
+			sizeof(struct conf_key)) ||
+	    snap_hash(SNAP_HASH_INIT, map + hdr->hdr_size,
+			hdr->size - hdr->hdr_size) != hdr->checksum) {
+		cifsd_err("snapshot %s is corrupted\n", path);
+		goto fail;
+	}
+
+	snap = calloc(1, sizeof(struct cifsd_snapshot));
+	if (!snap)
+		goto fail;
+
+	snap->map = map;
+	snap->map_len = st.st_size;
+	snap->users = (const struct cifsd_user_rec *)(map + hdr->users_off);
+	snap->nr_users = hdr->nr_users;
+	snap->conf.arena = map + hdr->arena_off;
+	snap->conf.arena_len = snap->conf.arena_size = hdr->arena_len;
+	snap->conf.sections = (struct conf_section *)(map + hdr->sections_off);
+	snap->conf.nr_sections = snap->conf.max_sections = hdr->nr_sections;
+	snap->conf.params = (struct conf_param *)(map + hdr->params_off);
+	snap->conf.nr_params = snap->conf.max_params = hdr->nr_params;
+	snap->conf.keys = (struct conf_key *)(map + hdr->keys_off);
+	snap->conf.nr_keys = snap->conf.max_keys = hdr->nr_keys;
+
+	if (!snap_model_ok(snap)) {
+		cifsd_err("snapshot %s is corrupted\n", path);
+		free(snap);
+		goto fail;
+	}
+	return snap;
+
+fail:
+	munmap(map, st.st_size);
+	return NULL;
+}
+
+/**
+ * snapshot_save() - write the parsed config and user records
+ * @path:	snapshot file
+ * @sources:	keys of the source files, taken before parsing them
+ * @conf:	config model
+ * @users:	user records
+ * @nr_users:	number of user records
+ *
+ * The file holds password hashes, it is only readable by its owner and
+ * replaced atomically.
+ *
+ * Return:	0 on success, -errno on error
+ */
+int snapshot_save(const char *path, const struct snap_source *sources,
+		struct cifsd_conf *conf, const struct cifsd_user_rec *users,
+		unsigned int nr_users)
+{
+	char tmp[PATH_MAX], dir[PATH_MAX];
+	struct snap_header *hdr;
+	size_t off, written;
+	ssize_t len;
+	char *buf;
+	int fd, ret = 0;
+
+	off = SNAP_ALIGN(sizeof(struct snap_header));
+	off += SNAP_ALIGN(nr_users * sizeof(struct cifsd_user_rec));
+	off += SNAP_ALIGN(conf->arena_len);
+	off += SNAP_ALIGN(conf->nr_sections * sizeof(struct conf_section));
+	off += SNAP_ALIGN(conf->nr_params * sizeof(struct conf_param));
+	off += SNAP_ALIGN(conf->nr_keys * sizeof(struct conf_key));
+	if (off > UINT_MAX)
+		return -EFBIG;
+
+	buf = calloc(1, off);
+	if (!buf)
+		return -ENOMEM;
+
+	hdr = (struct snap_header *)buf;
+	memcpy(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic));
+	hdr->version = SNAP_VERSION;
+	hdr->hdr_size = sizeof(struct snap_header);
+	hdr->size = off;
+	hdr->created = time(NULL);
+	memcpy(hdr->sources, sources,
+			SNAP_NR_SOURCES * sizeof(struct snap_source));
+
+	off = SNAP_ALIGN(sizeof(struct snap_header));
+	hdr->nr_users = nr_users;
+	hdr->users_off = off;
+	memcpy(buf + off, users, nr_users * sizeof(struct cifsd_user_rec));
+	off += SNAP_ALIGN(nr_users * sizeof(struct cifsd_user_rec));
+
+	hdr->arena_len = conf->arena_len;
+	hdr->arena_off = off;
+	memcpy(buf + off, conf->arena, conf->arena_len);
+	off += SNAP_ALIGN(conf->arena_len);
+
+	hdr->nr_sections = conf->nr_sections;
+	hdr->sections_off = off;
+	memcpy(buf + off, conf->sections,
+			conf->nr_sections * sizeof(struct conf_section));
+	off += SNAP_ALIGN(conf->nr_sections * sizeof(struct conf_section));
+
+	hdr->nr_params = conf->nr_params;
+	hdr->params_off = off;
+	memcpy(buf + off, conf->params,
+			conf->nr_params * sizeof(struct conf_param));
+	off += SNAP_ALIGN(conf->nr_params * sizeof(struct conf_param));
+
+	hdr->nr_keys = conf->nr_keys;
+	hdr->keys_off = off;
+	memcpy(buf + off, conf->keys, conf->nr_keys * sizeof(struct conf_key));
+
+	hdr->checksum = snap_hash(SNAP_HASH_INIT, buf + hdr->hdr_size,
+			hdr->size - hdr->hdr_size);
+
+	strncpy(dir, path, PATH_MAX - 1);
+	dir[PATH_MAX - 1] = '\0';
+	mkdir(dirname(dir), 0700);
+
+	snprintf(tmp, PATH_MAX, "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		ret = -errno;
+		free(buf);
+		return ret;
+	}
+
+	for (written = 0; written < hdr->size; written += len) {
+		len = write(fd, buf + written, hdr->size - written);
+		if (len < 0) {
+			if (errno == EINTR) {
+				len = 0;
+				continue;
+			}
+			ret = -errno;
+			break;
+		}
+	}
+
+	if (!ret && fsync(fd))
+		ret = -errno;
+	if (close(fd) && !ret)
+		ret = -errno;
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+
+	free(buf);
+	return ret;
+}
+
+/**
+ * snapshot_free() - unmap a snapshot
+ * @snap:	snapshot
+ */
+void snapshot_free(struct cifsd_snapshot *snap)
+{
+	if (!snap)
+		return;
+
+	munmap(snap->map, snap->map_len);
+	free(snap);
+}
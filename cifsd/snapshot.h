@@ -0,0 +1,87 @@
+/*
+ *   cifsd-tools/cifsd/snapshot.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_SNAPSHOT_H
+#define __CIFSD_SNAPSHOT_H
+
+#include "netlink.h"
+#include "smbconf.h"
+
+#define SNAP_MAGIC		"CIFSDSNP"
+#define SNAP_VERSION		2
+
+/* files a snapshot is built from */
+enum snap_source_id {
+	SNAP_SRC_CONF,
+	SNAP_SRC_USERS,
+	SNAP_SRC_PASSWD,		/* uid/gid of the user records */
+	SNAP_NR_SOURCES,
+};
+
+struct snap_source {
+	__u64 mtime;			/* ns */
+	__u64 size;
+	__u64 hash;			/* FNV-1a of path and content */
+};
+
+/*
+ * The file is the header followed by the user records and the arrays
+ * of the config model, each 8 byte aligned. The model refers to its
+ * strings by arena offset, so it is used from the mapping as is.
+ */
+struct snap_header {
+	char magic[8];
+	__u32 version;
+	__u32 hdr_size;
+	__u64 checksum;			/* FNV-1a of the bytes after header */
+	__u64 size;			/* whole file */
+	__u64 created;			/* seconds since the epoch */
+	struct snap_source sources[SNAP_NR_SOURCES];
+	__u32 nr_users;
+	__u32 users_off;
+	__u32 arena_len;
+	__u32 arena_off;
+	__u32 nr_sections;
+	__u32 sections_off;
+	__u32 nr_params;
+	__u32 params_off;
+	__u32 nr_keys;
+	__u32 keys_off;
+};
+
+struct cifsd_snapshot {
+	void *map;
+	size_t map_len;
+	/* arrays point into the mapping, never conf_free() it */
+	struct cifsd_conf conf;
+	const struct cifsd_user_rec *users;
+	unsigned int nr_users;
+};
+
+int snapshot_sources(struct snap_source *sources, const char *conf_path,
+		const char *db_path);
+struct cifsd_snapshot *snapshot_load(const char *path,
+		const struct snap_source *sources, unsigned int ttl);
+int snapshot_save(const char *path, const struct snap_source *sources,
+		struct cifsd_conf *conf, const struct cifsd_user_rec *users,
+		unsigned int nr_users);
+void snapshot_free(struct cifsd_snapshot *snap);
+
+#endif /* __CIFSD_SNAPSHOT_H */
@@ -0,0 +1,209 @@
+/*
+ *   cifsd-tools/cifsd/startup.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <time.h>
+#include "cifsd.h"
+#include "startup.h"
+
+static const char * const startup_phase_name[STARTUP_NR_PHASES] = {
+	[STARTUP_SHARE_INIT]	= "share_init",
+	[STARTUP_EARLY_INIT]	= "early_init",
+	[STARTUP_LOAD]		= "load",
+	[STARTUP_USERS]		= "users",
+	[STARTUP_SHARES]	= "shares",
+	[STARTUP_ACKS]		= "acks",
+	[STARTUP_NETLINK_SETUP]	= "netlink_setup",
+};
+
+static const char * const startup_counter_name[STARTUP_NR_COUNTERS] = {
+	[STARTUP_NR_USERS]	= "users",
+	[STARTUP_NR_SHARES]	= "shares",
+	[STARTUP_NR_NSS]	= "nss_lookups",
+	[STARTUP_NR_STAT]	= "stat_calls",
+};
+
+struct startup_stats {
+	unsigned long long us;
+	unsigned long counters[STARTUP_NR_COUNTERS];
+	unsigned long replies;		/* netlink round trips */
+	unsigned long sends;		/* netlink send syscalls */
+};
+
+static struct {
+	struct nl_sock *nlsock;
+	const char *profile_path;
+	int cur;			/* running phase, -1 if none */
+	unsigned long long start_us;	/* of startup_init() */
+	struct startup_stats mark;	/* totals when the phase started */
+	struct startup_stats phases[STARTUP_NR_PHASES];
+	/* bumped from path check threads too */
+	unsigned long counters[STARTUP_NR_COUNTERS];
+} startup = { .cur = -1 };
+
+static unsigned long long startup_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void startup_totals(struct startup_stats *st)
+{
+	int i;
+
+	st->us = startup_now();
+	for (i = 0; i < STARTUP_NR_COUNTERS; i++)
+		st->counters[i] = __atomic_load_n(&startup.counters[i],
+				__ATOMIC_RELAXED);
+	st->replies = startup.nlsock ? startup.nlsock->stats.nr_replies : 0;
+	st->sends = startup.nlsock ? startup.nlsock->stats.nr_send_calls : 0;
+}
+
+/* add what happened since the phase started to its stats */
+static void startup_end_phase(void)
+{
+	struct startup_stats now, *st;
+	int i;
+
+	if (startup.cur < 0)
+		return;
+
+	startup_totals(&now);
+	st = &startup.phases[startup.cur];
+	st->us += now.us - startup.mark.us;
+	for (i = 0; i < STARTUP_NR_COUNTERS; i++)
+		st->counters[i] += now.counters[i] - startup.mark.counters[i];
+	st->replies += now.replies - startup.mark.replies;
+	st->sends += now.sends - startup.mark.sends;
+	startup.cur = -1;
+}
+
+/**
+ * startup_init() - start timing daemon startup
+ * @nlsock:	netlink socket, its counters give the round trips
+ * @profile_path: JSON file written by startup_done(), NULL for none
+ */
+void startup_init(struct nl_sock *nlsock, const char *profile_path)
+{
+	startup.nlsock = nlsock;
+	startup.profile_path = profile_path;
+	startup.start_us = startup_now();
+}
+
+/**
+ * startup_phase() - end the running phase and start another
+ * @phase:	phase starting now
+ *
+ * A phase entered again adds to its earlier time and counts.
+ */
+void startup_phase(enum startup_phase phase)
+{
+	startup_end_phase();
+	startup_totals(&startup.mark);
+	startup.cur = phase;
+}
+
+/**
+ * startup_count() - count events of the running phase
+ * @counter:	event counted
+ * @n:		number of events
+ *
+ * Safe from any thread. Events outside of a phase are not reported.
+ */
+void startup_count(enum startup_counter counter, unsigned long n)
+{
+	__atomic_add_fetch(&startup.counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/**
+ * startup_write_profile() - write the phase stats as JSON
+ * @path:	profile file
+ * @total_us:	startup time
+ *
+ * Return:	0 on success, -errno on error
+ */
+static int startup_write_profile(const char *path,
+		unsigned long long total_us)
+{
+	struct startup_stats *st;
+	FILE *fp;
+	int i, j;
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -errno;
+
+	fprintf(fp, "{\n\t\"version\": \"%s\",\n\t\"total_us\": %llu,\n"
+			"\t\"phases\": [\n", CIFSD_TOOLS_VERSION, total_us);
+	for (i = 0; i < STARTUP_NR_PHASES; i++) {
+		st = &startup.phases[i];
+		fprintf(fp, "\t\t{ \"name\": \"%s\", \"us\": %llu",
+				startup_phase_name[i], st->us);
+		for (j = 0; j < STARTUP_NR_COUNTERS; j++)
+			fprintf(fp, ", \"%s\": %lu", startup_counter_name[j],
+					st->counters[j]);
+		fprintf(fp, ", \"netlink_round_trips\": %lu, "
+				"\"netlink_sends\": %lu }%s\n",
+				st->replies, st->sends,
+				i + 1 < STARTUP_NR_PHASES ? "," : "");
+	}
+	fprintf(fp, "\t]\n}\n");
+
+	if (fclose(fp))
+		return -errno;
+	return 0;
+}
+
+/**
+ * startup_done() - end startup, log the phase stats and write the
+ *		    profile file
+ */
+void startup_done(void)
+{
+	unsigned long long total_us;
+	struct startup_stats *st;
+	int i, ret;
+
+	startup_end_phase();
+	total_us = startup_now() - startup.start_us;
+
+	cifsd_info("started in %llu.%03llums\n", total_us / 1000,
+			total_us % 1000);
+	for (i = 0; i < STARTUP_NR_PHASES; i++) {
+		st = &startup.phases[i];
+		cifsd_info("startup %-13s %6llu.%03llums, %lu users, "
+				"%lu shares, %lu round trips, %lu nss, "
+				"%lu stat\n", startup_phase_name[i],
+				st->us / 1000, st->us % 1000,
+				st->counters[STARTUP_NR_USERS],
+				st->counters[STARTUP_NR_SHARES], st->replies,
+				st->counters[STARTUP_NR_NSS],
+				st->counters[STARTUP_NR_STAT]);
+	}
+
+	if (startup.profile_path) {
+		ret = startup_write_profile(startup.profile_path, total_us);
+		if (ret)
+			cifsd_err("failed to write startup profile %s : %d\n",
+					startup.profile_path, ret);
+	}
+	startup.nlsock = NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ *   cifsd-tools/cifsd/startup.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_STARTUP_H
+#define __CIFSD_STARTUP_H
+
+#include "netlink.h"
+
+/* startup phases, in the order they run */
+enum startup_phase {
+	STARTUP_SHARE_INIT,		/* init_share_config() */
+	STARTUP_EARLY_INIT,		/* capability negotiation */
+	STARTUP_LOAD,			/* user db, smb.conf or snapshot */
+	STARTUP_USERS,			/* config_users() */
+	STARTUP_SHARES,			/* config_shares() */
+	STARTUP_ACKS,			/* wait for kernel, save snapshot */
+	STARTUP_NETLINK_SETUP,		/* up to the event loop */
+	STARTUP_NR_PHASES,
+};
+
+/* events counted per phase */
+enum startup_counter {
+	STARTUP_NR_USERS,		/* user accounts pushed */
+	STARTUP_NR_SHARES,		/* shares exported */
+	STARTUP_NR_NSS,			/* getpwent()/getpwnam() calls */
+	STARTUP_NR_STAT,		/* stat() of share paths */
+	STARTUP_NR_COUNTERS,
+};
+
+void startup_init(struct nl_sock *nlsock, const char *profile_path);
+void startup_phase(enum startup_phase phase);
+void startup_count(enum startup_counter counter, unsigned long n);
+void startup_done(void);
+
+#endif /* __CIFSD_STARTUP_H */
@@ -0,0 +1,257 @@
+/*
+ *   cifsd-tools/cifsd/worker.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include "cifsd.h"
+#include "worker.h"
+
+static unsigned int worker_hash(__u64 handle, int nr_workers)
+{
+	handle ^= handle >> 32;
+	return (unsigned int)((handle * 0x9E3779B97F4A7C15ULL) >> 32) %
+		nr_workers;
+}
+
+static int handle_running(struct cifsd_worker *worker, __u64 handle)
+{
+	struct cifsd_work *work;
+
+	list_for_each_entry(work, &worker->running, list) {
+		if (work->handle == handle)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * worker_dequeue() - take the oldest runnable request off a queue
+ * @worker:	worker owning the queue
+ *
+ * Return:	request moved to running list, NULL if none is runnable
+ */
+static struct cifsd_work *worker_dequeue(struct cifsd_worker *worker)
+{
+	struct cifsd_work *work;
+
+	pthread_mutex_lock(&worker->lock);
+	list_for_each_entry(work, &worker->queue, list) {
+		if (!handle_running(worker, work->handle)) {
+			list_move_tail(&work->list, &worker->running);
+			pthread_mutex_unlock(&worker->lock);
+			return work;
+		}
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+static void worker_complete(struct cifsd_worker *home, struct cifsd_work *work)
+{
+	struct cifsd_worker_pool *pool = home->pool;
+
+	pthread_mutex_lock(&home->lock);
+	list_del(&work->list);
+	pthread_mutex_unlock(&home->lock);
+	free(work);
+
+	/* a request of the same handle may be runnable now */
+	pthread_mutex_lock(&pool->lock);
+	pool->gen++;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct cifsd_worker *self = (struct cifsd_worker *)arg;
+	struct cifsd_worker_pool *pool = self->pool;
+	struct cifsd_worker *home;
+	struct cifsd_work *work;
+	unsigned long gen;
+	int idx = self - pool->workers;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		gen = pool->gen;
+		if (pool->stop) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		home = self;
+		work = worker_dequeue(self);
+		for (i = 1; !work && i < pool->nr_workers; i++) {
+			home = &pool->workers[(idx + i) % pool->nr_workers];
+			work = worker_dequeue(home);
+			if (work)
+				self->nr_stolen++;
+		}
+
+		if (work) {
+			pool->handler(pool->nlsock,
+					(struct nlmsghdr *)work->msg);
+			self->nr_handled++;
+			worker_complete(home, work);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while (pool->gen == gen && !pool->stop)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * worker_pool_queue() - queue a netlink message to the worker of its
+ *			server handle
+ * @pool:	worker pool
+ * @nlh:	netlink message, copied into the queue
+ *
+ * Return:	0 on success, -ENOMEM on error
+ */
+int worker_pool_queue(struct cifsd_worker_pool *pool, struct nlmsghdr *nlh)
+{
+	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
+	struct cifsd_worker *worker;
+	struct cifsd_work *work;
+
+	work = malloc(sizeof(struct cifsd_work) + nlh->nlmsg_len);
+	if (!work)
+		return -ENOMEM;
+
+	work->handle = ev->server_handle;
+	memcpy(work->msg, nlh, nlh->nlmsg_len);
+
+	worker = &pool->workers[worker_hash(work->handle, pool->nr_workers)];
+	pthread_mutex_lock(&worker->lock);
+	list_add_tail(&work->list, &worker->queue);
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->gen++;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+static void worker_pool_free(struct cifsd_worker_pool *pool)
+{
+	struct cifsd_work *work;
+	struct list_head *tmp, *t;
+	int i;
+
+	for (i = 0; i < pool->nr_workers; i++) {
+		list_for_each_safe(tmp, t, &pool->workers[i].queue) {
+			work = list_entry(tmp, struct cifsd_work, list);
+			list_del(&work->list);
+			free(work);
+		}
+		pthread_mutex_destroy(&pool->workers[i].lock);
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+/**
+ * worker_pool_create() - start worker threads for pipe requests
+ * @nr_workers:	number of worker threads
+ * @nlsock:	netlink socket passed to @handler
+ * @handler:	request handler run on worker threads
+ *
+ * Return:	worker pool on success, NULL on error
+ */
+struct cifsd_worker_pool *worker_pool_create(int nr_workers,
+		struct nl_sock *nlsock, worker_handler_t handler)
+{
+	struct cifsd_worker_pool *pool;
+	char th_name[16];
+	int i, ret;
+
+	if (nr_workers > CIFSD_MAX_WORKERS)
+		nr_workers = CIFSD_MAX_WORKERS;
+
+	pool = calloc(1, sizeof(struct cifsd_worker_pool));
+	if (!pool)
+		return NULL;
+
+	pool->workers = calloc(nr_workers, sizeof(struct cifsd_worker));
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+
+	pool->nlsock = nlsock;
+	pool->handler = handler;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	for (i = 0; i < nr_workers; i++) {
+		pool->workers[i].pool = pool;
+		pthread_mutex_init(&pool->workers[i].lock, NULL);
+		INIT_LIST_HEAD(&pool->workers[i].queue);
+		INIT_LIST_HEAD(&pool->workers[i].running);
+	}
+	pool->nr_workers = nr_workers;
+
+	for (i = 0; i < nr_workers; i++) {
+		ret = pthread_create(&pool->workers[i].thread, NULL,
+				worker_thread, &pool->workers[i]);
+		if (ret) {
+			cifsd_err("pthread_create failed : %d\n", ret);
+			pool->nr_workers = i;
+			worker_pool_destroy(pool);
+			return NULL;
+		}
+
+		snprintf(th_name, sizeof(th_name), "cifsd_worker%d", i);
+		pthread_setname_np(pool->workers[i].thread, th_name);
+	}
+
+	return pool;
+}
+
+/**
+ * worker_pool_destroy() - stop worker threads and drop queued requests
+ * @pool:	worker pool
+ */
+void worker_pool_destroy(struct cifsd_worker_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nr_workers; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+		cifsd_debug("worker %d handled %lu requests, stole %lu\n", i,
+				pool->workers[i].nr_handled,
+				pool->workers[i].nr_stolen);
+	}
+
+	worker_pool_free(pool);
+}
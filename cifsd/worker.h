@@ -0,0 +1,73 @@
+/*
+ *   cifsd-tools/cifsd/worker.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_WORKER_H
+#define __CIFSD_WORKER_H
+
+#include <pthread.h>
+#include "netlink.h"
+
+#define CIFSD_MAX_WORKERS	64
+
+typedef int (*worker_handler_t)(struct nl_sock *nlsock,
+		struct nlmsghdr *nlh);
+
+/* one queued netlink message, owned by the worker pool */
+struct cifsd_work {
+	struct list_head list;
+	__u64 handle;
+	char msg[];
+};
+
+/*
+ * Every server handle is hashed onto one worker queue, so all requests
+ * of a client are queued in arrival order on the same queue. A request
+ * is only taken off a queue, by its owner or by a stealing worker, when
+ * no other request of the same handle is running from that queue.
+ */
+struct cifsd_worker {
+	pthread_t thread;
+	struct cifsd_worker_pool *pool;
+	pthread_mutex_t lock;
+	struct list_head queue;		/* waiting requests */
+	struct list_head running;	/* requests being handled */
+	unsigned long nr_handled;
+	unsigned long nr_stolen;
+};
+
+struct cifsd_worker_pool {
+	struct cifsd_worker *workers;
+	int nr_workers;
+	struct nl_sock *nlsock;
+	worker_handler_t handler;
+
+	/* idle workers sleep until generation changes */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long gen;
+	int stop;
+};
+
+struct cifsd_worker_pool *worker_pool_create(int nr_workers,
+		struct nl_sock *nlsock, worker_handler_t handler);
+int worker_pool_queue(struct cifsd_worker_pool *pool, struct nlmsghdr *nlh);
+void worker_pool_destroy(struct cifsd_worker_pool *pool);
+
+#endif /* __CIFSD_WORKER_H */
@@ -35,6 +35,7 @@
 #include <signal.h>
 #include <iconv.h>
 #include <errno.h>
+#include <pthread.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -55,6 +56,8 @@
 
 #define PATH_PWDDB "/etc/cifs/cifspwd.db"
 #define PATH_SHARECONF "/etc/cifs/smb.conf"
+#define PATH_IDCACHE "/var/cache/cifsd/idmap.cache"
+#define PATH_SNAPSHOT "/var/cache/cifsd/config.snap"
 
 #define UNICODE_LEN(x) (x * 2)
 
@@ -69,6 +72,7 @@
 #define RESP_BUF_SIZE (CIFS_MAX_MSGSIZE + MAX_CIFS_HDR_SIZE)
 
 #define CIFSD_CODEPAGE_LEN    32
+#define CIFSD_CODEPAGE_MAX	32	/* codepages with cached conversions */
 #define CIFSD_USERNAME_LEN	33
 
 enum cifsd_pipe_type {
@@ -95,7 +99,7 @@ struct cifsd_pipe {
         char *buf;
         int datasize;
         int sent;
-	char codepage[CIFSD_CODEPAGE_LEN];
+	int codepage;			/* from codepage_intern() */
 	char username[CIFSD_USERNAME_LEN];
 };
 
@@ -109,7 +113,7 @@ struct cifsd_client_info {
 struct cifsd_notify_client_info {
 	struct list_head list;
 	__u64 hash;
-	char codepage[CIFSD_CODEPAGE_LEN];
+	int codepage;
 	int wd;
 };
 
@@ -141,13 +145,17 @@ struct cifsd_share {
 	int     tcount;
 	char    *sharename;
 	struct share_config config;
-
-	/* global list of shares */
-	struct list_head list;
+	/* fingerprint of the config section, see conf_section_hash() */
+	unsigned long long conf_hash;
 };
 
-extern struct list_head cifsd_share_list;
-extern int cifsd_num_shares;
+extern char *cifsd_conf_path;
+extern unsigned int netlink_batch_size;
+extern unsigned int ipc_workers;
+extern unsigned int netlink_rcvbuf;
+extern unsigned int netlink_sndbuf;
+/* shares whose path did not answer in time, retried until it does */
+extern unsigned int nr_held_shares;
 
 char *guestAccountName;
 //char *server_string;
@@ -196,10 +204,12 @@ int process_rpc(struct cifsd_pipe *pipe, char *data);
 int handle_lanman_pipe(struct cifsd_pipe *pipe, char *in_data,
 		char *out_data, int *param_len);
 
+int codepage_intern(const char *name);
 int smbConvertToUTF16(__le16 *target, char *source, int slen,
-                int targetlen, const char *codepage);
+                int targetlen, int cp);
 char *smb_strndup_from_utf16(char *src, const int maxlen,
-                const int is_unicode, const char *codepage);
+                const int is_unicode, int cp);
+void conv_dump_stats(void);
 
 #define __constant_cpu_to_le64(x) ((__le64)(__u64)(x))
 #define __constant_le64_to_cpu(x) ((__u64)(__le64)(x))
@@ -0,0 +1,81 @@
+/*
+ *   cifsd-tools/include/evloop.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_TOOLS_EVLOOP_H
+#define __CIFSD_TOOLS_EVLOOP_H
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include "list.h"
+
+#define EVLOOP_MAX_EVENTS	32
+
+enum evloop_source_type {
+	EVLOOP_FD,
+	EVLOOP_SIGNAL,
+	EVLOOP_TIMER,
+};
+
+struct evloop;
+
+typedef void (*evloop_fd_cb)(struct evloop *loop, int fd,
+		unsigned int events, void *data);
+typedef void (*evloop_signal_cb)(struct evloop *loop, int signo,
+		void *data);
+typedef void (*evloop_timer_cb)(struct evloop *loop, int tfd, void *data);
+
+struct evloop_source {
+	struct list_head list;
+	int fd;
+	int type;
+	int dead;
+	union {
+		evloop_fd_cb fd;
+		evloop_signal_cb signal;
+		evloop_timer_cb timer;
+	} cb;
+	void *data;
+};
+
+struct evloop {
+	int epfd;
+	int running;
+	/* registered sources */
+	struct list_head sources;
+	/* sources removed while dispatching, freed after dispatch */
+	struct list_head dead;
+};
+
+struct evloop *evloop_create(void);
+void evloop_destroy(struct evloop *loop);
+
+int evloop_add_fd(struct evloop *loop, int fd, unsigned int events,
+		evloop_fd_cb cb, void *data);
+int evloop_del_fd(struct evloop *loop, int fd);
+int evloop_add_signal(struct evloop *loop, const sigset_t *mask,
+		evloop_signal_cb cb, void *data);
+int evloop_add_timer(struct evloop *loop, unsigned int msec, int periodic,
+		evloop_timer_cb cb, void *data);
+int evloop_set_timer(int tfd, unsigned int msec, int periodic);
+
+int evloop_run(struct evloop *loop);
+void evloop_stop(struct evloop *loop);
+
+#endif /* __CIFSD_TOOLS_EVLOOP_H */
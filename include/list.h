@@ -82,6 +82,21 @@ static inline int list_empty(const struct list_head *head)
         return head->next == head;
 }
 
+static inline void list_splice_init(struct list_head *list,
+                                    struct list_head *head)
+{
+        if (!list_empty(list)) {
+                struct list_head *first = list->next;
+                struct list_head *last = list->prev;
+
+                first->prev = head;
+                last->next = head->next;
+                head->next->prev = last;
+                head->next = first;
+                list_head_init(list);
+        }
+}
+
 #define list_entry(ptr, type, member) ({                        \
         const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
         (type *)( (char *)__mptr - offsetof(type,member) );})
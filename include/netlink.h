@@ -21,8 +21,10 @@
 #ifndef __CIFSD_TOOLS_NETLINK_H
 #define __CIFSD_TOOLS_NETLINK_H
 
+#include <pthread.h>
 #include <linux/netlink.h>
 #include "cifsd.h"
+#include "evloop.h"
 
 #ifdef IPV6_SUPPORTED
 #define MAX_IPLEN 128
@@ -36,6 +38,32 @@
 					sizeof(struct cifsd_uevent) + \
 					NETLINK_CIFSD_MAX_PAYLOAD)
 
+/* upper limit of events handled per wakeup in batched mode */
+#define NETLINK_CIFSD_MAX_BATCH	64
+
+/*
+ * Payloads bigger than NETLINK_CIFSD_MAX_PAYLOAD travel as a multipart
+ * message: every fragment carries the same event header, NLM_F_MULTI
+ * and the sequence number of the message, and ev->buflen is the length
+ * of the whole payload. The last fragment has nlmsg_type NLMSG_DONE.
+ * Only used when both ends announced CIFSD_CAP_MULTIPART.
+ */
+#define NETLINK_CIFSD_MAX_MULTI		(256 * NETLINK_CIFSD_MAX_PAYLOAD)
+
+/* receive buffer autotuning range, see nl_set_bufsize() */
+#define NETLINK_CIFSD_MIN_RCVBUF	(256 * 1024)
+#define NETLINK_CIFSD_MAX_RCVBUF	(16 * 1024 * 1024)
+
+/* capabilities exchanged in i_conn.caps and CIFSD_KEVENT_CAPS */
+#define CIFSD_CAP_MULTIPART	0x00000001
+#define CIFSD_CAP_USER_BATCH	0x00000002
+#define CIFSD_CAP_SHARE_BATCH	0x00000004
+#define CIFSD_CAP_SHARE_REMOVE	0x00000008
+#define CIFSD_CAP_SHARE_TLV	0x00000010
+#define CIFSD_CAPS		(CIFSD_CAP_MULTIPART | CIFSD_CAP_USER_BATCH | \
+				 CIFSD_CAP_SHARE_BATCH | CIFSD_CAP_SHARE_REMOVE | \
+				 CIFSD_CAP_SHARE_TLV)
+
 #define NETLINK_REQ_INIT        0x00
 #define NETLINK_REQ_SENT        0x01
 #define NETLINK_REQ_RECV        0x02
@@ -95,6 +123,15 @@ enum cifsd_uevent_e {
 	CIFSSTAT_UEVENT_LIST_USER_RSP,
 	CIFSSTAT_UEVENT_LIST_SHARE_RSP,
 
+	/*
+	 * events to this process were dropped on overrun: re-send pending
+	 * pipe requests, or fail them towards the clients
+	 */
+	CIFSD_UEVENT_RESYNC,
+	CIFSD_UEVENT_CONFIG_USERS_RSP,
+	CIFSD_UEVENT_CONFIG_SHARES_RSP,
+	CIFSD_UEVENT_REMOVE_SHARE_RSP,
+
 	/* up events: kernel space to userspace */
 	CIFSD_KEVENT_CREATE_PIPE	= 100,
 	CIFSD_KEVENT_READ_PIPE,
@@ -111,7 +148,11 @@ enum cifsd_uevent_e {
 	CIFSADMIN_KEVENT_QUERY_USER,
 	CIFSADMIN_KEVENT_REMOVE_USER,
 	CIFSADMIN_KEVENT_KERNEL_DEBUG,
-	CIFSADMIN_KEVENT_CASELESS_SEARCH
+	CIFSADMIN_KEVENT_CASELESS_SEARCH,
+	CIFSD_KEVENT_CAPS,
+	CIFSD_KEVENT_CONFIG_USERS,
+	CIFSD_KEVENT_CONFIG_SHARES,
+	CIFSD_KEVENT_REMOVE_SHARE,
 };
 
 struct cifsd_uevent {
@@ -125,7 +166,7 @@ struct cifsd_uevent {
 		/* messages u -> k */
 		unsigned int	nt_status;
 		struct msg_init_conn {
-			unsigned int	unused;
+			unsigned int	caps;
 		} i_conn;
 		struct msg_exit_conn {
 			unsigned int	unused;
@@ -152,6 +193,12 @@ struct cifsd_uevent {
 		struct msg_user_del_response {
 			unsigned int    unused;
 		} u_del_rsp;
+		struct msg_config_users {
+			unsigned int	nr_users;
+		} c_users;
+		struct msg_config_shares {
+			unsigned int	nr_shares;
+		} c_shares;
 	} u;
 
 	union {
@@ -189,10 +236,85 @@ struct cifsd_uevent {
 		struct msg_user_del {
 			char		username[CIFSD_USERNAME_LEN];
 		} u_del;
+		struct msg_caps {
+			unsigned int	caps;
+		} caps;
 	} k;
 	char buffer[0];
 };
 
+/*
+ * Record of CIFSD_KEVENT_CONFIG_USERS, the payload is an array of
+ * u.c_users.nr_users records. CIFSD_UEVENT_CONFIG_USERS_RSP answers
+ * with one int status per record, in the same order.
+ */
+#define CIFSD_USER_REC_ID	0x01	/* uid and gid are valid */
+
+struct cifsd_user_rec {
+	char		name[CIFSD_USERNAME_LEN];
+	char		hash[CIFS_NTHASH_SIZE];
+	__u8		flags;
+	__u8		pad[2];
+	__u32		uid;
+	__u32		gid;
+};
+
+/* user records sent per CIFSD_KEVENT_CONFIG_USERS message */
+#define CIFSD_USERS_PER_MSG	(NETLINK_CIFSD_MAX_PAYLOAD / \
+				sizeof(struct cifsd_user_rec))
+
+/*
+ * CIFSD_KEVENT_CONFIG_SHARES carries u.c_shares.nr_shares share config
+ * entries back to back, each formatted like the payload of
+ * CIFSD_KEVENT_CONFIG_SHARE. CIFSD_UEVENT_CONFIG_SHARES_RSP answers with
+ * one int status per entry, in the same order.
+ */
+#define CIFSD_SHARES_PER_MSG	64
+
+/*
+ * Share config entries are "<sharename = name<key = value..." NUL
+ * terminated text, split in PAGE_SZ pieces each repeating the name.
+ * When both ends announced CIFSD_CAP_SHARE_TLV, an entry is instead a
+ * sequence of struct cifsd_tlv, each padded to 4 bytes, holding a whole
+ * section. The first TLV of an entry is CIFSD_TLV_SHARE_NAME, which also
+ * delimits entries of CIFSD_KEVENT_CONFIG_SHARES. Values are not NUL
+ * terminated. CIFSD_TLV_GUEST_OK is a __u32, other known parameters are
+ * strings. Parameters without an id are sent as CIFSD_TLV_PARAM holding
+ * "name\0value".
+ */
+struct cifsd_tlv {
+	__u16		type;
+	__u16		len;		/* value length, without padding */
+	char		value[0];
+};
+
+#define CIFSD_TLV_ALIGN(len)	(((len) + 3) & ~3U)
+#define CIFSD_TLV_SPACE(len)	(sizeof(struct cifsd_tlv) + CIFSD_TLV_ALIGN(len))
+#define CIFSD_TLV_MAX_VALUE	0xffff
+
+enum cifsd_tlv_type {
+	CIFSD_TLV_SHARE_NAME		= 1,
+	CIFSD_TLV_PARAM,
+
+	CIFSD_TLV_SERVER_STRING		= 16,
+	CIFSD_TLV_WORKGROUP,
+	CIFSD_TLV_NETBIOS_NAME,
+	CIFSD_TLV_COMMENT,
+	CIFSD_TLV_PATH,
+	CIFSD_TLV_GUEST_OK,
+	CIFSD_TLV_ALLOW_HOSTS,
+	CIFSD_TLV_DENY_HOSTS,
+	CIFSD_TLV_VALID_USERS,
+	CIFSD_TLV_INVALID_USERS,
+};
+
+/*
+ * On config reload, a share config entry for a configured share name
+ * replaces the settings of that share. CIFSD_KEVENT_REMOVE_SHARE carries
+ * the NUL terminated name of a share to unexport and is only sent when
+ * the kernel announced CIFSD_CAP_SHARE_REMOVE.
+ */
+
 struct smb2_inotify_req_info {
 	__le16 watch_tree_flag;
 	__le32 CompletionFilter;
@@ -212,10 +334,108 @@ struct smb2_inotify_res_info {
 	struct FileNotifyInformation file_notify_info[];
 };
 
+/* per socket counters, see nl_dump_stats() */
+struct nl_stats {
+	unsigned long nr_events;	/* messages handed to event_handle_cb */
+	unsigned long nr_replies;	/* responses to asynchronous requests */
+	unsigned long nr_recv_calls;	/* receive syscalls issued */
+	unsigned long nr_send_calls;	/* send syscalls issued */
+	unsigned long nr_truncated;	/* messages dropped as oversize */
+	unsigned long nr_batches;	/* recvmmsg() wakeups in batched mode */
+	unsigned long nr_multipart;	/* multipart messages reassembled */
+	unsigned long nr_overruns;	/* ENOBUFS, events lost by kernel */
+	unsigned long max_backlog;	/* peak bytes queued on receive */
+};
+
+/* multipart message being reassembled */
+struct nl_multi {
+	char *buf;			/* nlmsghdr, event and whole payload */
+	unsigned int len;		/* payload bytes received so far */
+	unsigned int total;		/* payload length announced in buflen */
+	__u32 seq;
+	int discard;			/* drop fragments until NLMSG_DONE */
+};
+
+/* receive and send slots for batched mode, see nl_set_batch() */
+struct nl_batch {
+	unsigned int size;
+	struct mmsghdr *rcv_msgs;
+	struct iovec *rcv_iov;
+	char *rcv_bufs;
+	struct mmsghdr *snd_msgs;
+	struct iovec *snd_iov;
+	char *snd_bufs;
+	unsigned int nr_queued;		/* responses waiting for sendmmsg */
+	int collecting;			/* queue sends instead of sending */
+};
+
+/* events queued by other threads for the single writer thread */
+struct nl_txmsg {
+	struct list_head list;
+	unsigned int len;
+	char buf[];
+};
+
+struct nl_txq {
+	pthread_mutex_t lock;
+	struct list_head queue;
+	pthread_t writer;
+	int efd;			/* eventfd waking the writer */
+	struct evloop *loop;
+};
+
+struct nl_sock;
+
+/* requests sent without waiting, in flight at most per default */
+#define NETLINK_CIFSD_ASYNC_WINDOW	32
+/* time without any response after which pending requests are cancelled */
+#define NETLINK_CIFSD_ASYNC_TIMEOUT_MS	10000
+
+/* response to nl_async_send(), @nlh is NULL if the request is cancelled */
+typedef void (*nl_done_cb)(struct nl_sock *nlsock, struct nlmsghdr *nlh,
+		void *priv);
+
+struct nl_pending {
+	struct list_head list;
+	__u32 seq;
+	unsigned int rsp_type;
+	nl_done_cb done;
+	void *priv;
+};
+
+/* backend carrying cifsd_uevent frames, selected at nl_init() time */
+struct nl_transport {
+	const char *name;
+	int (*open)(struct nl_sock *nlsock, const char *arg);
+};
+
+#define CIFSD_TRANSPORT_ENV	"CIFSD_TRANSPORT"
+
 struct nl_sock {
 	char *nlsk_rcv_buf;
-	char *nlsk_send_buf;
+	unsigned int nlsk_rcv_len;	/* allocated size of nlsk_rcv_buf */
 	int nlsk_fd;
+	int nlsk_eof;			/* peer closed the connection */
+	const struct nl_transport *transport;
+	/* destination of sends, NULL on connected transports */
+	struct sockaddr *nlsk_dest;
+	socklen_t nlsk_destlen;
+	struct nl_stats stats;
+	struct nl_batch *batch;
+	struct nl_txq *txq;
+	struct nl_multi multi;
+	unsigned int peer_caps;		/* from CIFSD_KEVENT_CAPS */
+	int caps_known;			/* CIFSD_KEVENT_CAPS was received */
+	int caps_frozen;		/* peer_caps in use by config pushes */
+	unsigned int rcvbuf;		/* receive buffer size in effect */
+	int rcvbuf_auto;		/* grow rcvbuf with observed backlog */
+	unsigned long nr_wakeups;
+	__u32 nlsk_seq;			/* last sequence number sent */
+	pthread_mutex_t pending_lock;
+	pthread_cond_t pending_cond;	/* a pending request completed */
+	struct list_head pending;	/* nl_pending, oldest first */
+	unsigned int nr_pending;
+	unsigned long nr_cancels;	/* nl_async_cancel() calls */
 	struct sockaddr_nl src_addr;
 	struct sockaddr_nl dest_addr;
 	int (*event_handle_cb)(struct nl_sock *nlsock);
@@ -227,14 +447,30 @@ struct list_head cifsd_notify_clients;
 int cifsd_common_sendmsg(struct nl_sock *nlsock, struct cifsd_uevent *ev,
 		char *buf, unsigned int buflen);
 int cifsd_netlink_setup(struct nl_sock *nlsock);
+int cifsd_reload_config(struct nl_sock *nlsock);
+int cifsd_retry_held_shares(struct nl_sock *nlsock);
 
 /* Netlink Interface*/
 struct nl_sock *nl_init();
 int nl_handle_event(struct nl_sock *nlsock);
-void nl_loop(struct nl_sock *nlsock);
+int nl_handle_batch(struct nl_sock *nlsock);
+unsigned int nl_max_payload(struct nl_sock *nlsock);
+int nl_async_send(struct nl_sock *nlsock, struct cifsd_uevent *ev,
+		char *buf, unsigned int buflen, unsigned int rsp_type,
+		nl_done_cb done, void *priv);
+int nl_async_wait(struct nl_sock *nlsock, unsigned int max_inflight);
+void nl_async_cancel(struct nl_sock *nlsock);
+int nl_set_batch(struct nl_sock *nlsock, unsigned int size);
+int nl_set_bufsize(struct nl_sock *nlsock, unsigned int rcvbuf,
+		unsigned int sndbuf);
+int nl_set_writer(struct nl_sock *nlsock, struct evloop *loop);
+void nl_clear_writer(struct nl_sock *nlsock);
+int nl_loop(struct nl_sock *nlsock, struct evloop *loop);
 int nl_exit(struct nl_sock *nlsock);
+void nl_dump_stats(struct nl_sock *nlsock);
 
 int nl_handle_early_init_cifsd(struct nl_sock *nlsock);
+void nl_freeze_caps(struct nl_sock *nlsock);
 int nl_handle_init_cifsd(struct nl_sock *nlsock);
 int nl_handle_exit_cifsd(struct nl_sock *nlsock);
 int nl_handle_init_cifsstat(struct nl_sock *nlsock);
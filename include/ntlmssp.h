@@ -160,6 +160,6 @@ struct ntlmv2_resp {
 } __attribute__((packed));
 
 unsigned int build_ntlmssp_challenge_blob(CHALLENGE_MESSAGE *chgblob,
-		char *codepage);
+		int cp);
 
 #endif /* __CIFSD_NTLMSSP_H */
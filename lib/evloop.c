@@ -0,0 +1,335 @@
+/*
+ *   cifsd-tools/lib/evloop.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "cifsd.h"
+#include "evloop.h"
+
+/**
+ * evloop_create() - create an epoll based event loop
+ *
+ * Return:	event loop on success, NULL on error
+ */
+struct evloop *evloop_create(void)
+{
+	struct evloop *loop;
+
+	loop = calloc(1, sizeof(struct evloop));
+	if (!loop)
+		return NULL;
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		perror("epoll_create1");
+		free(loop);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&loop->sources);
+	INIT_LIST_HEAD(&loop->dead);
+	return loop;
+}
+
+static void evloop_free_dead(struct evloop *loop)
+{
+	struct evloop_source *src;
+	struct list_head *tmp, *t;
+
+	list_for_each_safe(tmp, t, &loop->dead) {
+		src = list_entry(tmp, struct evloop_source, list);
+		list_del(&src->list);
+		free(src);
+	}
+}
+
+static void evloop_release(struct evloop *loop, struct evloop_source *src)
+{
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+	/* signalfd and timerfd are owned by the loop */
+	if (src->type != EVLOOP_FD)
+		close(src->fd);
+
+	src->dead = 1;
+	list_move(&src->list, &loop->dead);
+}
+
+/**
+ * evloop_destroy() - release event loop and all of its sources
+ * @loop:	event loop
+ */
+void evloop_destroy(struct evloop *loop)
+{
+	struct evloop_source *src;
+	struct list_head *tmp, *t;
+
+	list_for_each_safe(tmp, t, &loop->sources) {
+		src = list_entry(tmp, struct evloop_source, list);
+		evloop_release(loop, src);
+	}
+
+	evloop_free_dead(loop);
+	close(loop->epfd);
+	free(loop);
+}
+
+static struct evloop_source *evloop_add(struct evloop *loop, int fd,
+		int type, unsigned int events, void *data)
+{
+	struct evloop_source *src;
+	struct epoll_event ev;
+
+	src = calloc(1, sizeof(struct evloop_source));
+	if (!src)
+		return NULL;
+
+	src->fd = fd;
+	src->type = type;
+	src->data = data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = src;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		cifsd_err("failed to watch fd %d, errno %d\n", fd, errno);
+		free(src);
+		return NULL;
+	}
+
+	list_add_tail(&src->list, &loop->sources);
+	return src;
+}
+
+/**
+ * evloop_add_fd() - watch a file descriptor
+ * @loop:	event loop
+ * @fd:		file descriptor, still owned by the caller
+ * @events:	epoll events to wait for
+ * @cb:		callback run when any of @events is ready
+ * @data:	callback private data
+ *
+ * Return:	0 on success, -1 on error
+ */
+int evloop_add_fd(struct evloop *loop, int fd, unsigned int events,
+		evloop_fd_cb cb, void *data)
+{
+	struct evloop_source *src;
+
+	src = evloop_add(loop, fd, EVLOOP_FD, events, data);
+	if (!src)
+		return -1;
+
+	src->cb.fd = cb;
+	return 0;
+}
+
+/**
+ * evloop_del_fd() - stop watching a file descriptor, signalfd or timerfd
+ * @loop:	event loop
+ * @fd:		file descriptor returned by or passed to evloop_add_*()
+ *
+ * Safe to call from a callback. Signal and timer descriptors are closed.
+ *
+ * Return:	0 on success, -ENOENT if @fd is not watched
+ */
+int evloop_del_fd(struct evloop *loop, int fd)
+{
+	struct evloop_source *src;
+
+	list_for_each_entry(src, &loop->sources, list) {
+		if (src->fd == fd) {
+			evloop_release(loop, src);
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * evloop_add_signal() - deliver signals through the event loop
+ * @loop:	event loop
+ * @mask:	signals to deliver, they are blocked for the calling thread
+ * @cb:		callback run once per received signal
+ * @data:	callback private data
+ *
+ * Return:	signalfd on success, -1 on error
+ */
+int evloop_add_signal(struct evloop *loop, const sigset_t *mask,
+		evloop_signal_cb cb, void *data)
+{
+	struct evloop_source *src;
+	int sfd;
+
+	if (sigprocmask(SIG_BLOCK, mask, NULL)) {
+		perror("sigprocmask");
+		return -1;
+	}
+
+	sfd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sfd < 0) {
+		perror("signalfd");
+		return -1;
+	}
+
+	src = evloop_add(loop, sfd, EVLOOP_SIGNAL, EPOLLIN, data);
+	if (!src) {
+		close(sfd);
+		return -1;
+	}
+
+	src->cb.signal = cb;
+	return sfd;
+}
+
+/**
+ * evloop_set_timer() - arm or disarm a timer
+ * @tfd:	timerfd returned by evloop_add_timer()
+ * @msec:	expiry in milliseconds, 0 disarms the timer
+ * @periodic:	rearm the timer with the same interval after expiry
+ *
+ * Return:	0 on success, -1 on error
+ */
+int evloop_set_timer(int tfd, unsigned int msec, int periodic)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = msec / 1000;
+	its.it_value.tv_nsec = (msec % 1000) * 1000000;
+	if (periodic)
+		its.it_interval = its.it_value;
+
+	if (timerfd_settime(tfd, 0, &its, NULL)) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * evloop_add_timer() - create a timer run by the event loop
+ * @loop:	event loop
+ * @msec:	first expiry in milliseconds, 0 creates a disarmed timer
+ * @periodic:	rearm the timer with the same interval after expiry
+ * @cb:		callback run on expiry
+ * @data:	callback private data
+ *
+ * Return:	timerfd on success, -1 on error
+ */
+int evloop_add_timer(struct evloop *loop, unsigned int msec, int periodic,
+		evloop_timer_cb cb, void *data)
+{
+	struct evloop_source *src;
+	int tfd;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	if (msec && evloop_set_timer(tfd, msec, periodic)) {
+		close(tfd);
+		return -1;
+	}
+
+	src = evloop_add(loop, tfd, EVLOOP_TIMER, EPOLLIN, data);
+	if (!src) {
+		close(tfd);
+		return -1;
+	}
+
+	src->cb.timer = cb;
+	return tfd;
+}
+
+static void evloop_dispatch(struct evloop *loop, struct evloop_source *src,
+		unsigned int events)
+{
+	struct signalfd_siginfo si;
+	uint64_t expired;
+
+	switch (src->type) {
+	case EVLOOP_FD:
+		src->cb.fd(loop, src->fd, events, src->data);
+		break;
+	case EVLOOP_SIGNAL:
+		while (!src->dead &&
+		       read(src->fd, &si, sizeof(si)) == sizeof(si))
+			src->cb.signal(loop, si.ssi_signo, src->data);
+		break;
+	case EVLOOP_TIMER:
+		if (read(src->fd, &expired, sizeof(expired)) ==
+				sizeof(expired))
+			src->cb.timer(loop, src->fd, src->data);
+		break;
+	}
+}
+
+/**
+ * evloop_run() - run event loop until evloop_stop() is called
+ * @loop:	event loop
+ *
+ * Return:	0 when stopped, -1 on error
+ */
+int evloop_run(struct evloop *loop)
+{
+	struct epoll_event events[EVLOOP_MAX_EVENTS];
+	struct evloop_source *src;
+	int i, nr;
+
+	loop->running = 1;
+	while (loop->running) {
+		nr = epoll_wait(loop->epfd, events, EVLOOP_MAX_EVENTS, -1);
+		if (nr == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+
+		for (i = 0; i < nr; i++) {
+			src = events[i].data.ptr;
+			if (!src->dead)
+				evloop_dispatch(loop, src, events[i].events);
+		}
+		evloop_free_dead(loop);
+	}
+
+	return 0;
+}
+
+/**
+ * evloop_stop() - make evloop_run() return after current dispatch round
+ * @loop:	event loop
+ */
+void evloop_stop(struct evloop *loop)
+{
+	loop->running = 0;
+}
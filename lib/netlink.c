@@ -18,198 +18,1503 @@
  *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <linux/sock_diag.h>
 
 #include "netlink.h"
 
+/* bytes between the end of event header and the start of payload */
+#define NL_EV_HDRLEN	offsetof(struct cifsd_uevent, buffer)
+#define NL_EV_PADLEN	(NLMSG_SPACE(sizeof(struct cifsd_uevent)) - \
+			 NLMSG_HDRLEN - NL_EV_HDRLEN)
+
+/* wakeups between two samples of the receive backlog */
+#define NL_TUNE_INTERVAL	64
+
+static const char nl_pad[NLMSG_ALIGNTO];
+
+/**
+ * nl_init_hdr() - initialize netlink header for an event
+ * @nlh:	netlink header to initialize
+ * @eev:	event header
+ * @dlen:	payload length
+ * @seq:	sequence number, echoed by the kernel in its response
+ */
+static void nl_init_hdr(struct nlmsghdr *nlh, struct cifsd_uevent *eev,
+		unsigned int dlen, __u32 seq)
+{
+	nlh->nlmsg_len = NLMSG_SPACE(sizeof(*eev)) + dlen;
+	nlh->nlmsg_type = eev->type;
+	nlh->nlmsg_flags = 0;
+	nlh->nlmsg_seq = seq;
+	nlh->nlmsg_pid = getpid();
+}
+
+/**
+ * nl_init_frag() - initialize netlink header of a multipart fragment
+ * @nlh:	netlink header to initialize
+ * @eev:	event header
+ * @dlen:	length of the whole payload
+ * @off:	offset of the fragment in the payload
+ * @seq:	sequence number of the multipart message
+ *
+ * Return:	payload length of the fragment
+ */
+static unsigned int nl_init_frag(struct nlmsghdr *nlh,
+		struct cifsd_uevent *eev, unsigned int dlen, unsigned int off,
+		__u32 seq)
+{
+	unsigned int flen = dlen - off;
+
+	if (flen > NETLINK_CIFSD_MAX_PAYLOAD)
+		flen = NETLINK_CIFSD_MAX_PAYLOAD;
+
+	nl_init_hdr(nlh, eev, flen, seq);
+	nlh->nlmsg_flags = NLM_F_MULTI;
+	if (off + flen == dlen)
+		nlh->nlmsg_type = NLMSG_DONE;
+	return flen;
+}
+
+/**
+ * nl_fill_iov() - describe a netlink message with iovecs, without copying
+ * @iov:	array of at least 4 iovecs
+ * @nlh:	initialized netlink header
+ * @eev:	event header
+ * @dlen:	payload length
+ * @data:	payload
+ *
+ * Return:	number of iovecs used
+ */
+static int nl_fill_iov(struct iovec *iov, struct nlmsghdr *nlh,
+		struct cifsd_uevent *eev, unsigned int dlen, char *data)
+{
+	int iovlen = 0;
+
+	iov[iovlen].iov_base = (void *)nlh;
+	iov[iovlen++].iov_len = NLMSG_HDRLEN;
+	iov[iovlen].iov_base = (void *)eev;
+	iov[iovlen++].iov_len = NL_EV_HDRLEN;
+	if (NL_EV_PADLEN) {
+		iov[iovlen].iov_base = (void *)nl_pad;
+		iov[iovlen++].iov_len = NL_EV_PADLEN;
+	}
+	if (dlen) {
+		iov[iovlen].iov_base = (void *)data;
+		iov[iovlen++].iov_len = dlen;
+	}
+	return iovlen;
+}
+
+/**
+ * nl_build_msg() - build a netlink message for an event in a buffer
+ * @buf:	destination buffer, large enough for header and payload
+ * @hdr:	initialized netlink header
+ * @eev:	event header
+ * @dlen:	payload length
+ * @data:	payload
+ *
+ * Return:	length of built netlink message
+ */
+static unsigned int nl_build_msg(char *buf, struct nlmsghdr *hdr,
+		struct cifsd_uevent *eev, unsigned int dlen, char *data)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	char *ev = NLMSG_DATA(nlh);
+
+	memcpy(nlh, hdr, NLMSG_HDRLEN);
+	memcpy(ev, eev, NL_EV_HDRLEN);
+	memset(ev + NL_EV_HDRLEN, 0, NL_EV_PADLEN);
+	if (dlen)
+		memcpy(ev + NL_EV_HDRLEN + NL_EV_PADLEN, data, dlen);
+
+	return nlh->nlmsg_len;
+}
+
+/**
+ * nl_sendmmsg() - send prepared messages, retrying partial sends
+ * @nlsock:	netlink socket
+ * @msgs:	messages to send
+ * @nr:		number of messages
+ *
+ * Return:	number of messages sent, -1 on error
+ */
+static int nl_sendmmsg(struct nl_sock *nlsock, struct mmsghdr *msgs,
+		unsigned int nr)
+{
+	unsigned int sent = 0;
+	int ret;
+
+	while (sent < nr) {
+		nlsock->stats.nr_send_calls++;
+		ret = sendmmsg(nlsock->nlsk_fd, msgs + sent, nr - sent,
+				MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("sendmmsg");
+			cifsd_err("dropped %u queued events\n", nr - sent);
+			return -1;
+		}
+		sent += ret;
+	}
+
+	return sent;
+}
+
+/**
+ * nl_flush_batch() - send all queued responses with sendmmsg()
+ * @nlsock:	netlink socket
+ *
+ * Return:	number of messages sent, -1 on error
+ */
+static int nl_flush_batch(struct nl_sock *nlsock)
+{
+	struct nl_batch *batch = nlsock->batch;
+	int ret;
+
+	ret = nl_sendmmsg(nlsock, batch->snd_msgs, batch->nr_queued);
+	batch->nr_queued = 0;
+	return ret;
+}
+
+/**
+ * nl_queue_msg() - queue an event to be sent at the end of current batch
+ * @nlsock:	netlink socket
+ * @eev:	event header
+ * @dlen:	payload length
+ * @data:	payload
+ * @seq:	sequence number
+ *
+ * Return:	length of queued message, -1 on error
+ */
+static int nl_queue_msg(struct nl_sock *nlsock, struct cifsd_uevent *eev,
+		unsigned int dlen, char *data, __u32 seq)
+{
+	struct nl_batch *batch = nlsock->batch;
+	struct nlmsghdr nlh;
+	struct mmsghdr *mmsg;
+	char *buf;
+
+	if (batch->nr_queued == batch->size && nl_flush_batch(nlsock) < 0)
+		return -1;
+
+	nl_init_hdr(&nlh, eev, dlen, seq);
+	buf = batch->snd_bufs + batch->nr_queued * NETLINK_CIFSD_MAX_BUF;
+	mmsg = &batch->snd_msgs[batch->nr_queued];
+	mmsg->msg_hdr.msg_iov->iov_len = nl_build_msg(buf, &nlh, eev, dlen,
+			data);
+	batch->nr_queued++;
+
+	return mmsg->msg_hdr.msg_iov->iov_len;
+}
+
+static struct nl_txmsg *nl_txq_alloc(struct nlmsghdr *nlh,
+		struct cifsd_uevent *eev, unsigned int dlen, char *data)
+{
+	struct nl_txmsg *txmsg;
+
+	txmsg = malloc(sizeof(struct nl_txmsg) +
+			NLMSG_SPACE(sizeof(*eev)) + dlen);
+	if (!txmsg)
+		return NULL;
+
+	txmsg->len = nl_build_msg(txmsg->buf, nlh, eev, dlen, data);
+	return txmsg;
+}
+
+static void nl_txq_free(struct list_head *queue)
+{
+	struct nl_txmsg *txmsg;
+	struct list_head *tmp, *t;
+
+	list_for_each_safe(tmp, t, queue) {
+		txmsg = list_entry(tmp, struct nl_txmsg, list);
+		list_del(&txmsg->list);
+		free(txmsg);
+	}
+}
+
+/**
+ * nl_txq_push() - append messages to the writer queue and wake the writer
+ * @nlsock:	netlink socket
+ * @msgs:	list of nl_txmsg, emptied
+ *
+ * All messages are appended at once, so fragments of a multipart message
+ * queued from different threads never interleave.
+ */
+static void nl_txq_push(struct nl_sock *nlsock, struct list_head *msgs)
+{
+	struct nl_txq *txq = nlsock->txq;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&txq->lock);
+	list_splice_init(msgs, txq->queue.prev);
+	pthread_mutex_unlock(&txq->lock);
+
+	if (write(txq->efd, &one, sizeof(one)) != sizeof(one))
+		perror("eventfd write");
+}
+
+/**
+ * nl_txq_queue() - hand an event over to the writer thread
+ * @nlsock:	netlink socket
+ * @eev:	event header
+ * @dlen:	payload length
+ * @data:	payload
+ * @seq:	sequence number
+ *
+ * Return:	length of queued message, -1 on error
+ */
+static int nl_txq_queue(struct nl_sock *nlsock, struct cifsd_uevent *eev,
+		unsigned int dlen, char *data, __u32 seq)
+{
+	struct nl_txmsg *txmsg;
+	struct nlmsghdr nlh;
+	struct list_head msgs;
+	int len;
+
+	nl_init_hdr(&nlh, eev, dlen, seq);
+	txmsg = nl_txq_alloc(&nlh, eev, dlen, data);
+	if (!txmsg) {
+		cifsd_err("failed to queue event %u\n", eev->type);
+		return -1;
+	}
+
+	len = txmsg->len;
+	INIT_LIST_HEAD(&msgs);
+	list_add_tail(&txmsg->list, &msgs);
+	nl_txq_push(nlsock, &msgs);
+	return len;
+}
+
+/**
+ * nl_txq_queue_multi() - hand all fragments of a multipart message over
+ *		to the writer thread
+ * @nlsock:	netlink socket
+ * @eev:	event header
+ * @dlen:	payload length
+ * @data:	payload
+ * @seq:	sequence number of the multipart message
+ *
+ * Return:	length of queued fragments, -1 on error
+ */
+static int nl_txq_queue_multi(struct nl_sock *nlsock,
+		struct cifsd_uevent *eev, unsigned int dlen, char *data,
+		__u32 seq)
+{
+	struct nl_txmsg *txmsg;
+	struct nlmsghdr nlh;
+	struct list_head msgs;
+	unsigned int off = 0, flen;
+	int len = 0;
+
+	INIT_LIST_HEAD(&msgs);
+	while (off < dlen) {
+		flen = nl_init_frag(&nlh, eev, dlen, off, seq);
+		txmsg = nl_txq_alloc(&nlh, eev, flen, data + off);
+		if (!txmsg) {
+			cifsd_err("failed to queue event %u\n", eev->type);
+			nl_txq_free(&msgs);
+			return -1;
+		}
+		list_add_tail(&txmsg->list, &msgs);
+		len += txmsg->len;
+		off += flen;
+	}
+
+	nl_txq_push(nlsock, &msgs);
+	return len;
+}
+
+/**
+ * nl_txq_flush() - send every event queued by other threads
+ * @nlsock:	netlink socket
+ */
+static void nl_txq_flush(struct nl_sock *nlsock)
+{
+	struct nl_txq *txq = nlsock->txq;
+	struct mmsghdr msgs[NETLINK_CIFSD_MAX_BATCH];
+	struct iovec iov[NETLINK_CIFSD_MAX_BATCH];
+	struct nl_txmsg *txmsg;
+	struct list_head queue;
+	unsigned int nr = 0;
+
+	INIT_LIST_HEAD(&queue);
+	pthread_mutex_lock(&txq->lock);
+	list_splice_init(&txq->queue, &queue);
+	pthread_mutex_unlock(&txq->lock);
+
+	memset(msgs, 0, sizeof(msgs));
+	list_for_each_entry(txmsg, &queue, list) {
+		iov[nr].iov_base = txmsg->buf;
+		iov[nr].iov_len = txmsg->len;
+		msgs[nr].msg_hdr.msg_name = nlsock->nlsk_dest;
+		msgs[nr].msg_hdr.msg_namelen = nlsock->nlsk_destlen;
+		msgs[nr].msg_hdr.msg_iov = &iov[nr];
+		msgs[nr].msg_hdr.msg_iovlen = 1;
+		if (++nr == NETLINK_CIFSD_MAX_BATCH) {
+			nl_sendmmsg(nlsock, msgs, nr);
+			nr = 0;
+		}
+	}
+	if (nr)
+		nl_sendmmsg(nlsock, msgs, nr);
+
+	nl_txq_free(&queue);
+}
+
+static void nl_txq_cb(struct evloop *loop, int fd, unsigned int events,
+		void *data)
+{
+	uint64_t cnt;
+
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return;
+
+	nl_txq_flush((struct nl_sock *)data);
+}
+
+/**
+ * nl_set_writer() - make the calling thread the only one writing to the
+ *		socket; events sent from other threads are queued and sent
+ *		from @loop
+ * @nlsock:	netlink socket
+ * @loop:	event loop run by the calling thread
+ *
+ * Return:	0 on success, -1 on error
+ */
+int nl_set_writer(struct nl_sock *nlsock, struct evloop *loop)
+{
+	struct nl_txq *txq;
+
+	txq = calloc(1, sizeof(struct nl_txq));
+	if (!txq)
+		return -1;
+
+	txq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (txq->efd < 0) {
+		perror("eventfd");
+		free(txq);
+		return -1;
+	}
+
+	if (evloop_add_fd(loop, txq->efd, EPOLLIN, nl_txq_cb, nlsock)) {
+		close(txq->efd);
+		free(txq);
+		return -1;
+	}
+
+	pthread_mutex_init(&txq->lock, NULL);
+	INIT_LIST_HEAD(&txq->queue);
+	txq->writer = pthread_self();
+	txq->loop = loop;
+	nlsock->txq = txq;
+	return 0;
+}
+
+/**
+ * nl_clear_writer() - send queued events and go back to direct sends
+ * @nlsock:	netlink socket
+ *
+ * Must be called by the writer thread once no other thread sends.
+ */
+void nl_clear_writer(struct nl_sock *nlsock)
+{
+	struct nl_txq *txq = nlsock->txq;
+
+	if (!txq)
+		return;
+
+	nl_txq_flush(nlsock);
+	nlsock->txq = NULL;
+	evloop_del_fd(txq->loop, txq->efd);
+	close(txq->efd);
+	pthread_mutex_destroy(&txq->lock);
+	free(txq);
+}
+
+/**
+ * nl_send_multi() - send a payload bigger than NETLINK_CIFSD_MAX_PAYLOAD
+ *		as one multipart message
+ * @nlsock:	netlink socket
+ * @eev:	event header
+ * @dlen:	payload length
+ * @data:	payload
+ * @seq:	sequence number shared by all fragments
+ *
+ * Fragments point into @data and are sent with sendmmsg(), up to
+ * NETLINK_CIFSD_MAX_BATCH of them per call.
+ *
+ * Return:	number of bytes sent, -1 on error
+ */
+static int nl_send_multi(struct nl_sock *nlsock, struct cifsd_uevent *eev,
+		unsigned int dlen, char *data, __u32 seq)
+{
+	struct nlmsghdr nlh[NETLINK_CIFSD_MAX_BATCH];
+	struct iovec iov[NETLINK_CIFSD_MAX_BATCH][4];
+	struct mmsghdr msgs[NETLINK_CIFSD_MAX_BATCH];
+	unsigned int off = 0, flen;
+	int nr, len = 0;
+
+	if (nlsock->txq &&
+	    !pthread_equal(pthread_self(), nlsock->txq->writer))
+		return nl_txq_queue_multi(nlsock, eev, dlen, data, seq);
+
+	/* keep responses queued earlier in this batch ahead of it */
+	if (nlsock->batch && nlsock->batch->nr_queued &&
+	    nl_flush_batch(nlsock) < 0)
+		return -1;
+
+	memset(msgs, 0, sizeof(msgs));
+	while (off < dlen) {
+		for (nr = 0; nr < NETLINK_CIFSD_MAX_BATCH && off < dlen;
+				nr++) {
+			flen = nl_init_frag(&nlh[nr], eev, dlen, off, seq);
+			msgs[nr].msg_hdr.msg_name = nlsock->nlsk_dest;
+			msgs[nr].msg_hdr.msg_namelen = nlsock->nlsk_destlen;
+			msgs[nr].msg_hdr.msg_iov = iov[nr];
+			msgs[nr].msg_hdr.msg_iovlen = nl_fill_iov(iov[nr],
+					&nlh[nr], eev, flen, data + off);
+			len += nlh[nr].nlmsg_len;
+			off += flen;
+		}
+
+		if (nl_sendmmsg(nlsock, msgs, nr) < 0)
+			return -1;
+	}
+
+	return len;
+}
+
+/**
+ * cifsd_sendmsg() - send an event to the kernel
+ * @nlsock:	netlink socket
+ * @eev:	event header
+ * @dlen:	payload length
+ * @data:	payload
+ * @seq:	sequence number
+ *
+ * The netlink header, the event header and the payload are handed to
+ * sendmsg() as separate iovecs, so neither is copied into a send buffer.
+ *
+ * Return:	number of bytes sent, -1 on error
+ */
 static int cifsd_sendmsg(struct nl_sock *nlsock, struct cifsd_uevent *eev,
-		unsigned int dlen, char *data)
+		unsigned int dlen, char *data, __u32 seq)
 {
-	struct nlmsghdr *nlh;
-	struct cifsd_uevent *ev;
+	struct nlmsghdr nlh;
 	struct msghdr msg;
-	struct iovec iov;
+	struct iovec iov[4];
 	int len;
 
-	cifsd_debug("sending %u event\n", eev->type);
-	nlh = (struct nlmsghdr *)nlsock->nlsk_send_buf;
-	memset(nlh, 0, NETLINK_CIFSD_MAX_BUF);
-	nlh->nlmsg_len = NLMSG_SPACE(sizeof(*ev));
-	nlh->nlmsg_type = eev->type;
-	nlh->nlmsg_pid = getpid();
-	memcpy(NLMSG_DATA(nlh), eev, sizeof(*ev));
-	ev = (struct cifsd_uevent *)NLMSG_DATA(nlh);
+	cifsd_debug("sending %u event\n", eev->type);
+	if (dlen > NETLINK_CIFSD_MAX_PAYLOAD)
+		return nl_send_multi(nlsock, eev, dlen, data, seq);
+
+	if (nlsock->txq &&
+	    !pthread_equal(pthread_self(), nlsock->txq->writer))
+		return nl_txq_queue(nlsock, eev, dlen, data, seq);
+
+	if (nlsock->batch && nlsock->batch->collecting)
+		return nl_queue_msg(nlsock, eev, dlen, data, seq);
+
+	nl_init_hdr(&nlh, eev, dlen, seq);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = nlsock->nlsk_dest;
+	msg.msg_namelen = nlsock->nlsk_destlen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = nl_fill_iov(iov, &nlh, eev, dlen, data);
+
+	nlsock->stats.nr_send_calls++;
+	/* a closed unix transport peer must not raise SIGPIPE */
+	len = sendmsg(nlsock->nlsk_fd, &msg, MSG_NOSIGNAL);
+	if (len == -1)
+		perror("sendmsg");
+	else if (len != nlh.nlmsg_len)
+		cifsd_err("partial data send, expected %u, actual %u\n",
+				nlh.nlmsg_len, len);
+	return len;
+}
+
+/**
+ * nl_max_payload() - largest payload which can be sent to the kernel
+ * @nlsock:	netlink socket
+ *
+ * Return:	NETLINK_CIFSD_MAX_MULTI if the kernel reassembles multipart
+ *		messages, NETLINK_CIFSD_MAX_PAYLOAD otherwise
+ */
+unsigned int nl_max_payload(struct nl_sock *nlsock)
+{
+	if (nlsock->peer_caps & CIFSD_CAP_MULTIPART)
+		return NETLINK_CIFSD_MAX_MULTI;
+	return NETLINK_CIFSD_MAX_PAYLOAD;
+}
+
+static __u32 nl_next_seq(struct nl_sock *nlsock)
+{
+	__u32 seq;
+
+	/* 0 is left for peers which do not number their messages */
+	do {
+		seq = __sync_add_and_fetch(&nlsock->nlsk_seq, 1);
+	} while (!seq);
+	return seq;
+}
+
+static int nl_send(struct nl_sock *nlsock, struct cifsd_uevent *ev,
+		char *buf, unsigned int buflen, __u32 seq)
+{
+	int ret;
+
+	if (buflen > nl_max_payload(nlsock)) {
+		cifsd_err("too big(%u) buffer\n", buflen);
+		return -1;
+	}
+
+	ret = cifsd_sendmsg(nlsock, ev, buflen, buf, seq);
+	if (ret < 0)
+		cifsd_err("failed to send event %u\n", ev->type);
+
+	return ret;
+}
+
+int cifsd_common_sendmsg(struct nl_sock *nlsock, struct cifsd_uevent *ev,
+		char *buf, unsigned int buflen)
+{
+	return nl_send(nlsock, ev, buf, buflen, nl_next_seq(nlsock));
+}
+
+/**
+ * nl_async_send() - send a request without waiting for its response
+ * @nlsock:	netlink socket
+ * @ev:		event header
+ * @buf:	payload
+ * @buflen:	payload length
+ * @rsp_type:	event type of the expected response
+ * @done:	called from nl_async_wait() or event handling with the
+ *		response, or with NULL if the request is cancelled
+ * @priv:	passed to @done
+ *
+ * The response is matched by sequence number. A response without one is
+ * matched to the oldest pending request expecting its event type.
+ * Requests may be sent from any thread, @done runs on the thread reading
+ * the socket.
+ *
+ * Return:	number of bytes sent, -1 on error; @done is not called
+ *		when sending fails
+ */
+int nl_async_send(struct nl_sock *nlsock, struct cifsd_uevent *ev,
+		char *buf, unsigned int buflen, unsigned int rsp_type,
+		nl_done_cb done, void *priv)
+{
+	struct nl_pending *req;
+	int ret;
+
+	req = malloc(sizeof(struct nl_pending));
+	if (!req)
+		return -1;
+
+	req->seq = nl_next_seq(nlsock);
+	req->rsp_type = rsp_type;
+	req->done = done;
+	req->priv = priv;
+
+	/* pending before sending, the reader may see the response first */
+	pthread_mutex_lock(&nlsock->pending_lock);
+	list_add_tail(&req->list, &nlsock->pending);
+	nlsock->nr_pending++;
+	pthread_mutex_unlock(&nlsock->pending_lock);
+
+	ret = nl_send(nlsock, ev, buf, buflen, req->seq);
+	if (ret < 0) {
+		pthread_mutex_lock(&nlsock->pending_lock);
+		list_del(&req->list);
+		nlsock->nr_pending--;
+		pthread_mutex_unlock(&nlsock->pending_lock);
+		free(req);
+	}
+	return ret;
+}
+
+/**
+ * nl_complete() - complete the pending request a message responds to
+ * @nlsock:	netlink socket
+ * @nlh:	received message
+ *
+ * Return:	1 if @nlh was a response to a pending request, 0 otherwise
+ */
+static int nl_complete(struct nl_sock *nlsock, struct nlmsghdr *nlh)
+{
+	struct nl_pending *req, *match = NULL;
+
+	pthread_mutex_lock(&nlsock->pending_lock);
+	/*
+	 * A numbered reply must also carry the expected type, so kernel
+	 * events whose seq happens to collide are not taken for acks.
+	 * Peers which do not number their messages match by type only.
+	 */
+	list_for_each_entry(req, &nlsock->pending, list) {
+		if (req->rsp_type != nlh->nlmsg_type)
+			continue;
+		if (!nlh->nlmsg_seq || req->seq == nlh->nlmsg_seq) {
+			match = req;
+			break;
+		}
+	}
+
+	if (match) {
+		list_del(&match->list);
+		nlsock->nr_pending--;
+	}
+	pthread_mutex_unlock(&nlsock->pending_lock);
+
+	if (!match)
+		return 0;
+
+	match->done(nlsock, nlh, match->priv);
+	free(match);
+
+	pthread_mutex_lock(&nlsock->pending_lock);
+	pthread_cond_broadcast(&nlsock->pending_cond);
+	pthread_mutex_unlock(&nlsock->pending_lock);
+	return 1;
+}
+
+/**
+ * nl_async_cancel() - drop all pending requests
+ * @nlsock:	netlink socket
+ *
+ * Threads waiting in nl_async_wait() for the reader fail with
+ * -ECANCELED.
+ */
+void nl_async_cancel(struct nl_sock *nlsock)
+{
+	struct nl_pending *req;
+	struct list_head *tmp, *t;
+	struct list_head cancelled;
+
+	INIT_LIST_HEAD(&cancelled);
+	pthread_mutex_lock(&nlsock->pending_lock);
+	list_splice_init(&nlsock->pending, &cancelled);
+	nlsock->nr_pending = 0;
+	pthread_mutex_unlock(&nlsock->pending_lock);
+
+	list_for_each_safe(tmp, t, &cancelled) {
+		req = list_entry(tmp, struct nl_pending, list);
+		list_del(&req->list);
+		req->done(nlsock, NULL, req->priv);
+		free(req);
+	}
+
+	pthread_mutex_lock(&nlsock->pending_lock);
+	nlsock->nr_cancels++;
+	pthread_cond_broadcast(&nlsock->pending_cond);
+	pthread_mutex_unlock(&nlsock->pending_lock);
+}
+
+int nl_handle_init_cifsd(struct nl_sock *nlsock)
+{
+	struct cifsd_uevent ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = CIFSD_UEVENT_INIT_CONNECTION;
+	ev.u.i_conn.caps = CIFSD_CAPS;
+
+	return cifsd_common_sendmsg(nlsock, &ev, NULL, 0);
+}
+
+int nl_handle_exit_cifsd(struct nl_sock *nlsock)
+{
+	struct cifsd_uevent ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = CIFSD_UEVENT_EXIT_CONNECTION;
+
+	return cifsd_common_sendmsg(nlsock, &ev, NULL, 0);
+}
+
+int nl_handle_init_cifsadmin(struct nl_sock *nlsock)
+{
+	struct cifsd_uevent ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = CIFSADMIN_UEVENT_INIT_CONNECTION;
+	ev.u.i_conn.caps = CIFSD_CAPS;
+
+	return cifsd_common_sendmsg(nlsock, &ev, NULL, 0);
+}
+
+int nl_handle_init_cifsstat(struct nl_sock *nlsock)
+{
+	struct cifsd_uevent ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = CIFSSTAT_UEVENT_INIT_CONNECTION;
+	ev.u.i_conn.caps = CIFSD_CAPS;
+	return cifsd_common_sendmsg(nlsock, &ev, NULL, 0);
+}
+
+static int nl_setbuf(int fd, int force_opt, int opt, unsigned int size)
+{
+	int val = size;
+	socklen_t len = sizeof(val);
+
+	/* *BUFFORCE ignores rmem_max/wmem_max, but needs CAP_NET_ADMIN */
+	if (setsockopt(fd, SOL_SOCKET, force_opt, &val, sizeof(val)) &&
+	    setsockopt(fd, SOL_SOCKET, opt, &val, sizeof(val)))
+		return -1;
+
+	if (getsockopt(fd, SOL_SOCKET, opt, &val, &len))
+		return -1;
+	return val;
+}
+
+/**
+ * nl_set_bufsize() - set socket buffer sizes
+ * @nlsock:	netlink socket
+ * @rcvbuf:	receive buffer size, 0 sizes it from observed backlog
+ *		starting at NETLINK_CIFSD_MIN_RCVBUF
+ * @sndbuf:	send buffer size, 0 keeps the system default
+ *
+ * Without CAP_NET_ADMIN the sizes are capped by net.core.rmem_max and
+ * net.core.wmem_max.
+ *
+ * Return:	0 on success, -1 on error
+ */
+int nl_set_bufsize(struct nl_sock *nlsock, unsigned int rcvbuf,
+		unsigned int sndbuf)
+{
+	int ret;
+
+	nlsock->rcvbuf_auto = !rcvbuf;
+	if (!rcvbuf)
+		rcvbuf = NETLINK_CIFSD_MIN_RCVBUF;
+
+	ret = nl_setbuf(nlsock->nlsk_fd, SO_RCVBUFFORCE, SO_RCVBUF, rcvbuf);
+	if (ret < 0) {
+		cifsd_err("failed to set receive buffer %u, errno %d\n",
+				rcvbuf, errno);
+		return -1;
+	}
+	nlsock->rcvbuf = ret;
+	cifsd_debug("receive buffer %d bytes%s\n", ret,
+			nlsock->rcvbuf_auto ? ", autotuned" : "");
+
+	if (!sndbuf)
+		return 0;
+
+	ret = nl_setbuf(nlsock->nlsk_fd, SO_SNDBUFFORCE, SO_SNDBUF, sndbuf);
+	if (ret < 0) {
+		cifsd_err("failed to set send buffer %u, errno %d\n",
+				sndbuf, errno);
+		return -1;
+	}
+	cifsd_debug("send buffer %d bytes\n", ret);
+	return 0;
+}
+
+static void nl_grow_rcvbuf(struct nl_sock *nlsock)
+{
+	unsigned int size = nlsock->rcvbuf * 2;
+	int ret;
+
+	if (nlsock->rcvbuf >= NETLINK_CIFSD_MAX_RCVBUF)
+		return;
+
+	if (size > NETLINK_CIFSD_MAX_RCVBUF)
+		size = NETLINK_CIFSD_MAX_RCVBUF;
+
+	ret = nl_setbuf(nlsock->nlsk_fd, SO_RCVBUFFORCE, SO_RCVBUF, size);
+	if (ret <= (int)nlsock->rcvbuf) {
+		/* capped by rmem_max, stop trying */
+		nlsock->rcvbuf_auto = 0;
+		return;
+	}
+
+	cifsd_info("receive buffer grown to %d bytes\n", ret);
+	nlsock->rcvbuf = ret;
+}
+
+/**
+ * nl_tune() - sample receive backlog and grow receive buffer when it
+ *		gets more than half full
+ * @nlsock:	netlink socket
+ */
+static void nl_tune(struct nl_sock *nlsock)
+{
+	__u32 mem[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(mem);
+
+	if (getsockopt(nlsock->nlsk_fd, SOL_SOCKET, SO_MEMINFO, mem, &len))
+		return;
+
+	if (mem[SK_MEMINFO_RMEM_ALLOC] > nlsock->stats.max_backlog)
+		nlsock->stats.max_backlog = mem[SK_MEMINFO_RMEM_ALLOC];
+
+	if (nlsock->rcvbuf_auto &&
+	    mem[SK_MEMINFO_RMEM_ALLOC] > mem[SK_MEMINFO_RCVBUF] / 2)
+		nl_grow_rcvbuf(nlsock);
+}
+
+/**
+ * nl_overrun() - recover after the kernel dropped events to this socket
+ * @nlsock:	netlink socket
+ *
+ * Lost events may be pipe requests whose clients now wait for a reply,
+ * so the kernel is asked to re-send or fail everything outstanding.
+ * Lost responses would leave pending requests waiting forever, so they
+ * are all cancelled.
+ */
+static void nl_overrun(struct nl_sock *nlsock)
+{
+	struct cifsd_uevent ev;
+
+	nlsock->stats.nr_overruns++;
+	cifsd_err("receive buffer overrun, %u bytes, requesting resync\n",
+			nlsock->rcvbuf);
+
+	if (nlsock->rcvbuf_auto)
+		nl_grow_rcvbuf(nlsock);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = CIFSD_UEVENT_RESYNC;
+	cifsd_common_sendmsg(nlsock, &ev, NULL, 0);
+
+	nl_async_cancel(nlsock);
+}
+
+/**
+ * cifsd_nl_read() - receive one netlink datagram
+ * @nlsock:	netlink socket
+ * @buf:	destination buffer
+ * @buflen:	size of destination buffer
+ * @flags:	recvmsg flags
+ *
+ * The socket is always read with MSG_TRUNC so the return value is the
+ * real length of the datagram, even when it did not fit in @buf.
+ * An overrun is recovered from here and reported with errno ENOBUFS.
+ *
+ * Return:	datagram length on success, -1 on error
+ */
+static int cifsd_nl_read(struct nl_sock *nlsock,
+		char *buf, unsigned int buflen, int flags)
+{
+	int len;
+	struct iovec iov;
+	struct msghdr msg;
+
+	iov.iov_base = buf;
+	iov.iov_len = buflen;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	nlsock->stats.nr_recv_calls++;
+	len = recvmsg(nlsock->nlsk_fd, &msg, flags | MSG_TRUNC);
+	if (len == -1 && errno == ENOBUFS) {
+		nl_overrun(nlsock);
+		errno = ENOBUFS;
+	} else if (len == -1)
+		perror("recvmsg");
+	else if (len == 0) {
+		cifsd_err("connection closed by peer\n");
+		nlsock->nlsk_eof = 1;
+		return -1;
+	}
+	return len;
+}
+
+/**
+ * nl_grow_rcv_buf() - enlarge receive buffer after an oversize datagram
+ * @nlsock:	netlink socket
+ * @len:	length of the datagram which did not fit
+ *
+ * Return:	0 on success, -ENOMEM on error
+ */
+static int nl_grow_rcv_buf(struct nl_sock *nlsock, unsigned int len)
+{
+	char *buf;
+
+	buf = realloc(nlsock->nlsk_rcv_buf, len);
+	if (!buf)
+		return -ENOMEM;
+
+	nlsock->nlsk_rcv_buf = buf;
+	nlsock->nlsk_rcv_len = len;
+	return 0;
+}
+
+static void nl_multi_reset(struct nl_multi *m)
+{
+	free(m->buf);
+	m->buf = NULL;
+	m->len = m->total = 0;
+	m->discard = 0;
+}
+
+/**
+ * nl_reassemble() - collect one fragment of a multipart message
+ * @nlsock:	netlink socket
+ * @nlh:	fragment
+ *
+ * A fragment with a new sequence number starts a new message and drops
+ * an unfinished one. The payload is checked against the length announced
+ * in ev->buflen, so a lost fragment discards the whole message.
+ *
+ * Return:	reassembled message after NLMSG_DONE, NULL otherwise
+ */
+static struct nlmsghdr *nl_reassemble(struct nl_sock *nlsock,
+		struct nlmsghdr *nlh)
+{
+	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
+	struct nl_multi *m = &nlsock->multi;
+	struct nlmsghdr *whole;
+	unsigned int flen;
+	int done = nlh->nlmsg_type == NLMSG_DONE;
+
+	flen = nlh->nlmsg_len - NLMSG_SPACE(sizeof(struct cifsd_uevent));
+	if ((!m->buf && !m->discard) || nlh->nlmsg_seq != m->seq) {
+		if (m->buf)
+			cifsd_err("dropped incomplete multipart event, seq %u\n",
+					m->seq);
+		nl_multi_reset(m);
+		m->seq = nlh->nlmsg_seq;
+		m->total = ev->buflen;
+		if (m->total > NETLINK_CIFSD_MAX_MULTI) {
+			cifsd_err("dropped multipart event %u, length %u\n",
+					ev->type, m->total);
+			nlsock->stats.nr_truncated++;
+			m->discard = 1;
+		} else {
+			m->buf = malloc(NLMSG_SPACE(sizeof(*ev)) + m->total);
+			if (!m->buf) {
+				cifsd_err("no memory for multipart event %u\n",
+						ev->type);
+				m->discard = 1;
+			} else {
+				memcpy(m->buf, nlh, NLMSG_SPACE(sizeof(*ev)));
+			}
+		}
+	}
+
+	if (m->discard)
+		goto out;
 
-	if (dlen) {
-		memcpy(ev->buffer, data, dlen);
-		nlh->nlmsg_len += dlen;
+	if (flen > m->total - m->len) {
+		cifsd_err("multipart event %u overflows %u bytes\n",
+				ev->type, m->total);
+		nl_multi_reset(m);
+		m->discard = 1;
+		goto out;
 	}
 
-	iov.iov_base = (void *)nlh;
-	iov.iov_len = nlh->nlmsg_len;
+	memcpy(m->buf + NLMSG_SPACE(sizeof(*ev)) + m->len,
+			(char *)nlh + NLMSG_SPACE(sizeof(*ev)), flen);
+	m->len += flen;
+	if (!done)
+		return NULL;
 
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_name = (void *)&nlsock->dest_addr;
-	msg.msg_namelen = sizeof(nlsock->dest_addr);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	if (m->len != m->total) {
+		cifsd_err("multipart event %u lost fragments, %u of %u bytes\n",
+				ev->type, m->len, m->total);
+		nl_multi_reset(m);
+		return NULL;
+	}
 
-	len = sendmsg(nlsock->nlsk_fd, &msg, 0);
-	if (len == -1)
-		perror("sendmsg");
-	else if (len != nlh->nlmsg_len)
-		cifsd_err("partial data send, expected %u, actual %u\n",
-				nlh->nlmsg_len, len);
-	return len;
+	whole = (struct nlmsghdr *)m->buf;
+	whole->nlmsg_len = NLMSG_SPACE(sizeof(*ev)) + m->total;
+	whole->nlmsg_type = ev->type;
+	whole->nlmsg_flags = 0;
+	nlsock->stats.nr_multipart++;
+	return whole;
+
+out:
+	if (done)
+		nl_multi_reset(m);
+	return NULL;
 }
 
-int cifsd_common_sendmsg(struct nl_sock *nlsock, struct cifsd_uevent *ev,
-		char *buf, unsigned int buflen)
+/**
+ * nl_input() - handle messages internal to the library
+ * @nlsock:	netlink socket
+ * @nlh:	received message
+ *
+ * Capability replies, fragments of multipart messages and responses to
+ * pending asynchronous requests are consumed here.
+ *
+ * Return:	message to pass to event handler, NULL if it was consumed
+ */
+static struct nlmsghdr *nl_input(struct nl_sock *nlsock,
+		struct nlmsghdr *nlh)
 {
-	int ret;
+	struct cifsd_uevent *ev;
 
-	if (buflen > NETLINK_CIFSD_MAX_PAYLOAD) {
-		cifsd_err("too big(%u) buffer\n", buflen);
-		return -1;
+	if (nlh->nlmsg_flags & NLM_F_MULTI) {
+		nlh = nl_reassemble(nlsock, nlh);
+		if (!nlh)
+			return NULL;
 	}
 
-	ret = cifsd_sendmsg(nlsock, ev, buflen, buf);
-	if (ret < 0)
-		cifsd_err("failed to send event %u\n", ev->type);
+	if (nl_complete(nlsock, nlh)) {
+		nlsock->stats.nr_events++;
+		nlsock->stats.nr_replies++;
+		if ((char *)nlh == nlsock->multi.buf)
+			nl_multi_reset(&nlsock->multi);
+		return NULL;
+	}
+
+	ev = NLMSG_DATA(nlh);
+	if (nlh->nlmsg_type == CIFSD_KEVENT_CAPS) {
+		if (nlsock->caps_frozen) {
+			cifsd_info("late kernel capabilities 0x%x ignored\n",
+					ev->k.caps.caps);
+			return NULL;
+		}
+		nlsock->peer_caps = ev->k.caps.caps;
+		nlsock->caps_known = 1;
+		cifsd_debug("kernel capabilities 0x%x\n", nlsock->peer_caps);
+		return NULL;
+	}
+
+	return nlh;
+}
+
+/**
+ * nl_deliver() - pass a message to event handler
+ * @nlsock:	netlink socket
+ * @nlh:	message, in receive buffer or reassembled
+ *
+ * Return:	event handler return value
+ */
+static int nl_deliver(struct nl_sock *nlsock, struct nlmsghdr *nlh)
+{
+	char *rcv_buf = nlsock->nlsk_rcv_buf;
+	unsigned int rcv_len = nlsock->nlsk_rcv_len;
+	int ret;
+
+	nlsock->stats.nr_events++;
+	nlsock->nlsk_rcv_buf = (char *)nlh;
+	nlsock->nlsk_rcv_len = nlh->nlmsg_len;
+	ret = (int)(nlsock->event_handle_cb)(nlsock);
+	nlsock->nlsk_rcv_buf = rcv_buf;
+	nlsock->nlsk_rcv_len = rcv_len;
 
+	if ((char *)nlh == nlsock->multi.buf)
+		nl_multi_reset(&nlsock->multi);
 	return ret;
 }
 
-int nl_handle_early_init_cifsd(struct nl_sock *nlsock)
+/**
+ * nl_recv_event() - receive a single datagram
+ * @nlsock:	netlink socket
+ * @ret:	event handler return value, if it was called
+ *
+ * Each datagram is read with exactly one recvmsg() call. A datagram
+ * bigger than the receive buffer is reported and dropped, and the buffer
+ * is grown so the next one of that size fits.
+ *
+ * Return:	1 if an event was passed to event handler, 0 if the datagram
+ *		was consumed by the library, -EBADMSG if it was dropped,
+ *		-EIO on receive error
+ */
+static int nl_recv_event(struct nl_sock *nlsock, int *ret)
 {
-	struct cifsd_uevent ev;
+	struct nlmsghdr *nlh;
+	int len;
 
-	memset(&ev, 0, sizeof(ev));
-	ev.type = CIFSD_KEVENT_EARLY_INIT;
+	len = cifsd_nl_read(nlsock, nlsock->nlsk_rcv_buf,
+			nlsock->nlsk_rcv_len, 0);
+	if (len < 0)
+		return errno == ENOBUFS ? -EBADMSG : -EIO;
 
-	return cifsd_common_sendmsg(nlsock, &ev, NULL, 0);
+	if (len > nlsock->nlsk_rcv_len) {
+		nlsock->stats.nr_truncated++;
+		cifsd_err("dropped oversize event, length %d, buffer %u\n",
+				len, nlsock->nlsk_rcv_len);
+		nl_grow_rcv_buf(nlsock, len);
+		return -EBADMSG;
+	}
+
+	nlh = (struct nlmsghdr *)nlsock->nlsk_rcv_buf;
+	if (len < NLMSG_SPACE(sizeof(struct cifsd_uevent)) ||
+			nlh->nlmsg_len <
+				NLMSG_SPACE(sizeof(struct cifsd_uevent)) ||
+			nlh->nlmsg_len > len) {
+		cifsd_err("malformed event, length %d, nlmsg_len %u\n",
+				len, nlh->nlmsg_len);
+		return -EBADMSG;
+	}
+
+	nlh = nl_input(nlsock, nlh);
+	if (!nlh)
+		return 0;
+
+	*ret = nl_deliver(nlsock, nlh);
+	return 1;
 }
 
-int nl_handle_init_cifsd(struct nl_sock *nlsock)
+/**
+ * nl_handle_event() - receive a single event and pass it to event handler
+ * @nlsock:	netlink socket
+ *
+ * Blocks until an event is passed to event handler; capability replies
+ * and fragments of multipart messages are consumed on the way.
+ *
+ * Return:	event handler return value, -1 on receive error
+ */
+int nl_handle_event(struct nl_sock *nlsock)
 {
-	struct cifsd_uevent ev;
+	int ret = 0;
+	int delivered;
 
-	memset(&ev, 0, sizeof(ev));
-	ev.type = CIFSD_UEVENT_INIT_CONNECTION;
+	do {
+		delivered = nl_recv_event(nlsock, &ret);
+	} while (!delivered);
 
-	return cifsd_common_sendmsg(nlsock, &ev, NULL, 0);
+	return delivered < 0 ? -1 : ret;
 }
 
-int nl_handle_exit_cifsd(struct nl_sock *nlsock)
+static unsigned long long nl_now_ms(void)
 {
-	struct cifsd_uevent ev;
+	struct timespec ts;
 
-	memset(&ev, 0, sizeof(ev));
-	ev.type = CIFSD_UEVENT_EXIT_CONNECTION;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
 
-	return cifsd_common_sendmsg(nlsock, &ev, NULL, 0);
+/**
+ * nl_poll() - wait for the socket to become readable
+ * @nlsock:	netlink socket
+ * @deadline:	monotonic time in ms to give up at
+ *
+ * Return:	1 if readable, 0 once @deadline passed, -EIO on error
+ */
+static int nl_poll(struct nl_sock *nlsock, unsigned long long deadline)
+{
+	struct pollfd pfd;
+	unsigned long long now;
+	int ret;
+
+	pfd.fd = nlsock->nlsk_fd;
+	pfd.events = POLLIN;
+	do {
+		now = nl_now_ms();
+		if (now >= deadline)
+			return 0;
+		ret = poll(&pfd, 1, deadline - now);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		perror("poll");
+		return -EIO;
+	}
+	return ret ? 1 : 0;
 }
 
-int nl_handle_init_cifsadmin(struct nl_sock *nlsock)
+/**
+ * nl_async_wait_reader() - wait for responses read by the writer thread
+ * @nlsock:	netlink socket
+ * @max_inflight:	number of requests allowed to stay pending
+ *
+ * Return:	0 on success, -ETIMEDOUT on timeout, -ECANCELED if the
+ *		pending requests were cancelled meanwhile
+ */
+static int nl_async_wait_reader(struct nl_sock *nlsock,
+		unsigned int max_inflight)
 {
-	struct cifsd_uevent ev;
+	unsigned long long deadline;
+	unsigned int nr_pending;
+	unsigned long cancels;
+	struct timespec ts;
+	int ret = 0;
 
-	memset(&ev, 0, sizeof(ev));
-	ev.type = CIFSADMIN_UEVENT_INIT_CONNECTION;
+	pthread_mutex_lock(&nlsock->pending_lock);
+	nr_pending = nlsock->nr_pending;
+	cancels = nlsock->nr_cancels;
+	deadline = nl_now_ms() + NETLINK_CIFSD_ASYNC_TIMEOUT_MS;
+	while (nlsock->nr_pending > max_inflight) {
+		if (nlsock->nr_cancels != cancels) {
+			ret = -ECANCELED;
+			break;
+		}
+		if (nlsock->nr_pending < nr_pending) {
+			nr_pending = nlsock->nr_pending;
+			deadline = nl_now_ms() + NETLINK_CIFSD_ASYNC_TIMEOUT_MS;
+		}
 
-	return cifsd_common_sendmsg(nlsock, &ev, NULL, 0);
+		ts.tv_sec = deadline / 1000;
+		ts.tv_nsec = deadline % 1000 * 1000000;
+		if (pthread_cond_timedwait(&nlsock->pending_cond,
+				&nlsock->pending_lock, &ts) == ETIMEDOUT &&
+		    nlsock->nr_pending >= nr_pending) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+	}
+	if (nlsock->nr_cancels != cancels)
+		ret = -ECANCELED;
+	pthread_mutex_unlock(&nlsock->pending_lock);
+
+	if (ret == -ETIMEDOUT) {
+		cifsd_err("%u requests got no response in %ums\n",
+				nr_pending, NETLINK_CIFSD_ASYNC_TIMEOUT_MS);
+		nl_async_cancel(nlsock);
+	}
+	return ret;
 }
 
-int nl_handle_init_cifsstat(struct nl_sock *nlsock)
+/**
+ * nl_async_wait() - handle incoming events until at most @max_inflight
+ *		requests sent with nl_async_send() are pending
+ * @nlsock:	netlink socket
+ * @max_inflight:	number of requests allowed to stay pending,
+ *		0 waits for all responses
+ *
+ * Events which are not responses to pending requests are passed to
+ * event handler as usual. Once a writer thread is set, other threads
+ * leave reading to it and sleep until their requests complete. The wait
+ * gives up when no pending request completes for
+ * NETLINK_CIFSD_ASYNC_TIMEOUT_MS, and fails when the kernel dropped
+ * events meanwhile; all pending requests are cancelled in both cases.
+ *
+ * Return:	0 on success, -ETIMEDOUT on timeout, -ENOBUFS after an
+ *		overrun, -ECANCELED if cancelled by the reader, -EIO on
+ *		receive error
+ */
+int nl_async_wait(struct nl_sock *nlsock, unsigned int max_inflight)
 {
-	struct cifsd_uevent ev;
+	unsigned long overruns = nlsock->stats.nr_overruns;
+	unsigned int nr_pending;
+	unsigned long long deadline;
+	int ret;
 
-	memset(&ev, 0, sizeof(ev));
-	ev.type = CIFSSTAT_UEVENT_INIT_CONNECTION;
-	return cifsd_common_sendmsg(nlsock, &ev, NULL, 0);
+	if (nlsock->txq &&
+	    !pthread_equal(pthread_self(), nlsock->txq->writer))
+		return nl_async_wait_reader(nlsock, max_inflight);
+
+	nr_pending = nlsock->nr_pending;
+
+	deadline = nl_now_ms() + NETLINK_CIFSD_ASYNC_TIMEOUT_MS;
+	while (nlsock->nr_pending > max_inflight) {
+		if (nlsock->nr_pending < nr_pending) {
+			nr_pending = nlsock->nr_pending;
+			deadline = nl_now_ms() + NETLINK_CIFSD_ASYNC_TIMEOUT_MS;
+		}
+
+		ret = nl_poll(nlsock, deadline);
+		if (ret < 0)
+			return -EIO;
+		if (!ret) {
+			cifsd_err("%u requests got no response in %ums\n",
+					nlsock->nr_pending,
+					NETLINK_CIFSD_ASYNC_TIMEOUT_MS);
+			nl_async_cancel(nlsock);
+			return -ETIMEDOUT;
+		}
+
+		if (nl_recv_event(nlsock, &ret) == -EIO)
+			return -EIO;
+		if (nlsock->stats.nr_overruns != overruns)
+			return -ENOBUFS;
+	}
+
+	return 0;
 }
 
-static int cifsd_nl_read(struct nl_sock *nlsock,
-		char *buf, unsigned int buflen, int flags)
+/**
+ * nl_handle_early_init_cifsd() - announce cifsd to the kernel
+ * @nlsock:	netlink socket
+ *
+ * The kernel answers with CIFSD_KEVENT_CAPS, older modules never do.
+ * Nothing waits for it here: it precedes the reply to any request sent
+ * after early init, config_users() relies on that.
+ *
+ * Return:	0 on success, -1 on error
+ */
+int nl_handle_early_init_cifsd(struct nl_sock *nlsock)
 {
-	int len;
-	struct iovec iov;
-	struct msghdr msg;
+	struct cifsd_uevent ev;
 
-	iov.iov_base = buf;
-	iov.iov_len = buflen;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = CIFSD_KEVENT_EARLY_INIT;
+	ev.u.i_conn.caps = CIFSD_CAPS;
 
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_name = (void *)&nlsock->src_addr;
-	msg.msg_namelen = sizeof(nlsock->src_addr);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	nlsock->caps_known = 0;
+	nlsock->caps_frozen = 0;
+	if (cifsd_common_sendmsg(nlsock, &ev, NULL, 0) < 0)
+		return -1;
+	return 0;
+}
 
-	len = recvmsg(nlsock->nlsk_fd, &msg, flags);
-	if (len == -1)
-		perror("recvmsg");
-	else if (len != buflen)
-		cifsd_err("partial data read, expected %u, actual %u\n",
-				buflen, len);
-	return len;
+/**
+ * nl_freeze_caps() - stop taking capabilities from the kernel
+ * @nlsock:	netlink socket
+ *
+ * Config pushes are shaped by peer_caps, a CIFSD_KEVENT_CAPS arriving
+ * after this point is ignored so that it cannot change them halfway.
+ */
+void nl_freeze_caps(struct nl_sock *nlsock)
+{
+	nlsock->caps_frozen = 1;
 }
 
-int nl_handle_event(struct nl_sock *nlsock)
+/**
+ * nl_handle_batch() - receive up to batch size events with one recvmmsg()
+ *		and pass each of them to event handler
+ * @nlsock:	netlink socket
+ *
+ * Responses sent by the event handler while the batch is dispatched are
+ * queued and flushed together with a single sendmmsg() call.
+ *
+ * Return:	number of received events, -1 on receive error
+ */
+int nl_handle_batch(struct nl_sock *nlsock)
 {
-	int len;
-	struct cifsd_uevent *ev;
+	struct nl_batch *batch = nlsock->batch;
 	struct nlmsghdr *nlh;
+	unsigned int len;
+	int i, nr;
 
-	len = cifsd_nl_read(nlsock, nlsock->nlsk_rcv_buf,
-			NLMSG_SPACE(sizeof(struct cifsd_uevent)),
-			MSG_PEEK);
-	if (len != NLMSG_SPACE(sizeof(struct cifsd_uevent)))
+	nlsock->stats.nr_recv_calls++;
+	nr = recvmmsg(nlsock->nlsk_fd, batch->rcv_msgs, batch->size,
+			MSG_WAITFORONE | MSG_TRUNC, NULL);
+	if (nr == -1) {
+		if (errno == ENOBUFS)
+			nl_overrun(nlsock);
+		else
+			perror("recvmmsg");
 		return -1;
-	nlh = (struct nlmsghdr *)nlsock->nlsk_rcv_buf;
-	ev = (struct cifsd_uevent *)NLMSG_DATA(nlsock->nlsk_rcv_buf);
-	if (len != nlh->nlmsg_len && ev->buflen) {
-		len = cifsd_nl_read(nlsock, nlsock->nlsk_rcv_buf,
-					nlh->nlmsg_len, MSG_PEEK);
-		if (len != nlh->nlmsg_len)
-			return -1;
 	}
 
-	len = cifsd_nl_read(nlsock, nlsock->nlsk_rcv_buf, nlh->nlmsg_len, 0);
-	if (len != nlh->nlmsg_len) {
-		cifsd_err("failed to remove data\n");
-		return -1;
+	nlsock->stats.nr_batches++;
+	batch->collecting = 1;
+	for (i = 0; i < nr; i++) {
+		len = batch->rcv_msgs[i].msg_len;
+		nlh = (struct nlmsghdr *)(batch->rcv_bufs +
+				i * NETLINK_CIFSD_MAX_BUF);
+
+		if (!len) {
+			cifsd_err("connection closed by peer\n");
+			nlsock->nlsk_eof = 1;
+			break;
+		}
+
+		if (len > NETLINK_CIFSD_MAX_BUF) {
+			nlsock->stats.nr_truncated++;
+			cifsd_err("dropped oversize event, length %u\n", len);
+			continue;
+		}
+
+		if (len < NLMSG_SPACE(sizeof(struct cifsd_uevent)) ||
+				nlh->nlmsg_len <
+					NLMSG_SPACE(sizeof(struct cifsd_uevent)) ||
+				nlh->nlmsg_len > len) {
+			cifsd_err("malformed event, length %u, nlmsg_len %u\n",
+					len, nlh->nlmsg_len);
+			continue;
+		}
+
+		nlh = nl_input(nlsock, nlh);
+		if (nlh)
+			nl_deliver(nlsock, nlh);
 	}
+	batch->collecting = 0;
 
-	return (int)(nlsock->event_handle_cb)(nlsock);
+	nl_flush_batch(nlsock);
+	return nr;
 }
 
-struct nl_sock *nl_init()
+static void nl_free_batch(struct nl_batch *batch)
 {
-	struct nl_sock *nlsock;
+	if (!batch)
+		return;
 
-	nlsock = malloc(sizeof(struct nl_sock));
-	nlsock->nlsk_rcv_buf = malloc(NETLINK_CIFSD_MAX_BUF);
-	if (!nlsock->nlsk_rcv_buf) {
-		perror("can't alloc netlink buffer\n");
-		return NULL;
+	free(batch->rcv_msgs);
+	free(batch->rcv_iov);
+	free(batch->rcv_bufs);
+	free(batch->snd_msgs);
+	free(batch->snd_iov);
+	free(batch->snd_bufs);
+	free(batch);
+}
+
+/**
+ * nl_set_batch() - set maximum number of events handled per wakeup
+ * @nlsock:	netlink socket
+ * @size:	events per batch, 0 or 1 disables batching
+ *
+ * Return:	0 on success, -ENOMEM on error
+ */
+int nl_set_batch(struct nl_sock *nlsock, unsigned int size)
+{
+	struct nl_batch *batch;
+	unsigned int i;
+
+	nl_free_batch(nlsock->batch);
+	nlsock->batch = NULL;
+	if (size <= 1)
+		return 0;
+
+	if (size > NETLINK_CIFSD_MAX_BATCH)
+		size = NETLINK_CIFSD_MAX_BATCH;
+
+	batch = calloc(1, sizeof(struct nl_batch));
+	if (!batch)
+		return -ENOMEM;
+
+	batch->size = size;
+	batch->rcv_msgs = calloc(size, sizeof(struct mmsghdr));
+	batch->rcv_iov = calloc(size, sizeof(struct iovec));
+	batch->rcv_bufs = malloc(size * NETLINK_CIFSD_MAX_BUF);
+	batch->snd_msgs = calloc(size, sizeof(struct mmsghdr));
+	batch->snd_iov = calloc(size, sizeof(struct iovec));
+	batch->snd_bufs = malloc(size * NETLINK_CIFSD_MAX_BUF);
+	if (!batch->rcv_msgs || !batch->rcv_iov || !batch->rcv_bufs ||
+	    !batch->snd_msgs || !batch->snd_iov || !batch->snd_bufs) {
+		nl_free_batch(batch);
+		return -ENOMEM;
 	}
 
-	nlsock->nlsk_send_buf = malloc(NETLINK_CIFSD_MAX_BUF);
-	if (!nlsock->nlsk_send_buf) {
-		perror("can't alloc netlink buffer\n");
-		goto free_rcv_buf;
+	for (i = 0; i < size; i++) {
+		batch->rcv_iov[i].iov_base =
+			batch->rcv_bufs + i * NETLINK_CIFSD_MAX_BUF;
+		batch->rcv_iov[i].iov_len = NETLINK_CIFSD_MAX_BUF;
+		batch->rcv_msgs[i].msg_hdr.msg_iov = &batch->rcv_iov[i];
+		batch->rcv_msgs[i].msg_hdr.msg_iovlen = 1;
+
+		batch->snd_iov[i].iov_base =
+			batch->snd_bufs + i * NETLINK_CIFSD_MAX_BUF;
+		batch->snd_msgs[i].msg_hdr.msg_name = nlsock->nlsk_dest;
+		batch->snd_msgs[i].msg_hdr.msg_namelen = nlsock->nlsk_destlen;
+		batch->snd_msgs[i].msg_hdr.msg_iov = &batch->snd_iov[i];
+		batch->snd_msgs[i].msg_hdr.msg_iovlen = 1;
 	}
 
+	nlsock->batch = batch;
+	return 0;
+}
+
+static int nl_netlink_open(struct nl_sock *nlsock, const char *arg)
+{
 	nlsock->nlsk_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_CIFSD);
 	if (nlsock->nlsk_fd < 0) {
 		perror("Failed to create netlink socket\n");
-		goto free_send_buf;
+		return -1;
 	}
 
 	memset(&nlsock->src_addr, 0, sizeof(nlsock->src_addr));
@@ -219,41 +1524,228 @@ struct nl_sock *nl_init()
 	if (bind(nlsock->nlsk_fd, (struct sockaddr *)&nlsock->src_addr,
 		sizeof(nlsock->src_addr))) {
 		perror("Failed to bind netlink socket\n");
-		goto close_sock;
+		close(nlsock->nlsk_fd);
+		return -1;
 	}
 
 	memset(&nlsock->dest_addr, 0, sizeof(nlsock->dest_addr));
 	nlsock->dest_addr.nl_family = AF_NETLINK;
 	nlsock->dest_addr.nl_pid = 0; /* kernel */
+	nlsock->nlsk_dest = (struct sockaddr *)&nlsock->dest_addr;
+	nlsock->nlsk_destlen = sizeof(nlsock->dest_addr);
+	return 0;
+}
+
+/*
+ * SOCK_SEQPACKET keeps message boundaries, so the peer exchanges the
+ * same nlmsghdr + cifsd_uevent frames as the kernel does on netlink.
+ */
+static int nl_unix_open(struct nl_sock *nlsock, const char *path)
+{
+	struct sockaddr_un addr;
+
+	if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+		cifsd_err("invalid unix transport path\n");
+		return -1;
+	}
+
+	nlsock->nlsk_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (nlsock->nlsk_fd < 0) {
+		perror("Failed to create unix socket\n");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(nlsock->nlsk_fd, (struct sockaddr *)&addr,
+				sizeof(addr))) {
+		cifsd_err("Failed to connect to %s, errno %d\n", path, errno);
+		close(nlsock->nlsk_fd);
+		return -1;
+	}
+
+	/* connected socket, no destination address on send */
+	nlsock->nlsk_dest = NULL;
+	nlsock->nlsk_destlen = 0;
+	return 0;
+}
+
+static const struct nl_transport nl_transports[] = {
+	{ "netlink",	nl_netlink_open },
+	{ "unix",	nl_unix_open },
+};
+
+/**
+ * nl_find_transport() - parse transport specification
+ * @spec:	"<name>" or "<name>:<argument>", NULL selects netlink
+ * @arg:	set to the argument part of @spec
+ *
+ * Return:	transport on success, NULL if unknown
+ */
+static const struct nl_transport *nl_find_transport(const char *spec,
+		const char **arg)
+{
+	size_t len;
+	int i;
+
+	*arg = NULL;
+	if (!spec || !*spec)
+		return &nl_transports[0];
+
+	len = strcspn(spec, ":");
+	if (spec[len] == ':')
+		*arg = spec + len + 1;
+
+	for (i = 0; i < sizeof(nl_transports) / sizeof(nl_transports[0]);
+			i++) {
+		if (strlen(nl_transports[i].name) == len &&
+		    !strncmp(nl_transports[i].name, spec, len))
+			return &nl_transports[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * nl_init() - open the connection to cifsd kernel module
+ *
+ * The transport is netlink unless CIFSD_TRANSPORT environment variable
+ * selects another one, e.g. "unix:/run/cifsd.sock" connects to a
+ * userspace process playing the kernel side.
+ *
+ * Return:	socket on success, NULL on error
+ */
+struct nl_sock *nl_init()
+{
+	struct nl_sock *nlsock;
+	pthread_condattr_t attr;
+	const char *arg;
+	socklen_t len;
+	int rcvbuf;
+
+	nlsock = calloc(1, sizeof(struct nl_sock));
+	if (!nlsock) {
+		perror("can't alloc netlink socket\n");
+		return NULL;
+	}
+
+	nlsock->transport = nl_find_transport(getenv(CIFSD_TRANSPORT_ENV),
+			&arg);
+	if (!nlsock->transport) {
+		cifsd_err("unknown transport %s\n",
+				getenv(CIFSD_TRANSPORT_ENV));
+		goto free_sock;
+	}
+
+	INIT_LIST_HEAD(&nlsock->pending);
+	nlsock->nlsk_rcv_len = NETLINK_CIFSD_MAX_BUF;
+	nlsock->nlsk_rcv_buf = malloc(nlsock->nlsk_rcv_len);
+	if (!nlsock->nlsk_rcv_buf) {
+		perror("can't alloc netlink buffer\n");
+		goto free_sock;
+	}
+
+	if (nlsock->transport->open(nlsock, arg))
+		goto free_rcv_buf;
+
+	len = sizeof(rcvbuf);
+	if (!getsockopt(nlsock->nlsk_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+				&len))
+		nlsock->rcvbuf = rcvbuf;
+
+	pthread_mutex_init(&nlsock->pending_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&nlsock->pending_cond, &attr);
+	pthread_condattr_destroy(&attr);
 	return nlsock;
 
-close_sock:
-	close(nlsock->nlsk_fd);
-free_send_buf:
-	free(nlsock->nlsk_send_buf);
 free_rcv_buf:
 	free(nlsock->nlsk_rcv_buf);
+free_sock:
+	free(nlsock);
 	return NULL;
 }
 
-void nl_loop(struct nl_sock *nlsock)
+static void nl_event_cb(struct evloop *loop, int fd, unsigned int events,
+		void *data)
 {
-	fd_set readfds;
-	int ret;
+	struct nl_sock *nlsock = (struct nl_sock *)data;
+	int ret, full = 0;
 
-	for (;;) {
-		/* add cifsd netlink socket fd to read fd list*/
-		FD_ZERO(&readfds);
-		FD_SET(nlsock->nlsk_fd, &readfds);
+	/* a pending socket error, like an overrun, is reported by reading */
+	if (events & (EPOLLIN | EPOLLERR)) {
+		if (nlsock->batch)
+			full = nl_handle_batch(nlsock) == nlsock->batch->size;
+		else
+			nl_recv_event(nlsock, &ret);
+	} else if (events & EPOLLHUP) {
+		nlsock->nlsk_eof = 1;
+	}
 
-		ret = select(nlsock->nlsk_fd + 1, &readfds, NULL, NULL, NULL);
-		if (ret == -1) {
-			perror("select");
-		} else {
-			if (FD_ISSET(nlsock->nlsk_fd, &readfds))
-				nl_handle_event(nlsock);
-		}
+	/* a full batch means more events were waiting: check the backlog */
+	if (full || !(++nlsock->nr_wakeups % NL_TUNE_INTERVAL))
+		nl_tune(nlsock);
+
+	if (nlsock->nlsk_eof)
+		evloop_stop(loop);
+}
+
+/**
+ * nl_loop() - handle netlink events from an event loop until it is stopped
+ * @nlsock:	netlink socket
+ * @loop:	event loop, other sources may already be registered on it
+ *
+ * Return:	0 when the loop is stopped, -1 on error
+ */
+int nl_loop(struct nl_sock *nlsock, struct evloop *loop)
+{
+	int ret;
+
+	if (evloop_add_fd(loop, nlsock->nlsk_fd, EPOLLIN, nl_event_cb,
+				nlsock)) {
+		cifsd_err("failed to add netlink socket to event loop\n");
+		return -1;
 	}
+
+	ret = evloop_run(loop);
+	evloop_del_fd(loop, nlsock->nlsk_fd);
+	return ret;
+}
+
+/**
+ * nl_dump_stats() - print syscall counters of netlink socket
+ * @nlsock:	netlink socket
+ */
+void nl_dump_stats(struct nl_sock *nlsock)
+{
+	struct nl_stats *st = &nlsock->stats;
+	unsigned long per_event = 0;
+	unsigned long depth = 0;
+
+	if (st->nr_events)
+		per_event = st->nr_recv_calls * 100 / st->nr_events;
+	if (st->nr_batches)
+		depth = st->nr_events * 100 / st->nr_batches;
+
+	cifsd_info("netlink: %lu events, %lu recv calls (%lu.%02lu per event), "
+			"%lu send calls, %lu oversize\n",
+			st->nr_events, st->nr_recv_calls,
+			per_event / 100, per_event % 100,
+			st->nr_send_calls, st->nr_truncated);
+	if (st->nr_replies)
+		cifsd_info("netlink: %lu responses to requests\n",
+				st->nr_replies);
+	if (st->nr_multipart)
+		cifsd_info("netlink: %lu multipart events\n",
+				st->nr_multipart);
+	cifsd_info("netlink: receive buffer %u, peak backlog %lu, "
+			"%lu overruns\n", nlsock->rcvbuf, st->max_backlog,
+			st->nr_overruns);
+	if (st->nr_batches)
+		cifsd_info("netlink: %lu batches, average depth %lu.%02lu\n",
+				st->nr_batches, depth / 100, depth % 100);
 }
 
 int nl_exit(struct nl_sock *nlsock)
@@ -261,11 +1753,14 @@ int nl_exit(struct nl_sock *nlsock)
 	if (nlsock->nlsk_fd >= 0)
 		close(nlsock->nlsk_fd);
 
-	if (nlsock->nlsk_send_buf)
-		free(nlsock->nlsk_send_buf);
-
 	if (nlsock->nlsk_rcv_buf)
 		free(nlsock->nlsk_rcv_buf);
+
+	nl_async_cancel(nlsock);
+	pthread_cond_destroy(&nlsock->pending_cond);
+	pthread_mutex_destroy(&nlsock->pending_lock);
+	nl_free_batch(nlsock->batch);
+	nl_multi_reset(&nlsock->multi);
 	return 0;
 
 }